@@ -10,6 +10,14 @@ typedef enum {
 	TDM_PLAY,
 	TDM_LOOP,
 	TDM_SELECT,
+	TDM_FASTER,
+	TDM_SLOWER,
+	TDM_NEXT,
+	TDM_PREV,
+	TDM_BIND,
+	TDM_FLUSH,
+	TDM_STATS,
+	TDM_ARM,
 	MACRO_RANGE_START
 } custom_keycodes;
 
@@ -0,0 +1,136 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file tdm_container.h
+ * @brief Macro container, the file format shared by the firmware and tools/tdm_container.py.
+ *
+ * A container is a flat image of recorded macros, made to be used where it
+ * lies: memory-mapped flash on the keyboard (TDM_CONTAINER) or mmap on a host.
+ * Everything is little-endian, and every field is aligned to its size from
+ * the start of the image, which is itself 4-byte aligned, so the structs
+ * below are read in place without copying.
+ *
+ *   tdm_container_header_t
+ *   tdm_container_slot_t  x slot_count, sorted by slot, no slot twice
+ *   each slot's macro at its offset: length events, tdm_container_program_t and
+ *   length bytes of bytecode, or tdm_container_lz_t and the compressed events
+ *
+ * Events are the entries the firmware records: time_ms is when the event
+ * plays, from the start of the macro, and never goes down within a macro.
+ * flags holds FLAG_pressed (bit 0) and the event kind (bits 1-3, EVENT_* in
+ * temporal_dynamic_macro.c), the other bits are 0. A run event is played
+ * repeat more times, interval ms apart.
+ *
+ * Bytecode (TDM_BYTECODE) is a program of one-byte opcodes, each followed by
+ * its operands, little-endian too (see the opcodes below). Blocks of REPEAT
+ * and NEXT nest, and the program ends with the END at depth 0, its last byte.
+ * tools/tdm_compile.py compiles it from text, and works out how long one run
+ * lasts and how many instructions it takes. The firmware stops a program after
+ * TDM_VM_STEPS instructions, or where its repeats and calls nest deeper than
+ * TDM_VM_DEPTH, which the tools refuse.
+ *
+ * Compressed macros (TDM_LZ) hold length events, delta coded (time_ms is the
+ * time since the event before) and then LZ coded: each token byte is either a
+ * literal run, token + 1 bytes copied from the stream, or with TDM_LZ_MATCH set
+ * a match, (token & 0x7F) + TDM_LZ_MIN_MATCH bytes copied from distance + 1
+ * bytes back in the output, distance being the next byte. Matches may overlap
+ * what they produce, and never reach before the start of the macro.
+ *
+ * The CRC (CRC-16/CCITT, initial value 0xFFFF) covers every byte after the
+ * header, up to size. Any change to the layout bumps TDM_CONTAINER_VERSION,
+ * readers only accept the version they know.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define TDM_CONTAINER_MAGIC 0x434D4454 // "TDMC"
+#define TDM_CONTAINER_VERSION 3
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_count;
+	uint32_t size; //of the whole image, in bytes
+	uint16_t event_size; //sizeof(tdm_container_event_t), a check against a mismatched build
+	uint16_t crc;
+} tdm_container_header_t;
+
+typedef struct {
+	uint16_t slot; //the macro slot it plays from
+	uint16_t length; //in events, or bytes of bytecode
+	uint32_t offset; //of the macro, in bytes from the start of the image
+	uint16_t loop_gap_ms; //timing of the macro like tdm_macro_config_t, 0 keeps the keyboard's
+	uint8_t debounce_ms;
+	uint8_t time_scale;
+	uint8_t kind; //TDM_CONTAINER_EVENTS, TDM_CONTAINER_BYTECODE or TDM_CONTAINER_LZ
+	uint8_t reserved[3];
+} tdm_container_slot_t;
+#define TDM_CONTAINER_EVENTS 0
+#define TDM_CONTAINER_BYTECODE 1
+#define TDM_CONTAINER_LZ 2
+
+typedef struct {
+	uint32_t duration_ms; //of one run, repeats and calls included, so playing it doesn't need a dry run
+} tdm_container_program_t;
+#define TDM_VM_DEPTH 8 //nested repeats and calls
+#define TDM_VM_STEPS 0xFFFF //instructions of one run
+
+typedef struct {
+	uint32_t packed; //bytes of tokens that follow
+	uint32_t duration_ms; //when the last event's run ends, so playing it doesn't need to decode it all
+} tdm_container_lz_t;
+#define TDM_LZ_MATCH 0x80
+#define TDM_LZ_MIN_MATCH 3
+#define TDM_LZ_WINDOW 256 //the farthest a match reaches back
+
+typedef struct {
+	uint16_t keycode; //keycode, or the packed payload of a non-key event
+	uint16_t reserved;
+	uint32_t time_ms;
+	uint8_t flags;
+	uint8_t repeat;
+	uint8_t interval;
+	uint8_t reserved2;
+} tdm_container_event_t;
+
+/* Opcodes, with their operands. Keycodes are one byte for basic ones, two
+ * for the rest (chords like LCTL(KC_C) included). A TAP presses and releases
+ * right away. MODS sets the modifiers the macro holds to exactly these.
+ * Waits move the program's clock, everything between two waits plays at once.
+ */
+enum {
+	TDM_OP_END = 0x00, //returns from a CALL, or ends the macro
+	TDM_OP_PRESS, //keycode8
+	TDM_OP_RELEASE, //keycode8
+	TDM_OP_TAP, //keycode8
+	TDM_OP_PRESS16, //keycode16
+	TDM_OP_RELEASE16, //keycode16
+	TDM_OP_TAP16, //keycode16
+	TDM_OP_MODS, //mods8
+	TDM_OP_WAIT16, //ms16
+	TDM_OP_REPEAT, //count8 (1-255), runs the block up to its NEXT that many times
+	TDM_OP_NEXT,
+	TDM_OP_CALL, //slot16, plays the bytecode macro of that slot of the image, then goes on
+	TDM_OP_WAIT = 0x80, //| ms (1-127), short waits in a single byte
+};
+#define TDM_OP_LAST TDM_OP_CALL
+#define TDM_OP_OPERANDS(op) (((op) & TDM_OP_WAIT) || (op) == TDM_OP_END || (op) == TDM_OP_NEXT ? 0 : \
+		((op) >= TDM_OP_PRESS16 && (op) <= TDM_OP_TAP16) || (op) == TDM_OP_WAIT16 || (op) == TDM_OP_CALL ? 2 : 1)
+
+_Static_assert(sizeof(tdm_container_header_t) == 16 && sizeof(tdm_container_slot_t) == 16 && sizeof(tdm_container_event_t) == 12 &&
+		sizeof(tdm_container_program_t) == 4 && sizeof(tdm_container_lz_t) == 8,
+		"temporal dynamic macro: the container structs must not have padding");
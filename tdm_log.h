@@ -0,0 +1,184 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file tdm_log.h
+ * @brief Log messages of the temporal dynamic macros.
+ *
+ * Every message has its format defined below as TDM_LOG_FORMAT_<NAME>, is listed
+ * in TDM_LOG_MESSAGES and logged with TDM_LOG(NAME, args...). By default that's
+ * a plain uprintf of the format. With TDM_LOG_BINARY defined, the format
+ * strings stay out of the firmware: a log only sends its message ID and its
+ * arguments as int32 through tdm_log_write(), and
+ * tools/tdm_log_decode.py turns them back into text using this table.
+ *
+ * Frame: 0xFE, message ID, argument count, then each argument little-endian.
+ *
+ * IDs are positions in the list, so only ever add messages at the end, or
+ * decode with the tdm_log.h the firmware was built with. Arguments are
+ * numbers only, there's no %s.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define TDM_LOG_FORMAT_PLAY_USER "playing macro: %d\n"
+#define TDM_LOG_FORMAT_PLAY_STOP_USER "done playing macro: %d\n"
+#define TDM_LOG_FORMAT_SELECTING "selecting\n"
+#define TDM_LOG_FORMAT_SELECT_INVALID_KEY "temporal dynamic macro: only numeric keys are valid in macro select"
+#define TDM_LOG_FORMAT_SELECT_OUT_OF_RANGE "temporal dynamic macro: there are only %d macro slots\n"
+#define TDM_LOG_FORMAT_SELECTION "selection: %d\n"
+#define TDM_LOG_FORMAT_SELECTED "selected macro: %d\n"
+#define TDM_LOG_FORMAT_LIBRARY_FORMAT "temporal dynamic macro: formatting the macro library\n"
+#define TDM_LOG_FORMAT_LIBRARY_MOUNT "temporal dynamic macro: library bank %d, epoch %d, %ld bytes used\n"
+#define TDM_LOG_FORMAT_LIBRARY_COMPACT "temporal dynamic macro: compacting the library into bank %d\n"
+#define TDM_LOG_FORMAT_LIBRARY_FULL "temporal dynamic macro: library is full, macro %d is only kept in RAM\n"
+#define TDM_LOG_FORMAT_CACHE_NO_ROOM "temporal dynamic macro: macro %d doesn't fit in RAM\n"
+#define TDM_LOG_FORMAT_UNBOUND "temporal dynamic macro: unbound %d+%d\n"
+#define TDM_LOG_FORMAT_BINDINGS_FULL "temporal dynamic macro: all %d bindings are used\n"
+#define TDM_LOG_FORMAT_BOUND "temporal dynamic macro: bound %d+%d to macro %d\n"
+#define TDM_LOG_FORMAT_BIND_START "temporal dynamic macro: press the chord to bind to macro %d\n"
+#define TDM_LOG_FORMAT_RECORD_START "temporal dynamic macro: recording into macro# %d\n"
+#define TDM_LOG_FORMAT_RECORD_NO_SPACE "temporal dynamic macro: no space left to record\n"
+#define TDM_LOG_FORMAT_RECORD_LEADING_KEYUP "temporal dynamic macro: ignoring a leading key-up event\n"
+#define TDM_LOG_FORMAT_RECORD_DELAY_KEY "recording delay: %d\n"
+#define TDM_LOG_FORMAT_DELAY_INVALID_KEY "temporal dynamic macro: only numeric keys are valid during delay entry"
+#define TDM_LOG_FORMAT_RECORD_DELAY_END "temporal dynamic macro: ending record delay : iter %d, kc %d, flags %d\n"
+#define TDM_LOG_FORMAT_RECORD_END "temporal dynamic macro: ending record : iter %d, kc %d, flags %d\n"
+#define TDM_LOG_FORMAT_RECORD_TRIM "temporal dynamic macro: trimming : iter %d, kc %d, flags %d\n"
+#define TDM_LOG_FORMAT_RECORD_SAVED "temporal dynamic macro: slot %d saved, length: %d\n"
+#define TDM_LOG_FORMAT_SAFE_RANGE "SAFE_RANGE: %d\n"
+#define TDM_LOG_FORMAT_PLAY_START "play start: macro %d, %d entries, at %d\n"
+#define TDM_LOG_FORMAT_NOT_IN_DELAY "not in a delay\n"
+#define TDM_LOG_FORMAT_LOOP_START "loop start: macro %d, %d entries, at %d\n"
+#define TDM_LOG_FORMAT_PLAY_DEBOUNCE "play debounce\n"
+#define TDM_LOG_FORMAT_DELAY_DONE "done with delay\n"
+#define TDM_LOG_FORMAT_PLAY_LOOP "play loop: t= %ld\n"
+#define TDM_LOG_FORMAT_PLAYING_SLOT "temporal dynamic macro: playing slot %d \n"
+#define TDM_LOG_FORMAT_PLAY_KEY "iter %d KC: %d, down? %d, time: %ld\n"
+#define TDM_LOG_FORMAT_PLAY_DELAY "delaying: %ld\n"
+#define TDM_LOG_FORMAT_PLAY_FINISHED "play finished %d\n"
+#define TDM_LOG_FORMAT_TIME_SCALE "temporal dynamic macro: macro %d time scale %d/16\n"
+#define TDM_LOG_FORMAT_TRANSITION "transitioning to state: %d\n"
+#define TDM_LOG_FORMAT_STARTS_BEGIN "MacroStarts: ["
+#define TDM_LOG_FORMAT_STARTS_ITEM "%d, "
+#define TDM_LOG_FORMAT_LIST_END "]\n"
+#define TDM_LOG_FORMAT_INVALID_TRANSITION "temporal dynamic macro: invalid transition: %d to %d\n"
+#define TDM_LOG_FORMAT_DUMP_BEGIN "\n==========\n"
+#define TDM_LOG_FORMAT_DUMP_STARTS "MACRO_starts[%d] = ["
+#define TDM_LOG_FORMAT_DUMP_START "%d,"
+#define TDM_LOG_FORMAT_DUMP_BUFFER_SIZE "%d\n"
+#define TDM_LOG_FORMAT_DUMP_MACRO "\nMacro# %d\n"
+#define TDM_LOG_FORMAT_DUMP_KEY "KC: %d, down? %d, time: %ld\n"
+#define TDM_LOG_FORMAT_DUMP_END "==========\n"
+#define TDM_LOG_FORMAT_COUNTERS_EVENTS "temporal dynamic macro: %ld events recorded, %ld played, %ld loops\n"
+#define TDM_LOG_FORMAT_COUNTERS_ERRORS "temporal dynamic macro: %d overflows, %d invalid transitions, %d refused for unsaved macros\n"
+#define TDM_LOG_FORMAT_COUNTERS_TIMING "temporal dynamic macro: %d ms max lateness, %d/%d pool entries at most\n"
+#define TDM_LOG_FORMAT_PROFILE_CALLS "temporal dynamic macro: scope %d: %ld calls, %ld ticks mean\n"
+#define TDM_LOG_FORMAT_PROFILE_RANGE "temporal dynamic macro: scope %d: %ld to %ld ticks\n"
+#define TDM_LOG_FORMAT_ARMED "temporal dynamic macro: macro %d armed\n"
+#define TDM_LOG_FORMAT_COUNTERS_ARM "temporal dynamic macro: %d ms from an armed trigger to its first report at most\n"
+#define TDM_LOG_FORMAT_CONTAINER_MOUNT "temporal dynamic macro: container with %d macros mounted\n"
+#define TDM_LOG_FORMAT_CONTAINER_INVALID "temporal dynamic macro: invalid container, not mounted\n"
+#define TDM_LOG_FORMAT_STAGED "temporal dynamic macro: macro %d staged for the next loop\n"
+#define TDM_LOG_FORMAT_SWAPPED "temporal dynamic macro: loop switched from macro %d to %d\n"
+#define TDM_LOG_FORMAT_CACHE_UNSAVED "temporal dynamic macro: all %d cached macros are unsaved, macro %d has to wait\n"
+#define TDM_LOG_FORMAT_OVERRIDES_FULL "temporal dynamic macro: all %d overrides are taken, macro %d keeps the global speed\n"
+
+// the IDs, in the order of the formats above
+#define TDM_LOG_MESSAGES(X) \
+	X(PLAY_USER) \
+	X(PLAY_STOP_USER) \
+	X(SELECTING) \
+	X(SELECT_INVALID_KEY) \
+	X(SELECT_OUT_OF_RANGE) \
+	X(SELECTION) \
+	X(SELECTED) \
+	X(LIBRARY_FORMAT) \
+	X(LIBRARY_MOUNT) \
+	X(LIBRARY_COMPACT) \
+	X(LIBRARY_FULL) \
+	X(CACHE_NO_ROOM) \
+	X(UNBOUND) \
+	X(BINDINGS_FULL) \
+	X(BOUND) \
+	X(BIND_START) \
+	X(RECORD_START) \
+	X(RECORD_NO_SPACE) \
+	X(RECORD_LEADING_KEYUP) \
+	X(RECORD_DELAY_KEY) \
+	X(DELAY_INVALID_KEY) \
+	X(RECORD_DELAY_END) \
+	X(RECORD_END) \
+	X(RECORD_TRIM) \
+	X(RECORD_SAVED) \
+	X(SAFE_RANGE) \
+	X(PLAY_START) \
+	X(NOT_IN_DELAY) \
+	X(LOOP_START) \
+	X(PLAY_DEBOUNCE) \
+	X(DELAY_DONE) \
+	X(PLAY_LOOP) \
+	X(PLAYING_SLOT) \
+	X(PLAY_KEY) \
+	X(PLAY_DELAY) \
+	X(PLAY_FINISHED) \
+	X(TIME_SCALE) \
+	X(TRANSITION) \
+	X(STARTS_BEGIN) \
+	X(STARTS_ITEM) \
+	X(LIST_END) \
+	X(INVALID_TRANSITION) \
+	X(DUMP_BEGIN) \
+	X(DUMP_STARTS) \
+	X(DUMP_START) \
+	X(DUMP_BUFFER_SIZE) \
+	X(DUMP_MACRO) \
+	X(DUMP_KEY) \
+	X(DUMP_END) \
+	X(COUNTERS_EVENTS) \
+	X(COUNTERS_ERRORS) \
+	X(COUNTERS_TIMING) \
+	X(PROFILE_CALLS) \
+	X(PROFILE_RANGE) \
+	X(ARMED) \
+	X(COUNTERS_ARM) \
+	X(CONTAINER_MOUNT) \
+	X(CONTAINER_INVALID) \
+	X(STAGED) \
+	X(SWAPPED) \
+	X(CACHE_UNSAVED) \
+	X(OVERRIDES_FULL)
+
+#define TDM_LOG_ID(name) TDM_LOG_##name,
+typedef enum { TDM_LOG_MESSAGES(TDM_LOG_ID) TDM_LOG_MESSAGE_COUNT } tdm_log_id_t;
+#undef TDM_LOG_ID
+
+#define TDM_LOG_FRAME_START 0xFE
+
+#ifdef TDM_LOG_BINARY
+// a log site is one call with up to 4 arguments, missing ones are passed as 0 and not sent
+void tdm_log_binary(uint8_t id, uint8_t count, int32_t a, int32_t b, int32_t c, int32_t d);
+// sends a frame, to the console by default
+void tdm_log_write(const uint8_t* data, uint8_t length);
+
+#	define TDM_LOG_NARGS(empty, a, b, c, d, n, ...) n
+#	define TDM_LOG_ARGS(empty, a, b, c, d, ...) a, b, c, d
+#	define TDM_LOG(name, ...) \
+		tdm_log_binary(TDM_LOG_##name, TDM_LOG_NARGS(, ##__VA_ARGS__, 4, 3, 2, 1, 0), TDM_LOG_ARGS(, ##__VA_ARGS__, 0, 0, 0, 0))
+#else
+// the format stays a literal, so the compiler checks the arguments against it
+#	define TDM_LOG(name, ...) uprintf(TDM_LOG_FORMAT_##name, ##__VA_ARGS__)
+#endif
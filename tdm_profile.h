@@ -0,0 +1,92 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file tdm_profile.h
+ * @brief Cycle counts of the temporal dynamic macro entry points.
+ *
+ * Define TDM_PROFILE to time every TDM_PROFILE_SCOPE(NAME) from where it's
+ * declared to the end of its block, and keep the call count, min, max and
+ * total per scope. TDM_STATS prints them, as the scope's position in the
+ * table below. Nested scopes each count the whole time, callees included.
+ *
+ * Ticks are CPU cycles on Cortex-M3/M4/M7/M33 (DWT CYCCNT), TSC ticks on x86
+ * and nanoseconds on other hosts. Without TDM_PROFILE, TDM_PROFILE_SCOPE is
+ * empty and nothing of this is compiled in.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define TDM_PROFILE_SCOPES(X) \
+	X(PROCESS) \
+	X(PLAY) \
+	X(RECORD_KEY) \
+	X(TRANSITION) \
+	X(DELAY_CALLBACK) \
+	X(LOOP_CALLBACK) \
+	X(LIBRARY_WRITE)
+
+#ifdef TDM_PROFILE
+
+#	define TDM_PROFILE_ID(name) TDM_PROFILE_##name,
+typedef enum { TDM_PROFILE_SCOPES(TDM_PROFILE_ID) TDM_PROFILE_SCOPE_COUNT } tdm_profile_id_t;
+#	undef TDM_PROFILE_ID
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+} tdm_profile_t;
+
+typedef struct {
+	uint8_t id;
+	uint32_t start;
+} tdm_profile_scope_t;
+
+#	if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+#		define TDM_DWT_CTRL (*(volatile uint32_t*)0xE0001000)
+#		define TDM_DWT_CYCCNT (*(volatile uint32_t*)0xE0001004)
+#		define TDM_DEMCR (*(volatile uint32_t*)0xE000EDFC)
+static inline uint32_t tdm_profile_now(void) {
+	return TDM_DWT_CYCCNT;
+}
+#	elif defined(__x86_64__) || defined(__i386__)
+static inline uint32_t tdm_profile_now(void) {
+	return (uint32_t)__builtin_ia32_rdtsc();
+}
+#	elif defined(__unix__) || defined(__APPLE__)
+#		include <time.h>
+static inline uint32_t tdm_profile_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+#	else
+#		error "temporal_dynamic_macro: TDM_PROFILE needs a Cortex-M with a DWT cycle counter or a host build."
+#	endif
+
+void tdm_profile_init(void);
+void tdm_profile_end(tdm_profile_scope_t* scope);
+tdm_profile_t* tdm_get_profile(tdm_profile_id_t id);
+void tdm_profile_print(void);
+void tdm_profile_reset(void);
+
+#	define TDM_PROFILE_SCOPE(name) \
+		__attribute__((cleanup(tdm_profile_end))) tdm_profile_scope_t tdm_profile_scope = {TDM_PROFILE_##name, tdm_profile_now()}
+#else
+#	define TDM_PROFILE_SCOPE(name)
+#endif
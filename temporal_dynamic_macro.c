@@ -19,25 +19,51 @@
  * For full documentation, see
  * <https://jackbellinger.github.io/blog/articles/qmk-temporal-dynamic-macro>
  
- users cannot hold a layer key during a delay
-Tapdances currently can't be used in a tdm, since I'm using register_code, it doesn't store taps or combos (when the tapdance is) so register code must not trigger taps
-Layer keys are filtered out, only the resulting keycode will be stored.
+ Tapdances currently can't be used in a tdm, since I'm using register_code, it doesn't store taps or combos (when the tapdance is) so register code must not trigger taps
+Layer keys themselves aren't stored, only the resulting keycode and the layer changes they cause.
  
  you can't add a delay at the end of a macro without another key following it. If you'd like to end with a delay for a loop and not have any following key before the start of the macro, you'll need to enter a KC_NO
  */
 
 #include "temporal_dynamic_macro.h"
 #include "custom_keycodes.h"
+#include "tdm_log.h"
+#include "tdm_profile.h"
+#include "tdm_container.h"
 #include "rgblight.h"
 #define RGBLIGHT_LED_COUNT 19
 #if !defined(DEFERRED_EXEC_ENABLE)
 #error "temporal_dynamic_macro: Please set `DEFERRED_EXEC_ENABLE = yes` in rules.mk."
 #endif
 
+/* Logging, messages are listed in tdm_log.h */
+#ifdef TDM_LOG_BINARY
+__attribute__((weak)) void tdm_log_write(const uint8_t* data, uint8_t length) {
+	for (uint8_t i = 0; i < length; i++) {
+		sendchar(data[i]);
+	}
+}
+
+void tdm_log_binary(uint8_t id, uint8_t count, int32_t a, int32_t b, int32_t c, int32_t d) {
+	const int32_t args[] = {a, b, c, d};
+	uint8_t frame[3 + sizeof(args)] = {TDM_LOG_FRAME_START, id, count};
+	uint8_t length = 3;
+	for (uint8_t i = 0; i < count; i++) {
+		uint32_t arg = (uint32_t)args[i];
+		frame[length++] = arg;
+		frame[length++] = arg >> 8;
+		frame[length++] = arg >> 16;
+		frame[length++] = arg >> 24;
+	}
+	tdm_log_write(frame, length);
+}
+#endif
+
 /* User hooks for Temporal Dynamic Macros
  * functions which can be overridden by the user to customize functionality.
- * tdm_is_valid_key_user allows the user to narrow what keys are allowed to be in a macro. 
+ * tdm_is_valid_key_user allows the user to narrow what keys are allowed to be in a macro, with TDM_VALID_KEY_USER.
  *     Normally the only restriction is that only numeric keys can be entered while recording a delay
+ *     TDM_KEY_FILTER does the same from a list of keycode ranges, without a call per key
  * 
  */
 // default feedback method
@@ -78,41 +104,46 @@ __attribute__((weak)) void tdm_rgb_user() {
 __attribute__((weak)) void tdm_init_user(void) {
 	tdm_led_blink();
 }
-__attribute__((weak)) void tdm_record_start_user(uint8_t MACRO_id) {
+__attribute__((weak)) void tdm_record_start_user(uint16_t M_id) {
 	tdm_led_blink();
 	// print_macros();
 }
+#ifdef TDM_VALID_KEY_USER
 __attribute__((weak)) bool tdm_is_valid_key_user(uint16_t keycode) {
 	return true;
 }
-__attribute__((weak)) void tdm_record_key_user(uint8_t MACRO_id, uint16_t keycode) {
+#endif
+__attribute__((weak)) void tdm_record_key_user(uint16_t M_id, uint16_t keycode) {
 	// uprintf("recording key: %d\n", keycode);
 	print_macros();
 	tdm_led_blink();
 }
-__attribute__((weak)) void tdm_record_end_user(uint8_t MACRO_id) {
+__attribute__((weak)) void tdm_record_end_user(uint16_t M_id) {
 	tdm_led_blink();
 	print_macros();
 }
-__attribute__((weak)) void tdm_play_user(uint8_t M_id) {
-	uprintf("playing macro: %d\n", M_id);
+__attribute__((weak)) void tdm_play_user(uint16_t M_id) {
+	TDM_LOG(PLAY_USER, M_id);
 	tdm_led_blink();
 }
-__attribute__((weak)) void tdm_play_stop_user(uint8_t M_id) {
-	uprintf("done playing macro: %d\n", M_id);
+__attribute__((weak)) void tdm_play_stop_user(uint16_t M_id) {
+	TDM_LOG(PLAY_STOP_USER, M_id);
 	tdm_led_blink();
 }
+__attribute__((weak)) void tdm_play_trace_user(uint16_t M_id, uint8_t kind, uint16_t payload, bool pressed, uint32_t time) {}
 
 /* Buffer state
- * stores the recorded macros, their lengths, and iteration position
- * MACRO_buffers: the array of keyrecords.
- * MACRO_ends: pointers to the end of the macro
- * current_pointer: macro iteration pointer
+ * the recorded macros are arrays of keyrecords, kept in tdm.pool (see the Macro Pool below)
  */
 typedef struct {
-	uint16_t keycode;
-	uint32_t delay_ms;
+	uint16_t keycode; //keycode, or the packed payload of a non-key event
+	union {
+		uint32_t delay_ms; //while recording: the delay before this entry
+		uint32_t time_ms; //once recorded: when it plays, in ms from the start of the macro
+	};
 	uint8_t flags; //butmask set by tdm_key_flags
+	uint8_t repeat; //how many more times a run event is played after the first
+	uint8_t interval; //ms between the plays of a run event
 	// TODO figure out what other fields I would need to support various qmk features
 	//			(combo keys used in tdm, tap dances, etc)
 } tdm_keypress_t;
@@ -120,12 +151,22 @@ typedef struct {
 /*
  * bitmask for key metadata flags
  * FLAG_pressed: if the key was pressed down or released
- * 1-8: unused, reserved for future extensions to support 
+ * EVENT_*: what kind of event the entry stores (bits 1-3)
+ *     EVENT_key: keycode press or release
+ *     EVENT_motion: pointing device step, keycode holds (int8_t dx | int8_t dy << 8)
+ *     EVENT_encoder: encoder detents, keycode is tapped once per detent
+ *     EVENT_layer: one layer turned on or off, keycode holds (layer | on << 7)
+ *     EVENT_mods: modifier change, keycode holds (mods added | mods removed << 8)
+ * 5-8: unused, reserved for future extensions to support 
 */
 #define FLAG_pressed (1u)
-#define FLAG_1 (1u << 1)
-#define FLAG_3 (1u << 2)
-#define FLAG_4 (1u << 3)
+#define FLAG_KIND_MASK (7u << 1)
+#define EVENT_key (0u << 1)
+#define EVENT_motion (1u << 1)
+#define EVENT_encoder (2u << 1)
+#define EVENT_layer (3u << 1)
+#define EVENT_mods (4u << 1)
+#define LAYER_on (1u << 7)
 #define FLAG_5 (1u << 4)
 #define FLAG_6 (1u << 5)
 #define FLAG_7 (1u << 6)
@@ -140,73 +181,505 @@ static inline bool is_set(tdm_keypress_t *keypress, uint8_t flag){
 static inline void clear_flags(tdm_keypress_t *keypress) {
 	keypress->flags = 0;
 }
+static inline uint8_t event_kind(tdm_keypress_t *keypress) {
+	return keypress->flags & FLAG_KIND_MASK;
+}
 
-/* Macro Buffers: 2D array that stores the keyrecords for each step of a macro
- * Each macro shares a buffer but read/write on different
- * ends of it.
- *
- * Macro1 is written left-to-right starting from the beginning of
- * the buffer.
- *
- * Macro2 is written right-to-left starting from the end of the
- * buffer.
- *
- * &macro_buffer   MACRO_end
- *  v                   
- * +------------------------------------------------------------+
- * |>>>>>> MACRO1 >>>>>>      <<<<<<<<<<<<< MACRO2 <<<<<<<<<<<<<|
- * +------------------------------------------------------------+
- *                           ^                                 ^
- *                         r_MACRO_end                  r_macro_buffer
- *
- * During the recording when one macro encounters the end of the
- * other macro, the recording is stopped. Apart from this, there
- * are no arbitrary limits for the macros' length in relation to
- * each other: for example one can either have two medium sized
- * macros or one long macro and one short macro. Or even one empty
- * and one using the whole buffer.
+typedef enum {
+	STATE_recording,
+	STATE_recording_delay,
+	STATE_playing,
+	STATE_looping,
+	STATE_selecting,
+	STATE_binding,
+	STATE_armed,
+	STATE_idle
+} State;
+
+// Macro library journal, see below
+#if TDM_LIBRARY_SIZE > 0
+typedef struct {
+	uint16_t magic;
+	uint16_t epoch; //the bank with the newest one is active
+} tdm_library_bank_t;
+
+typedef struct {
+	uint16_t slot;
+	uint16_t length; //0 deletes the macro
+	uint16_t seq; //the newest record of a slot wins
+	uint16_t crc; //of the epoch, the fields above and the entries, so records left from an older epoch don't count
+} tdm_library_record_t;
+
+// where a slot's newest record is, see tdm_library_find
+typedef struct {
+	uint32_t address; //of the entries
+	uint16_t length;
+	uint16_t seq;
+} tdm_library_slot_t;
+#endif
+
+// Trigger bindings, see below
+typedef struct {
+	uint16_t keycode; //KC_NO when the bucket is empty
+	uint16_t slot;
+	uint8_t mods;
+} tdm_binding_t;
+#define TDM_BINDING_BUCKETS (TDM_NUM_BINDINGS * 2)
+_Static_assert((TDM_NUM_BINDINGS & (TDM_NUM_BINDINGS - 1)) == 0 && TDM_NUM_BINDINGS <= 64,
+		"temporal dynamic macro: TDM_NUM_BINDINGS must be a power of two, at most 64");
+#define TDM_CHORD_KEYS 6 //chords held down at once while recording, like the keys of a HID report
+
+// Bytecode interpreter, see below
+#ifdef TDM_BYTECODE
+#	ifndef TDM_CONTAINER
+#		error "temporal_dynamic_macro: TDM_BYTECODE plays programs from a container image, define TDM_CONTAINER too."
+#	endif
+#	define TDM_VM_CALL 0xFF //marks a call frame
+typedef struct {
+	const uint8_t* pc; //start of the repeated block, or where a call returns to
+	uint8_t left; //runs of the block after this one, TDM_VM_CALL for a call
+} tdm_vm_frame_t;
+
+typedef struct {
+	const uint8_t* pc; //next instruction, NULL when no program plays
+	uint32_t time; //when it's due, in ms from the start of the run
+	uint8_t mods; //set by the program
+	bool silent; //runs without playing anything, to skip ahead
+	uint16_t steps; //instructions run, up to TDM_VM_STEPS
+	uint8_t depth;
+	tdm_vm_frame_t frames[TDM_VM_DEPTH];
+} tdm_vm_t;
+#endif
+
+// Compressed macros, see below
+#ifdef TDM_LZ
+#	ifndef TDM_CONTAINER
+#		error "temporal_dynamic_macro: TDM_LZ decompresses macros of a container image, define TDM_CONTAINER too."
+#	endif
+_Static_assert(TDM_LZ_WINDOW == 256, "temporal dynamic macro: the window position wraps as a uint8_t");
+typedef struct {
+	const uint8_t* source; //next token or literal byte
+	uint16_t left; //entries not decoded yet
+	uint8_t run; //bytes left in the current token
+	uint16_t distance; //of the current match, 0 in a literal run
+	uint8_t head; //where the next byte goes in the window
+	uint32_t time; //of the last decoded entry
+	const tdm_container_lz_t* stream; //of the macro being decoded
+	uint8_t window[TDM_LZ_WINDOW];
+	tdm_keypress_t chunk[TDM_LZ_CHUNK];
+} tdm_lz_t;
+#endif
+
+/* Engine state
+ * everything the engine keeps between calls, in one struct so a host build can run independent
+ * instances side by side (TDM_MULTI_INSTANCE). The firmware has a single static instance, whose
+ * fields are addressed directly like separate globals would be.
+ */
+typedef struct tdm_context {
+	tdm_config_t config;
+	deferred_token config_token; //the config's pending save, see tdm_config_changed
+#ifdef TDM_PROFILE
+	tdm_profile_t profiles[TDM_PROFILE_SCOPE_COUNT];
+#endif
+	tdm_counters_t counters;
+
+	// Macro pool, see below
+	tdm_keypress_t pool[TDM_BUFFER_SIZE];
+	uint16_t starts[TDM_NUM_MACROS + 1];
+
+	// Bookkeeping: what the user is currently doing, and which actions can be taken next
+	uint16_t id; //the selected macro slot, 0..TDM_NUM_MACROS-1, which is recorded or played
+	tdm_keypress_t* start; //start of the current macro
+	tdm_keypress_t* iterator; //current macro position
+	tdm_keypress_t* end; //end of the current macro (while recording, the start of the next slot)
+	uint32_t delay_next_key_ms; //the delay being typed in
+	layer_state_t layers; //layer state as of the last recorded entry
+	State current_state;
+	State previous_state;
+	uint16_t selection;
+
+#if TDM_LIBRARY_SIZE > 0
+	// Macro library
+	uint8_t library_stored[(TDM_NUM_MACROS + 7) / 8]; //slots whose newest record has entries
+	uint8_t library_bank;
+	uint16_t library_epoch;
+	uint32_t library_head; //where the next record goes
+	uint16_t library_seq; //of the next record
+
+	// Write-behind queue
+	uint8_t library_queued[(TDM_NUM_MACROS + 7) / 8];
+	uint16_t write_id; //slot whose record is being written, TDM_NUM_MACROS if none
+	tdm_library_record_t write_record;
+	uint32_t write_pos; //bytes of the record written so far, entries first
+	uint16_t write_crc;
+	bool compacting;
+	uint16_t compact_next; //slot to copy next
+	uint32_t compact_head; //end of the old bank's journal, slots not copied yet are read from it
+	uint32_t compact_from; //entries of the record being copied
+	deferred_token write_token;
+
+	// Resident macros
+	uint16_t lru[TDM_CACHE_WAYS];
+	uint8_t lru_count;
+	uint16_t loaded; //the macro being loaded is always the one playing: how many of its entries are in the pool so far
+	uint16_t load_length;
+	uint32_t load_address;
+#endif
+#ifdef TDM_CONTAINER
+	const tdm_container_header_t* container; //the mounted image, NULL if none
+	const tdm_container_slot_t* container_slots;
+#endif
+#ifdef TDM_BYTECODE
+	tdm_vm_t vm;
+#endif
+#ifdef TDM_LZ
+	tdm_lz_t lz;
+#endif
+
+	// Trigger bindings
+	tdm_binding_t bindings[TDM_BINDING_BUCKETS];
+	uint8_t binding_filter[256 / 8];
+	uint8_t binding_count;
+	uint16_t bound_keycode; //the trigger that started playback, its release is swallowed too
+	State bind_return; //state to go back to once the trigger chord is pressed
+
+	// Playback
+	bool play_finished;
+	uint8_t run_played; //how many repeats of the run event at the iterator have been played
+	layer_state_t played_layers; //layers turned on by the playing macro, turned back off when it restarts
+	deferred_token play_token;
+	deferred_token delay_token;
+	uint8_t saved_mods; //modifiers the user held when playback started
+	uint8_t saved_oneshot_mods;
+	bool mods_saved;
+	uint16_t debounce_ms; //timing of the macro being played
+	uint16_t loop_gap_ms;
+	uint8_t time_scale;
+	uint32_t play_origin; //when the current run started playing
+	uint32_t play_duration; //of one run, at normal speed
+	bool play_started;
+	uint16_t staged_id; //macro the loop switches to at its next boundary, TDM_NUM_MACROS if none
+	uint16_t played_chords[TDM_CHORD_KEYS]; //chords held down by playback, KC_NO when free
+#ifdef TDM_LOWPOWER
+	uint32_t wake_at; //when the pending playback callback is due
+#endif
+#ifdef TDM_REPORT_MIX
+	report_keyboard_t mix_report; //what the macro holds, only its mods and keys are used
+	uint8_t mix_weak_mods; //modifiers of the chords it holds
+	bool mix_pending; //changed since the last report
+	uint8_t mix_touched[KEYBOARD_REPORT_KEYS]; //keys changed since the last report
+	uint8_t mix_touched_count;
+	uint8_t mix_touched_mods; //and modifiers
+	host_driver_t mix_driver; //the host driver, with the keyboard sends wrapped
+	void (*mix_send_keyboard)(report_keyboard_t* report);
+#	ifdef NKRO_ENABLE
+	void (*mix_send_nkro)(report_nkro_t* report);
+#	endif
+#endif
+
+	// Recording
+	uint32_t encoder_last; //time of the last recorded detent
+	uint8_t held_mods; //modifiers held down while recording
+	uint8_t recorded_mods; //the ones the macro holds at this point, the others only apply to chords
+	uint16_t chords[TDM_CHORD_KEYS]; //chord keycodes held down, their release is recorded the same
+	uint16_t chord_key; //the last chord recorded, while its modifiers are still held
+	uint8_t chord_mods; //those modifiers, 0 once one of them is released
+	bool got_first_keydown; //key releases before the first press belong to keys pressed before recording
+#ifdef POINTING_DEVICE_ENABLE
+	int16_t motion_x;
+	int16_t motion_y;
+	uint16_t motion_window; //start of the current sample window
+	uint32_t motion_last; //time of the last stored step
+	uint8_t mouse_buttons;
+#endif
+} tdm_context_t;
+
+#if TDM_LIBRARY_SIZE > 0
+#	define TDM_LIBRARY_CONTEXT_INIT .write_id = TDM_NUM_MACROS, .write_token = INVALID_DEFERRED_TOKEN,
+#else
+#	define TDM_LIBRARY_CONTEXT_INIT
+#endif
+#define TDM_CONTEXT_INIT \
+	{ \
+		.counters = {.version = TDM_COUNTERS_VERSION}, \
+		.current_state = STATE_idle, \
+		.previous_state = STATE_idle, \
+		.config_token = INVALID_DEFERRED_TOKEN, \
+		TDM_LIBRARY_CONTEXT_INIT \
+		.bound_keycode = KC_NO, \
+		.bind_return = STATE_idle, \
+		.staged_id = TDM_NUM_MACROS, \
+		.play_token = INVALID_DEFERRED_TOKEN, \
+		.delay_token = INVALID_DEFERRED_TOKEN, \
+		.debounce_ms = TDM_DEBOUNCE_DELAY, \
+		.loop_gap_ms = TDM_LOOP_GAP, \
+		.time_scale = TDM_TIME_SCALE, \
+	}
+
+#ifdef TDM_MULTI_INSTANCE
+static const tdm_context_t tdm_context_initial = TDM_CONTEXT_INIT;
+static tdm_context_t tdm_default_context = TDM_CONTEXT_INIT;
+// the instance each thread works on
+static _Thread_local tdm_context_t* tdm_context = &tdm_default_context;
+#	define tdm (*tdm_context)
+
+size_t tdm_context_size(void) {
+	return sizeof(tdm_context_t);
+}
+
+void tdm_context_init(tdm_context_t* context) {
+	*context = tdm_context_initial;
+}
+
+tdm_context_t* tdm_context_select(tdm_context_t* context) {
+	tdm_context_t* previous = tdm_context;
+	tdm_context = context ? context : &tdm_default_context;
+	return previous;
+}
+#else
+static tdm_context_t tdm = TDM_CONTEXT_INIT;
+#endif
+
+/* Runtime config
+ * loaded from EEPROM at init, falls back to the compiled defaults when the stored version doesn't match.
+ * eeprom_update_block only writes the bytes that changed. Changes made while typing only mark it
+ * dirty, it's saved TDM_CONFIG_SAVE_DELAY ms after the last one, outside the key handler.
  */
-static tdm_keypress_t MACRO_buffers[(TDM_NUM_MACROS + 1) / 2][TDM_BUFFER_SIZE];
+tdm_config_t* tdm_get_config(void) {
+	return &tdm.config;
+}
+
+void tdm_config_save(void) {
+	if (tdm.config_token != INVALID_DEFERRED_TOKEN) {
+		cancel_deferred_exec(tdm.config_token);
+		tdm.config_token = INVALID_DEFERRED_TOKEN;
+	}
+	eeprom_update_block(&tdm.config, (void*)TDM_EEPROM_ADDR, sizeof(tdm.config));
+}
+
+static uint32_t tdm_config_save_callback(uint32_t trigger_time, void* cb_arg) {
+	tdm.config_token = INVALID_DEFERRED_TOKEN;
+	tdm_config_save();
+	return 0;
+}
+
+static void tdm_config_changed(void) {
+	if (tdm.config_token == INVALID_DEFERRED_TOKEN || !extend_deferred_exec(tdm.config_token, TDM_CONFIG_SAVE_DELAY)) {
+		tdm.config_token = defer_exec(TDM_CONFIG_SAVE_DELAY, tdm_config_save_callback, NULL);
+	}
+}
 
-/* Pointers to the end of each buffer
- * initially each buffer is empty, so each end pointer starts at the beginning.
- * points to the index after the last keycode in the macro
- * (if end points to n, last filled spot is n-1)
+//values the playback code relies on being non-zero
+static void tdm_config_sanitize(void) {
+	tdm.config.version = TDM_CONFIG_VERSION;
+	tdm.config.time_scale += tdm.config.time_scale == 0;
+	tdm.config.loop_gap_ms += tdm.config.loop_gap_ms == 0;
+}
+
+void tdm_config_reset(void) {
+	memset(&tdm.config, 0, sizeof(tdm.config));
+	tdm.config.silent_recorded_keys = TDM_SILENT_RECORDED_KEYS;
+	tdm.config.silent_invalid_keys = TDM_SILENT_INVALID_KEYS;
+	tdm.config.exit_state_on_any_key = TDM_EXIT_STATE_ON_ANY_KEY;
+	tdm.config.debounce_ms = TDM_DEBOUNCE_DELAY;
+	tdm.config.loop_gap_ms = TDM_LOOP_GAP;
+	tdm.config.time_scale = TDM_TIME_SCALE;
+	tdm_config_sanitize();
+	tdm_config_save();
+}
+
+/* A macro's overrides, NULL if it has none. With add, a free entry is taken for it, NULL if there's
+ * none left.
  */
-static tdm_keypress_t* MACRO_ends[(TDM_NUM_MACROS + (TDM_NUM_MACROS % 2))];
+static tdm_macro_config_t* tdm_macro_config(uint16_t M_id, bool add) {
+	tdm_macro_override_t* free = NULL;
+	for (uint8_t i = 0; i < TDM_NUM_OVERRIDES; i++) {
+		tdm_macro_override_t* entry = &tdm.config.overrides[i];
+		if (!(entry->config.loop_gap_ms | entry->config.debounce_ms | entry->config.time_scale)) {
+			free = free ? free : entry;
+		} else if (entry->id == M_id) {
+			return &entry->config;
+		}
+	}
+	if (!add || free == NULL) {
+		return NULL;
+	}
+	free->id = M_id;
+	return &free->config;
+}
+
+static void tdm_config_load(void) {
+	eeprom_read_block(&tdm.config, (void*)TDM_EEPROM_ADDR, sizeof(tdm.config));
+	if (tdm.config.version != TDM_CONFIG_VERSION) {
+		tdm_config_reset();
+	}
+	tdm_config_sanitize();
+}
+
+/* Profiling, scopes are listed in tdm_profile.h */
+#ifdef TDM_PROFILE
+void tdm_profile_reset(void) {
+	for (uint8_t i = 0; i < TDM_PROFILE_SCOPE_COUNT; i++) {
+		tdm.profiles[i] = (tdm_profile_t){.min = UINT32_MAX};
+	}
+}
+
+void tdm_profile_init(void) {
+#	ifdef TDM_DWT_CYCCNT
+	TDM_DEMCR |= 1ul << 24; //TRCENA
+	TDM_DWT_CYCCNT = 0;
+	TDM_DWT_CTRL |= 1ul; //CYCCNTENA
+#	endif
+	tdm_profile_reset();
+}
 
-/* Bookkeeping state
- * tracks what process the user currently in
- * validates what actions can be taken next
+void tdm_profile_end(tdm_profile_scope_t* scope) {
+	uint32_t ticks = tdm_profile_now() - scope->start;
+	tdm_profile_t* profile = &tdm.profiles[scope->id];
+	profile->count++;
+	profile->total += ticks;
+	if (ticks < profile->min) {
+		profile->min = ticks;
+	}
+	if (ticks > profile->max) {
+		profile->max = ticks;
+	}
+}
+
+tdm_profile_t* tdm_get_profile(tdm_profile_id_t id) {
+	return &tdm.profiles[id];
+}
+
+void tdm_profile_print(void) {
+	for (uint8_t i = 0; i < TDM_PROFILE_SCOPE_COUNT; i++) {
+		tdm_profile_t* profile = &tdm.profiles[i];
+		if (profile->count == 0) {
+			continue;
+		}
+		TDM_LOG(PROFILE_CALLS, i, (long)profile->count, (long)(profile->total / profile->count));
+		TDM_LOG(PROFILE_RANGE, i, (long)profile->min, (long)profile->max);
+	}
+}
+#endif
+
+/* Counters
+ * only ever incremented or raised, so updating them costs next to nothing.
  */
+tdm_counters_t* tdm_get_counters(void) {
+	return &tdm.counters;
+}
 
-/* 0   - no macro is being recorded right now
-* 1,2,..TDM_NUM_MACROS - macro 1, 2, or n is being recorded or played */
-static uint8_t MACRO_id = 0;
+void tdm_counters_print(void) {
+	TDM_LOG(COUNTERS_EVENTS, (long)tdm.counters.events_recorded, (long)tdm.counters.events_played, (long)tdm.counters.loops_completed);
+	TDM_LOG(COUNTERS_ERRORS, tdm.counters.overflows, tdm.counters.invalid_transitions, tdm.counters.cache_refused);
+	TDM_LOG(COUNTERS_TIMING, tdm.counters.max_lateness_ms, tdm.counters.high_water, TDM_BUFFER_SIZE);
+	TDM_LOG(COUNTERS_ARM, tdm.counters.max_arm_latency_ms);
+}
 
-// pointer to the start of the current macro buffer
-static tdm_keypress_t* MACRO_start;
-//pointer to the current macro position (iterator)
-static tdm_keypress_t* MACRO_iterator = NULL;
-//pointer to the current macro neighbor end (last empty buffer space)
-static tdm_keypress_t* MACRO_end;
+#ifdef TDM_COUNTERS_PERSIST
+void tdm_counters_save(void) {
+	eeprom_update_block(&tdm.counters, (void*)TDM_COUNTERS_ADDR, sizeof(tdm.counters));
+}
+#endif
 
-/* The MACRO_direction of the current macro, even(0,2..) macros go ->LtR->, odd macros go <-RtL<- 
-* either 1 or -1
-*/
-static int8_t MACRO_direction = 1;
+void tdm_counters_reset(void) {
+	memset(&tdm.counters, 0, sizeof(tdm.counters));
+	tdm.counters.version = TDM_COUNTERS_VERSION;
+#ifdef TDM_COUNTERS_PERSIST
+	tdm_counters_save();
+#endif
+}
 
-// The MACRO_delay_next_key_ms stores the number while inputting a delay
-static uint32_t MACRO_delay_next_key_ms = 0;
+static void tdm_counters_load(void) {
+#ifdef TDM_COUNTERS_PERSIST
+	eeprom_read_block(&tdm.counters, (void*)TDM_COUNTERS_ADDR, sizeof(tdm.counters));
+	if (tdm.counters.version != TDM_COUNTERS_VERSION) {
+		tdm_counters_reset();
+	}
+#endif
+}
 
-typedef enum {
-	STATE_recording,
-	STATE_recording_delay,
-	STATE_playing,
-	STATE_looping,
-	STATE_selecting,
-	STATE_idle
-} State;
+// trigger_time is when the callback was due
+static inline void tdm_counters_lateness(uint32_t trigger_time) {
+	uint32_t late = timer_read32() - trigger_time;
+	if (late > tdm.counters.max_lateness_ms) {
+		tdm.counters.max_lateness_ms = late > UINT16_MAX ? UINT16_MAX : late;
+	}
+}
+
+// select the override unless it's 0, without a branch
+static inline uint16_t tdm_override(uint16_t value, uint16_t fallback) {
+	return value | (fallback & -(uint16_t)(value == 0));
+}
+
+#ifdef RAW_ENABLE
+bool tdm_raw_hid_receive(uint8_t* data, uint8_t length) {
+	if (length < 2 || data[0] != TDM_HID_COMMAND) {
+		return false;
+	}
+	uint16_t offset = length >= 4 ? data[2] | (data[3] << 8) : 0;
+	uint8_t count = length >= 5 ? data[4] : 0;
+	uint16_t size = data[1] == TDM_HID_COUNTERS_GET ? sizeof(tdm.counters) : sizeof(tdm.config);
+	bool in_range = length >= 5 && count <= length - 5 && offset + count <= size;
+	uint8_t status = 1;
+	switch (data[1]) {
+		case TDM_HID_CONFIG_GET:
+			if (in_range) {
+				memcpy(&data[5], (uint8_t*)&tdm.config + offset, count);
+				status = 0;
+			}
+			break;
+		case TDM_HID_CONFIG_SET:
+			if (in_range) {
+				memcpy((uint8_t*)&tdm.config + offset, &data[5], count);
+				tdm_config_sanitize();
+				tdm_config_changed();
+				status = 0;
+			}
+			break;
+		case TDM_HID_CONFIG_RESET:
+			tdm_config_reset();
+			status = 0;
+			break;
+		case TDM_HID_COUNTERS_GET:
+			if (in_range) {
+				memcpy(&data[5], (uint8_t*)&tdm.counters + offset, count);
+				status = 0;
+			}
+			break;
+		case TDM_HID_COUNTERS_RESET:
+			tdm_counters_reset();
+			status = 0;
+			break;
+	}
+	data[2] = status;
+	raw_hid_send(data, length);
+	return true;
+}
+#endif
+
+/* Macro Pool: every macro is stored back to back in one array, in slot order.
+ *
+ * tdm.starts is the slot directory: slot i is tdm.pool[tdm.starts[i]] up to
+ * tdm.pool[tdm.starts[i + 1]], so finding a macro is O(1) and an empty slot takes
+ * no entries, only its 2-byte offset here (see TDM_NUM_MACROS for the rest).
+ *
+ * While slot n is being recorded the slots after it are moved to the top of the
+ * pool, and all of the free space becomes a gap right after slot n:
+ *
+ *  tdm.starts[n]                tdm.starts[n + 1]
+ *  v                            v
+ * +------------------------------------------------------------+
+ * |slot 0|..|>>> slot n >>>     |slot n+1|..|slot N-1|          |
+ * +------------------------------------------------------------+
+ *                 ^
+ *                 tdm.iterator
+ *
+ * When the recording ends the tail is moved back down, so any slot can use all of
+ * the free space no matter how the others are sized. Recording stops when the
+ * macro runs into the tail.
+ */
+_Static_assert(TDM_BUFFER_SIZE <= UINT16_MAX, "temporal dynamic macro: TDM_BUFFER_SIZE must fit in 16 bits");
 
 const char* state_to_string(State st) {
 	switch (st) {
@@ -220,14 +693,16 @@ const char* state_to_string(State st) {
 			return "looping";
 		case STATE_selecting:
 			return "selecting";
+		case STATE_binding:
+			return "binding";
+		case STATE_armed:
+			return "armed";
 		case STATE_idle:
 			return "idle";
 	}
 	return "idle";
 }
 
-static State MACRO_current_state = STATE_idle;
-
 State keycode_to_state(uint16_t keycode){
 	//if the keycode isn't a control key, then next state is idle unless it's recording a delay.
 	State key_state = STATE_idle; 
@@ -250,17 +725,34 @@ State keycode_to_state(uint16_t keycode){
 		case TDM_SELECT:
 			key_state = STATE_selecting;
 			break;
+		case TDM_BIND:
+			key_state = STATE_binding;
+			break;
+		case TDM_ARM:
+			key_state = STATE_armed;
+			break;
 	}
 	return key_state;
 }
 
 void reset_state(void);
-void tdm_init_state_machine(void);
 void tdm_init_user(void);
 
+static void tdm_config_load(void);
+#if TDM_LIBRARY_SIZE > 0
+static void tdm_library_init(void);
+#endif
+
 void tdm_init(void) {
+#ifdef TDM_PROFILE
+	tdm_profile_init();
+#endif
+	tdm_config_load();
+	tdm_counters_load();
 	reset_state();
-	tdm_init_state_machine();
+#if TDM_LIBRARY_SIZE > 0
+	tdm_library_init();
+#endif
 	tdm_init_user();
 }
 
@@ -275,246 +767,1825 @@ int keycode_to_int(uint16_t keycode) {
 	}
 }
 
-static uint8_t MACRO_selection = 0;
 void tdm_select_start(void) {
-	uprintf("selecting\n");
-	MACRO_selection = 0;
+	TDM_LOG(SELECTING);
+	tdm.selection = 0;
 }
 
 void tdm_select_macro(uint16_t keycode) {
-	if (MACRO_selection >= TDM_NUM_MACROS) {
-		return;
-	}
 	int key_val = keycode_to_int(keycode);
 	if (key_val == -1) { 
-		uprintf("temporal dynamic macro: only numeric keys are valid in macro select");
+		TDM_LOG(SELECT_INVALID_KEY);
+		return;
+	}
+	//a digit that would go past the last slot is ignored, so the selection is always valid
+	uint32_t selection = (uint32_t)tdm.selection * 10 + key_val;
+	if (selection >= TDM_NUM_MACROS) {
+		TDM_LOG(SELECT_OUT_OF_RANGE, TDM_NUM_MACROS);
 		return;
 	}
-	MACRO_selection *= 10;
-	MACRO_selection += key_val;
+	tdm.selection = selection;
 }
 
 void tdm_select_end(void) {
 	clear_keyboard();
 	layer_clear();
-	uprintf("selection: %d\n", MACRO_selection);
-	if (MACRO_selection >= TDM_NUM_MACROS)
-		MACRO_id = TDM_NUM_MACROS -1;
-	else
-		MACRO_id = MACRO_selection;
-	uprintf("selected macro: %d\n", MACRO_id);
+	TDM_LOG(SELECTION, tdm.selection);
+	tdm.id = tdm.selection;
+	TDM_LOG(SELECTED, tdm.id);
+}
+
+bool select_macro_id(uint16_t new_macro_id) {
+	if (new_macro_id >= TDM_NUM_MACROS || tdm.current_state != STATE_idle) {
+		return false;
+	}
+	tdm.id = new_macro_id;
+	return true;
 }
 
 /* Convenience macros used for retrieving state.
- * MACRO_id must be defined
  */
-#define DIRECTION(M_id) ((M_id & 1) * -2 + 1)
-#define NEIGHBOR(x) ((x) + 1 - 2 * ((x) % 2))
-#define TDM_BUFFER_START(M_id) (&MACRO_buffers[M_id / 2][0])
-#define TDM_CURRENT_START(M_id) (TDM_BUFFER_START(M_id) + ((M_id & 1) * TDM_BUFFER_SIZE))
-#define TDM_CURRENT_LENGTH(POINTER) (DIRECTION(MACRO_id) * (POINTER - TDM_CURRENT_START(MACRO_id)))
-#define TDM_CURRENT_CAPACITY(M_id) (DIRECTION(M_id) * (MACRO_ends[NEIGHBOR(M_id)] - TDM_CURRENT_START(M_id)))
-#define TDM_ITERATOR_AT_START() (MACRO_iterator == MACRO_start)
+#define TDM_SLOT_START(M_id) (&tdm.pool[tdm.starts[M_id]])
+#define TDM_SLOT_END(M_id) (&tdm.pool[tdm.starts[(M_id) + 1]])
+#define TDM_SLOT_LENGTH(M_id) (tdm.starts[(M_id) + 1] - tdm.starts[M_id])
+#define TDM_CURRENT_LENGTH(POINTER) ((POINTER) - tdm.start)
+#define TDM_ITERATOR_AT_START() (tdm.iterator == tdm.start)
 
 void reset_state(void) {
-	for (int i = 0; i < TDM_NUM_MACROS; i++) {
-		MACRO_ends[i] = TDM_CURRENT_START(i);
+	for (int i = 0; i <= TDM_NUM_MACROS; i++) {
+		tdm.starts[i] = 0;
 	}
-	MACRO_start = MACRO_buffers[0];
-	MACRO_iterator = NULL;
-	MACRO_end = MACRO_ends[0];
+	tdm.start = tdm.pool;
+	tdm.iterator = NULL;
+	tdm.end = tdm.pool;
 }
 
-static bool play_finished;
-void tdm_reset_iterator(void) {
-	MACRO_direction = DIRECTION(MACRO_id);
-	MACRO_start = TDM_CURRENT_START(MACRO_id);
-	MACRO_iterator = MACRO_start;
-	MACRO_end = MACRO_ends[MACRO_id];
-	play_finished = false;
-}
-
-void tdm_record_start(void);
-void tdm_record_key(uint16_t keycode, keyrecord_t* record);
-void tdm_record_delay_start(void);
-void tdm_record_delay(uint16_t keycode);
-void tdm_record_delay_end(void);
-void tdm_record_end(void);
-/**
- * Start recording of the dynamic macro.
- *
- * @param[in]  record  The record of the key that was pressed
+/* Moves the slots after M_id so that slot M_id ends at new_end,
+ * growing or shrinking the space between them.
  */
-void tdm_record_start(void) {
-	uprintf("temporal dynamic macro: recording into macro# %d\n", MACRO_id);
-
-	tdm_record_start_user(MACRO_id);
+static void tdm_move_tail(uint16_t M_id, uint16_t new_end) {
+	uint16_t old_end = tdm.starts[M_id + 1];
+	uint16_t tail_length = tdm.starts[TDM_NUM_MACROS] - old_end;
+	memmove(&tdm.pool[new_end], &tdm.pool[old_end], tail_length * sizeof(tdm_keypress_t));
+	for (int i = M_id + 1; i <= TDM_NUM_MACROS; i++) {
+		tdm.starts[i] += new_end - old_end;
+	}
+	//the gap a recording opens is free space, it's counted once the recording ends and closes it
+	if (tdm.current_state != STATE_recording && tdm.starts[TDM_NUM_MACROS] > tdm.counters.high_water) {
+		tdm.counters.high_water = tdm.starts[TDM_NUM_MACROS];
+	}
+}
 
-	clear_keyboard();
-	layer_clear();
-	tdm_reset_iterator();
+#if TDM_LIBRARY_SIZE > 0 || defined(TDM_CONTAINER)
+// CRC-16/CCITT
+static uint16_t tdm_crc16(uint16_t crc, uint8_t byte) {
+	crc ^= (uint16_t)byte << 8;
+	for (uint8_t i = 0; i < 8; i++) {
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
 }
+#endif
 
-/**
- * Record a single key in a dynamic macro.
+#if TDM_LIBRARY_SIZE > 0
+/* Macro library
+ * every recorded macro is also saved to a backing store (EEPROM unless tdm_library_read/write are
+ * overridden), which can hold far more than the RAM pool. The pool then works as a cache:
+ * up to TDM_CACHE_WAYS macros stay resident, the least recently played one is evicted when space
+ * runs out, and a macro that isn't resident is loaded TDM_CACHE_CHUNK entries at a time just ahead
+ * of the playback cursor, so playback starts without waiting for the whole macro.
  *
- * @param macro_buffer[in] The start of the used macro buffer.
- * @param current_pointer[in,out] The current buffer position.
- * @param macro2_end[in] The end of the other macro.
- * @param record[in]	 The current keypress.
+ * The store is a journal: saving a macro appends a record, nothing is ever rewritten in place, so
+ * writes are spread over the whole store and a power cut can at worst lose the record being written.
+ * It's split in two banks (addresses relative to TDM_LIBRARY_ADDR):
+ *   tdm_library_bank_t
+ *   records: tdm_library_record_t followed by its tdm_keypress_t entries, back to back
+ * When the active bank is full the live records are copied to the other one, which becomes active
+ * once its header is written with the next epoch. tdm_init replays the bank with the newest epoch up
+ * to the first record whose CRC doesn't match, keeping the newest record of each slot.
  */
-void tdm_record_key(uint16_t keycode, keyrecord_t* record) {
-	/* If we've just started recording, ignore all the key releases. */
-	
-	static bool got_first_keydown = false;
-	if (!record->event.pressed && !got_first_keydown) {
-		uprintf("temporal dynamic macro: ignoring a leading key-up event\n");
-		return;
-	} else {
-		got_first_keydown = true;
-	}
+#define TDM_LIBRARY_MAGIC (0x7D00 | sizeof(tdm_keypress_t)) //a different entry layout formats the library
+#define TDM_LIBRARY_BANK_SIZE \
+	(sizeof(tdm_library_bank_t) + TDM_NUM_MACROS * sizeof(tdm_library_record_t) + (uint32_t)TDM_LIBRARY_SIZE * sizeof(tdm_keypress_t))
+#define TDM_LIBRARY_BANK_ADDR(bank) ((uint32_t)(bank) * TDM_LIBRARY_BANK_SIZE)
+#define TDM_LIBRARY_RECORD_SIZE(length) (sizeof(tdm_library_record_t) + (uint32_t)(length) * sizeof(tdm_keypress_t))
+#define TDM_SEQ_NEWER(a, b) ((int16_t)((a) - (b)) > 0)
 
-	//TODO
-	//if the pointer is past the neighbor's end, it's overlapping so end the macro and return
-	if (MACRO_iterator - MACRO_direction == MACRO_ends[NEIGHBOR(MACRO_id)]) {
-		tdm_record_end();
-		return;
-	}
-	
-	MACRO_iterator->keycode = keycode;
-	
-	set_flag(MACRO_iterator, FLAG_pressed, record->event.pressed);
-	
-	MACRO_iterator += MACRO_direction;
-	//clear any old data
-	MACRO_iterator->delay_ms = 0;
-	clear_flags(MACRO_iterator);
-	
-	tdm_record_key_user(MACRO_id, keycode);
-	// uprintf("temporal dynamic macro: slot %d length: %d/%d\n", MACRO_id, TDM_CURRENT_LENGTH(MACRO_iterator), TDM_CURRENT_CAPACITY(MACRO_id));
+__attribute__((weak)) void tdm_library_read(uint32_t address, void* data, uint16_t size) {
+	eeprom_read_block(data, (const void*)(TDM_LIBRARY_ADDR + address), size);
 }
+__attribute__((weak)) void tdm_library_write(uint32_t address, const void* data, uint16_t size) {
+	eeprom_update_block(data, (void*)(TDM_LIBRARY_ADDR + address), size);
+}
+// called before a bank is reused, flash backends erase it here. EEPROM doesn't need to
+__attribute__((weak)) void tdm_library_erase(uint32_t address, uint32_t size) {}
 
-void tdm_overwrite_alert(uint16_t keycode) {
-	//dprintln("temporal dynamic macro: stopping to avoid overwriting");
-	//TODO: flash leds or something
+// CRC of everything in a record but its entries
+static uint16_t tdm_record_crc(const tdm_library_record_t* record) {
+	uint16_t crc = 0xFFFF;
+	const uint16_t fields[] = {tdm.library_epoch, record->slot, record->length, record->seq};
+	for (uint8_t i = 0; i < sizeof(fields); i++) {
+		crc = tdm_crc16(crc, ((const uint8_t*)fields)[i]);
+	}
+	return crc;
 }
 
-static inline bool tdm_is_layer_key(uint16_t keycode);
-static inline bool tdm_is_control_key(uint16_t keycode);
+static tdm_library_bank_t tdm_library_bank(uint8_t bank) {
+	tdm_library_bank_t header;
+	tdm_library_read(TDM_LIBRARY_BANK_ADDR(bank), &header, sizeof(header));
+	return header;
+}
 
-void tdm_record_delay_start(void){
-	MACRO_delay_next_key_ms = 0;
-	while (MACRO_iterator != MACRO_start && 
-			(tdm_is_layer_key((MACRO_iterator - MACRO_direction)->keycode))) {
-		uprintf("temporal dynamic macro: trimming : iter %d, kc %d, flags %d\n", MACRO_iterator, MACRO_iterator->keycode, MACRO_iterator->flags);
-		MACRO_iterator -= MACRO_direction;
+// checks the active bank's records, the journal ends before the first one that isn't whole
+static void tdm_library_replay(void) {
+	uint32_t end = TDM_LIBRARY_BANK_ADDR(tdm.library_bank) + TDM_LIBRARY_BANK_SIZE;
+	memset(tdm.library_stored, 0, sizeof(tdm.library_stored));
+	tdm.library_seq = 0;
+	tdm.library_head = TDM_LIBRARY_BANK_ADDR(tdm.library_bank) + sizeof(tdm_library_bank_t);
+	for (;;) {
+		tdm_library_record_t record;
+		if (tdm.library_head + sizeof(record) > end) {
+			break;
+		}
+		tdm_library_read(tdm.library_head, &record, sizeof(record));
+		if (record.slot >= TDM_NUM_MACROS || tdm.library_head + TDM_LIBRARY_RECORD_SIZE(record.length) > end) {
+			break;
+		}
+		uint16_t crc = tdm_record_crc(&record);
+		for (uint32_t i = 0; i < record.length * sizeof(tdm_keypress_t); i++) {
+			uint8_t byte;
+			tdm_library_read(tdm.library_head + sizeof(record) + i, &byte, 1);
+			crc = tdm_crc16(crc, byte);
+		}
+		if (crc != record.crc) { //end of the journal, or a record cut short
+			break;
+		}
+		if (record.length) {
+			tdm.library_stored[record.slot / 8] |= 1u << (record.slot % 8);
+		} else {
+			tdm.library_stored[record.slot / 8] &= ~(1u << (record.slot % 8));
+		}
+		if (!TDM_SEQ_NEWER(tdm.library_seq, record.seq)) {
+			tdm.library_seq = record.seq + 1;
+		}
+		tdm.library_head += TDM_LIBRARY_RECORD_SIZE(record.length);
 	}
 }
 
-/**
- * Record a single key in a dynamic macro.
+/* A slot's newest record. There's no directory in RAM, the record headers are walked instead: every
+ * one up to library_head was checked by tdm_library_replay, and a later record of a slot is always
+ * newer, compacting copies one per slot before anything else is written. While compacting, slots
+ * that aren't copied yet are still in the old bank. Length 0 if the slot has none.
  */
-void tdm_record_delay(uint16_t keycode) {
-	uprintf("recording delay: %d\n", keycode);
-	if (MACRO_delay_next_key_ms > 7200000) { //max delay is 2 hours (ms)
-		return;
-	}
-	int key_val = keycode_to_int(keycode);
-	if (key_val == -1) { 
-		uprintf("temporal dynamic macro: only numeric keys are valid during delay entry");
-		return;
+static tdm_library_slot_t tdm_library_find(uint16_t M_id) {
+	tdm_library_slot_t found = {0};
+	uint8_t bank = tdm.library_bank;
+	uint32_t head = tdm.library_head;
+	for (uint8_t pass = 0; pass <= tdm.compacting && found.address == 0; pass++) {
+		uint32_t address = TDM_LIBRARY_BANK_ADDR(bank) + sizeof(tdm_library_bank_t);
+		while (address < head) {
+			tdm_library_record_t record;
+			tdm_library_read(address, &record, sizeof(record));
+			if (record.slot == M_id) {
+				found = (tdm_library_slot_t){address + sizeof(record), record.length, record.seq};
+			}
+			address += TDM_LIBRARY_RECORD_SIZE(record.length);
+		}
+		bank = !bank;
+		head = tdm.compact_head;
 	}
-	MACRO_delay_next_key_ms *= 10;
-	MACRO_delay_next_key_ms += key_val;
+	return found;
 }
 
-void tdm_record_delay_end(void) {
-	print_macros();
-	//add delay to last pressed key
-	tdm_keypress_t* lookback_iterator = MACRO_iterator;
-	// while (lookback_iterator != MACRO_start && !is_set(lookback_iterator, FLAG_pressed)) {
-	// 	uprintf("temporal dynamic macro: trimming : iter %d, kc %d, flags %d\n", lookback_iterator, lookback_iterator->keycode, lookback_iterator->flags);
-	// 	lookback_iterator -= MACRO_direction;
-	// }
-	uprintf("temporal dynamic macro: ending record delay : iter %d, kc %d, flags %d\n", lookback_iterator, lookback_iterator->keycode, lookback_iterator->flags);
-	lookback_iterator->delay_ms = MACRO_delay_next_key_ms;
-	MACRO_delay_next_key_ms = 0;
+static inline bool tdm_library_stored(uint16_t M_id) {
+	return tdm.library_stored[M_id / 8] & (1u << (M_id % 8));
 }
-/**
- * End recording of the dynamic macro. Essentially just update the
- * pointer to the end of the macro.
- */
-void tdm_record_end(void) {
-	/* Do not save the keys being held when stopping the recording,
-	* i.e. the keys used to access the layer DM_RSTP is on.
-	*/
-	uprintf("temporal dynamic macro: ending record : iter %d, kc %d, flags %d\n", MACRO_iterator, MACRO_iterator->keycode, MACRO_iterator->flags);
-	print_macros();
-	while (MACRO_iterator != MACRO_start && 
-			(!is_set((MACRO_iterator - MACRO_direction), FLAG_pressed) || 
-			 tdm_is_control_key((MACRO_iterator - MACRO_direction)->keycode) || 
-			 tdm_is_layer_key((MACRO_iterator - MACRO_direction)->keycode))) 
-	{
-		uprintf("temporal dynamic macro: trimming : iter %d, kc %d, flags %d\n", (MACRO_iterator - MACRO_direction), (MACRO_iterator - MACRO_direction)->keycode, (MACRO_iterator - MACRO_direction)->flags);
-		MACRO_iterator -= MACRO_direction;
+
+static void tdm_library_init(void) {
+	tdm_library_bank_t banks[2] = {tdm_library_bank(0), tdm_library_bank(1)};
+	bool valid[2] = {banks[0].magic == TDM_LIBRARY_MAGIC, banks[1].magic == TDM_LIBRARY_MAGIC};
+	if (!valid[0] && !valid[1]) {
+		TDM_LOG(LIBRARY_FORMAT);
+		tdm_library_erase(TDM_LIBRARY_BANK_ADDR(0), TDM_LIBRARY_BANK_SIZE);
+		banks[0] = (tdm_library_bank_t){.magic = TDM_LIBRARY_MAGIC, .epoch = 0};
+		tdm_library_write(TDM_LIBRARY_BANK_ADDR(0), &banks[0], sizeof(banks[0]));
+		valid[0] = true;
 	}
-	uprintf("temporal dynamic macro: slot %d saved, length: %d\n", MACRO_id, TDM_CURRENT_LENGTH(MACRO_iterator));
-	MACRO_ends[MACRO_id] = MACRO_iterator;
-	tdm_record_end_user(MACRO_id);
+	tdm.library_bank = !valid[0] || (valid[1] && TDM_SEQ_NEWER(banks[1].epoch, banks[0].epoch));
+	tdm.library_epoch = banks[tdm.library_bank].epoch;
+	tdm_library_replay();
+	TDM_LOG(LIBRARY_MOUNT, tdm.library_bank, tdm.library_epoch,
+			(long)(tdm.library_head - TDM_LIBRARY_BANK_ADDR(tdm.library_bank)));
 }
-bool tdm_state_transition(State next_state);
-void tdm_play_start(void);
-void tdm_play(void);
 
-typedef uint32_t (*DeferCallback)(uint32_t trigger_time, void* cb_arg);
-static uint32_t tdm_delay_callback(uint32_t trigger_time, void* cb_arg);
-static uint32_t tdm_loop_callback(uint32_t trigger_time, void* cb_arg);
+/* Write-behind queue
+ * saving a macro only queues its slot, the record is appended TDM_WRITE_BYTES changed bytes at a
+ * time every TDM_WRITE_INTERVAL ms: first the entries, straight from the pool, then the record header,
+ * whose CRC makes it count. Bytes that already hold the right value are skipped. A slot queued again
+ * before its record is started is only written once. Compacting goes through the same queue, ahead
+ * of the saves, copying entries from the old bank instead of the pool.
+ */
+#define TDM_WRITE_COMPARE (TDM_WRITE_BYTES * 32) //unchanged bytes skipped per tick at most
 
-// we could save this defer_exec slot when not using tap selecto MACRO_id
+static void tdm_cache_saved(uint16_t M_id);
+
+static uint32_t tdm_library_live_size(void) {
+	uint32_t size = sizeof(tdm_library_bank_t);
+	for (uint16_t i = 0; i < TDM_NUM_MACROS; i++) {
+		if (tdm_library_stored(i)) {
+			size += TDM_LIBRARY_RECORD_SIZE(tdm_library_find(i).length);
+		}
+	}
+	return size;
+}
+
+static void tdm_library_compact_start(void) {
+	TDM_LOG(LIBRARY_COMPACT, !tdm.library_bank);
+	tdm.compacting = true;
+	tdm.compact_next = 0;
+	tdm.compact_head = tdm.library_head;
+	tdm.library_bank = !tdm.library_bank;
+	tdm.library_epoch++;
+	tdm.library_head = TDM_LIBRARY_BANK_ADDR(tdm.library_bank) + sizeof(tdm_library_bank_t);
+	tdm_library_erase(TDM_LIBRARY_BANK_ADDR(tdm.library_bank), TDM_LIBRARY_BANK_SIZE);
+}
+
+// every live record is in the new bank, which now takes over
+static void tdm_library_compact_end(void) {
+	tdm_library_bank_t header = {.magic = TDM_LIBRARY_MAGIC, .epoch = tdm.library_epoch};
+	tdm_library_write(TDM_LIBRARY_BANK_ADDR(tdm.library_bank), &header, sizeof(header));
+	tdm.compacting = false;
+}
+
+static bool tdm_library_next_write(void) {
+	while (tdm.compacting) {
+		if (tdm.compact_next == TDM_NUM_MACROS) {
+			tdm_library_compact_end();
+			break;
+		}
+		uint16_t i = tdm.compact_next++;
+		if (tdm_library_stored(i)) {
+			tdm_library_slot_t slot = tdm_library_find(i);
+			tdm.compact_from = slot.address;
+			tdm.write_id = i;
+			tdm.write_record = (tdm_library_record_t){.slot = i, .length = slot.length, .seq = slot.seq};
+			tdm.write_pos = 0;
+			tdm.write_crc = tdm_record_crc(&tdm.write_record);
+			return true;
+		}
+	}
+	for (uint16_t i = 0; i < TDM_NUM_MACROS; i++) {
+		if (!(tdm.library_queued[i / 8] & (1u << (i % 8)))) {
+			continue;
+		}
+		uint16_t length = TDM_SLOT_LENGTH(i);
+		if (length == 0 && !tdm_library_stored(i)) { //nothing to delete
+			tdm.library_queued[i / 8] &= ~(1u << (i % 8));
+			continue;
+		}
+		if (tdm.library_head + TDM_LIBRARY_RECORD_SIZE(length) > TDM_LIBRARY_BANK_ADDR(tdm.library_bank) + TDM_LIBRARY_BANK_SIZE) {
+			//the old copy is kept until the new one is written, both have to fit
+			if (tdm_library_live_size() + TDM_LIBRARY_RECORD_SIZE(length) > TDM_LIBRARY_BANK_SIZE) {
+				TDM_LOG(LIBRARY_FULL, i);
+				tdm.library_queued[i / 8] &= ~(1u << (i % 8));
+				continue;
+			}
+			tdm_library_compact_start(); //still queued, it goes in once the live records are copied
+			return tdm_library_next_write();
+		}
+		tdm.library_queued[i / 8] &= ~(1u << (i % 8));
+		tdm.write_id = i;
+		tdm.write_record = (tdm_library_record_t){.slot = i, .length = length, .seq = tdm.library_seq++};
+		tdm.write_pos = 0;
+		tdm.write_crc = tdm_record_crc(&tdm.write_record);
+		return true;
+	}
+	return false;
+}
+
+// the record's header is written, it's now the newest one of its slot
+static void tdm_library_commit(void) {
+	uint16_t M_id = tdm.write_id;
+	if (tdm.write_record.length) {
+		tdm.library_stored[M_id / 8] |= 1u << (M_id % 8);
+	} else {
+		tdm.library_stored[M_id / 8] &= ~(1u << (M_id % 8));
+	}
+	tdm.library_head += TDM_LIBRARY_RECORD_SIZE(tdm.write_record.length);
+	tdm.write_id = TDM_NUM_MACROS;
+	if (!tdm.compacting) {
+		tdm_cache_saved(M_id);
+	}
+}
+
+// writes up to TDM_WRITE_BYTES changed bytes, returns false once the queue is empty
+static bool tdm_library_write_step(void) {
+	uint8_t written = 0;
+	for (uint16_t compared = 0; written < TDM_WRITE_BYTES && compared < TDM_WRITE_COMPARE; compared++) {
+		if (tdm.write_id == TDM_NUM_MACROS && !tdm_library_next_write()) {
+			return false;
+		}
+		uint32_t body = tdm.write_record.length * sizeof(tdm_keypress_t);
+		if (tdm.write_pos == body + sizeof(tdm_library_record_t)) {
+			tdm_library_commit();
+			continue;
+		}
+		uint32_t address;
+		uint8_t byte;
+		if (tdm.write_pos < body) {
+			address = tdm.library_head + sizeof(tdm_library_record_t) + tdm.write_pos;
+			if (tdm.compacting) {
+				tdm_library_read(tdm.compact_from + tdm.write_pos, &byte, 1);
+			} else {
+				byte = ((const uint8_t*)TDM_SLOT_START(tdm.write_id))[tdm.write_pos];
+			}
+			tdm.write_crc = tdm_crc16(tdm.write_crc, byte);
+			tdm.write_record.crc = tdm.write_crc;
+		} else {
+			address = tdm.library_head + tdm.write_pos - body;
+			byte = ((const uint8_t*)&tdm.write_record)[tdm.write_pos - body];
+		}
+		tdm.write_pos++;
+		uint8_t stored;
+		tdm_library_read(address, &stored, 1);
+		if (stored != byte) {
+			tdm_library_write(address, &byte, 1);
+			written++;
+		}
+	}
+	return true;
+}
+
+static uint32_t tdm_library_write_callback(uint32_t trigger_time, void* cb_arg) {
+	TDM_PROFILE_SCOPE(LIBRARY_WRITE);
+	if (tdm_library_write_step()) {
+		return TDM_WRITE_INTERVAL;
+	}
+	tdm.write_token = INVALID_DEFERRED_TOKEN;
+	return 0;
+}
+
+static void tdm_library_queue(uint16_t M_id) {
+	tdm.library_queued[M_id / 8] |= 1u << (M_id % 8);
+	if (tdm.write_token == INVALID_DEFERRED_TOKEN) {
+		tdm.write_token = defer_exec(TDM_WRITE_INTERVAL, tdm_library_write_callback, NULL);
+	}
+}
+
+// the pool has a newer copy than the library
+static bool tdm_library_pending(uint16_t M_id) {
+	return (tdm.library_queued[M_id / 8] & (1u << (M_id % 8))) || (M_id == tdm.write_id && !tdm.compacting);
+}
+
+/* The slot is being re-recorded, what's in the pool isn't worth writing anymore. A record already
+ * being written is abandoned: its header goes last, so the journal ends before it like after a power
+ * cut, and the next record is written over it.
+ */
+static void tdm_library_unqueue(uint16_t M_id) {
+	tdm.library_queued[M_id / 8] &= ~(1u << (M_id % 8));
+	if (M_id == tdm.write_id && !tdm.compacting) {
+		tdm.write_id = TDM_NUM_MACROS;
+	}
+}
+
+bool tdm_library_dirty(void) {
+	if (tdm.write_id != TDM_NUM_MACROS || tdm.compacting) {
+		return true;
+	}
+	for (uint16_t i = 0; i < sizeof(tdm.library_queued); i++) {
+		if (tdm.library_queued[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// writes everything that's queued right away
+void tdm_library_flush(void) {
+	while (tdm_library_write_step()) {
+	}
+	cancel_deferred_exec(tdm.write_token);
+	tdm.write_token = INVALID_DEFERRED_TOKEN;
+}
+
+/* Resident macros, most recently played first. A macro only has entries in the pool while it's
+ * listed here. TDM_CACHE_UNSAVED marks one the library doesn't have yet, because it's still queued
+ * or didn't fit, which must not be evicted.
+ */
+#define TDM_CACHE_UNSAVED 0x8000
+
+static void tdm_cache_drop(uint8_t way) {
+	uint16_t M_id = tdm.lru[way] & ~TDM_CACHE_UNSAVED;
+	tdm_move_tail(M_id, tdm.starts[M_id]);
+	tdm.lru_count--;
+	memmove(&tdm.lru[way], &tdm.lru[way + 1], (tdm.lru_count - way) * sizeof(tdm.lru[0]));
+}
+
+// evicts the least recently played saved macro other than keep, false if there is none
+static bool tdm_cache_evict(uint16_t keep) {
+	for (uint8_t way = tdm.lru_count; way-- > 0;) {
+		if (tdm.lru[way] != keep && !(tdm.lru[way] & TDM_CACHE_UNSAVED)) {
+			tdm_cache_drop(way);
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint8_t tdm_cache_way(uint16_t M_id) {
+	uint8_t way = 0;
+	while (way < tdm.lru_count && (tdm.lru[way] & ~TDM_CACHE_UNSAVED) != M_id) {
+		way++;
+	}
+	return way;
+}
+
+/* Makes sure the macro has a way, false if every way holds an unsaved macro: one still waiting to be
+ * written, or one the library had no room for, which only lives in RAM and is never dropped.
+ * Nothing waits for the library here, writing it can take seconds on EEPROM.
+ */
+static bool tdm_cache_make_way(uint16_t M_id) {
+	if (tdm_cache_way(M_id) != tdm.lru_count || tdm.lru_count < TDM_CACHE_WAYS || tdm_cache_evict(M_id)) {
+		return true;
+	}
+	tdm.counters.cache_refused++;
+	TDM_LOG(CACHE_UNSAVED, TDM_CACHE_WAYS, M_id);
+	return false;
+}
+
+// moves the macro to the front of the list, adding it if it isn't resident (make a way first)
+static void tdm_cache_touch(uint16_t M_id, bool unsaved) {
+	uint8_t way = tdm_cache_way(M_id);
+	if (way == tdm.lru_count) {
+		tdm.lru[tdm.lru_count] = M_id;
+		way = tdm.lru_count++;
+	}
+	uint16_t entry = tdm.lru[way] | (unsaved ? TDM_CACHE_UNSAVED : 0);
+	memmove(&tdm.lru[1], &tdm.lru[0], way * sizeof(tdm.lru[0]));
+	tdm.lru[0] = entry;
+}
+
+// the library has caught up with the pool, the macro can be evicted again
+static void tdm_cache_saved(uint16_t M_id) {
+	uint8_t way = tdm_cache_way(M_id);
+	if (way != tdm.lru_count) {
+		tdm.lru[way] &= ~TDM_CACHE_UNSAVED;
+	}
+}
+
+/* Makes the selected macro playable: resident ones only move up the list, otherwise room is made for
+ * the whole macro and loading starts. Returns false if it can't fit in the pool, or not until the
+ * macros waiting to be written are (queued macros can't be evicted).
+ */
+static bool tdm_cache_prepare(void) {
+	tdm.loaded = tdm.load_length = 0;
+	if (TDM_SLOT_LENGTH(tdm.id)) {
+		tdm_cache_touch(tdm.id, false);
+		return true;
+	}
+	if (!tdm_library_stored(tdm.id) || tdm_library_pending(tdm.id)) { //pending here means deleted but not written yet
+		return true;
+	}
+	tdm_library_slot_t slot = tdm_library_find(tdm.id);
+	if (!tdm_cache_make_way(tdm.id)) {
+		TDM_LOG(CACHE_NO_ROOM, tdm.id);
+		return false;
+	}
+	tdm_cache_touch(tdm.id, false);
+	while (TDM_BUFFER_SIZE - tdm.starts[TDM_NUM_MACROS] < slot.length) {
+		if (!tdm_cache_evict(tdm.id)) {
+			TDM_LOG(CACHE_NO_ROOM, tdm.id);
+			return false;
+		}
+	}
+	tdm_move_tail(tdm.id, tdm.starts[tdm.id] + slot.length); //reserved now, filled while playing
+	tdm.load_length = slot.length;
+	tdm.load_address = slot.address;
+	return true;
+}
+
+// keeps at least a chunk loaded ahead of the playback cursor
+static inline void tdm_cache_fill(void) {
+	if (tdm.loaded == tdm.load_length || tdm.start + tdm.loaded - tdm.iterator >= TDM_CACHE_CHUNK) {
+		return;
+	}
+	uint16_t count = tdm.load_length - tdm.loaded < TDM_CACHE_CHUNK ? tdm.load_length - tdm.loaded : TDM_CACHE_CHUNK;
+	tdm_library_read(tdm.load_address + tdm.loaded * sizeof(tdm_keypress_t), tdm.start + tdm.loaded,
+			count * sizeof(tdm_keypress_t));
+	tdm.loaded += count;
+	tdm.end = tdm.start + tdm.loaded;
+}
+
+// a macro stopped before it was fully loaded isn't kept
+static void tdm_cache_abort(void) {
+	if (tdm.loaded != tdm.load_length) {
+		tdm_cache_drop(0);
+	}
+	tdm.loaded = tdm.load_length = 0;
+}
+
+// every saved macro is evicted so the recording gets all the free space, false if it has no way
+static bool tdm_cache_record_start(void) {
+	if (!tdm_cache_make_way(tdm.id)) {
+		return false;
+	}
+	tdm_library_unqueue(tdm.id);
+	while (tdm_cache_evict(tdm.id)) {
+	}
+	tdm_cache_touch(tdm.id, true);
+	return true;
+}
+
+// stays unsaved until the write queue gets to it
+static void tdm_cache_record_end(void) {
+	tdm_library_queue(tdm.id);
+	if (TDM_SLOT_LENGTH(tdm.id) == 0) {
+		tdm_cache_drop(0);
+	}
+}
+#endif
+
+// if a macro was recorded on the keyboard, whether or not it's in RAM
+static bool tdm_is_recorded(uint16_t M_id) {
+#if TDM_LIBRARY_SIZE > 0
+	return TDM_SLOT_LENGTH(M_id) || (!tdm_library_pending(M_id) && tdm_library_stored(M_id));
+#else
+	return TDM_SLOT_LENGTH(M_id);
+#endif
+}
+
+#ifdef TDM_CONTAINER
+/* Container image
+ * mounted from memory-mapped flash and played in place: while a macro of the image plays, tdm.start
+ * and tdm.end point into it. Nothing writes through them during playback, the const is only cast
+ * away to share the iterator with the pool. The layout checks below make the image's events
+ * readable as tdm_keypress_t.
+ */
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && sizeof(tdm_keypress_t) == sizeof(tdm_container_event_t) &&
+		offsetof(tdm_keypress_t, keycode) == offsetof(tdm_container_event_t, keycode) &&
+		offsetof(tdm_keypress_t, time_ms) == offsetof(tdm_container_event_t, time_ms) &&
+		offsetof(tdm_keypress_t, flags) == offsetof(tdm_container_event_t, flags) &&
+		offsetof(tdm_keypress_t, repeat) == offsetof(tdm_container_event_t, repeat) &&
+		offsetof(tdm_keypress_t, interval) == offsetof(tdm_container_event_t, interval),
+		"temporal dynamic macro: TDM_CONTAINER needs a little-endian 32 bit target (ARM) or a host build");
+
+#ifdef TDM_BYTECODE
+// every instruction is whole and known, blocks are balanced and the last byte is the final END
+static bool tdm_bytecode_check(const uint8_t* code, uint16_t length) {
+	uint8_t depth = 0;
+	for (uint16_t i = 0; i < length;) {
+		uint8_t op = code[i];
+		if (op > TDM_OP_LAST && !(op & TDM_OP_WAIT)) {
+			return false;
+		}
+		i += 1 + TDM_OP_OPERANDS(op);
+		if (i > length) {
+			return false;
+		}
+		if (op == TDM_OP_REPEAT && (++depth > TDM_VM_DEPTH || code[i - 1] == 0)) {
+			return false;
+		}
+		if (op == TDM_OP_NEXT && depth-- == 0) {
+			return false;
+		}
+		if (op == TDM_OP_END && depth == 0) {
+			return i == length;
+		}
+	}
+	return false;
+}
+#endif
+
+#ifdef TDM_LZ
+// the tokens stay inside the stream, decode to exactly length entries and never reach before its start
+static bool tdm_lz_check(const uint8_t* stream, uint32_t room, uint16_t length) {
+	const tdm_container_lz_t* lz = (const tdm_container_lz_t*)stream;
+	if (room < sizeof(*lz) || room - sizeof(*lz) < lz->packed) {
+		return false;
+	}
+	const uint8_t* token = stream + sizeof(*lz);
+	const uint8_t* end = token + lz->packed;
+	uint32_t produced = 0;
+	while (token != end) {
+		if (*token & TDM_LZ_MATCH) {
+			if (end - token < 2 || token[1] + 1u > produced) {
+				return false;
+			}
+			produced += (*token & ~TDM_LZ_MATCH) + TDM_LZ_MIN_MATCH;
+			token += 2;
+		} else {
+			if (end - token - 1 < *token + 1) {
+				return false;
+			}
+			produced += *token + 1;
+			token += *token + 2;
+		}
+	}
+	return produced == (uint32_t)length * sizeof(tdm_container_event_t);
+}
+#endif
+
+// the structure is sound: every macro lies inside the image, aligned, in a slot that exists
+static bool tdm_container_check(const tdm_container_header_t* header, uint32_t size) {
+	if (((uintptr_t)header & 3) || size < sizeof(*header) || header->magic != TDM_CONTAINER_MAGIC ||
+			header->version != TDM_CONTAINER_VERSION || header->event_size != sizeof(tdm_container_event_t) ||
+			header->size > size || header->size < sizeof(*header) + (uint32_t)header->slot_count * sizeof(tdm_container_slot_t)) {
+		return false;
+	}
+	const tdm_container_slot_t* slots = (const tdm_container_slot_t*)(header + 1);
+	for (uint16_t i = 0; i < header->slot_count; i++) {
+		uint32_t bytes = slots[i].kind == TDM_CONTAINER_EVENTS ? slots[i].length * sizeof(tdm_container_event_t) :
+				slots[i].kind == TDM_CONTAINER_LZ ? sizeof(tdm_container_lz_t) : sizeof(tdm_container_program_t) + slots[i].length;
+		if (slots[i].slot >= TDM_NUM_MACROS || (i > 0 && slots[i].slot <= slots[i - 1].slot) || (slots[i].offset & 3) ||
+				slots[i].offset > header->size || header->size - slots[i].offset < bytes) {
+			return false;
+		}
+#ifdef TDM_BYTECODE
+		if (slots[i].kind == TDM_CONTAINER_BYTECODE &&
+				tdm_bytecode_check((const uint8_t*)header + slots[i].offset + sizeof(tdm_container_program_t), slots[i].length)) {
+			continue;
+		}
+#endif
+#ifdef TDM_LZ
+		if (slots[i].kind == TDM_CONTAINER_LZ &&
+				tdm_lz_check((const uint8_t*)header + slots[i].offset, header->size - slots[i].offset, slots[i].length)) {
+			continue;
+		}
+#endif
+		if (slots[i].kind != TDM_CONTAINER_EVENTS) { //or a program this build can't play
+			return false;
+		}
+	}
+	uint16_t crc = 0xFFFF;
+	for (uint32_t i = sizeof(*header); i < header->size; i++) {
+		crc = tdm_crc16(crc, ((const uint8_t*)header)[i]);
+	}
+	return crc == header->crc;
+}
+
+bool tdm_container_mount(const void* image, uint32_t size) {
+	tdm.container = NULL;
+	tdm.container_slots = NULL;
+	if (image == NULL) {
+		return true;
+	}
+	if (!tdm_container_check(image, size)) {
+		TDM_LOG(CONTAINER_INVALID);
+		return false;
+	}
+	tdm.container = image;
+	tdm.container_slots = (const tdm_container_slot_t*)(tdm.container + 1);
+	TDM_LOG(CONTAINER_MOUNT, tdm.container->slot_count);
+	return true;
+}
+
+// the image's macro for a slot, NULL if there is none
+static const tdm_container_slot_t* tdm_container_find(uint16_t M_id) {
+	if (tdm.container == NULL) {
+		return NULL;
+	}
+	uint16_t low = 0;
+	uint16_t high = tdm.container->slot_count;
+	while (low != high) {
+		uint16_t middle = low + (high - low) / 2;
+		if (tdm.container_slots[middle].slot < M_id) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < tdm.container->slot_count && tdm.container_slots[low].slot == M_id ? &tdm.container_slots[low] : NULL;
+}
+
+// the one a slot plays, as long as nothing was recorded in it
+static const tdm_container_slot_t* tdm_container_macro(uint16_t M_id) {
+	return tdm.container == NULL || tdm_is_recorded(M_id) ? NULL : tdm_container_find(M_id);
+}
+
+#	ifdef TDM_BYTECODE
+static inline const tdm_container_program_t* tdm_container_program(const tdm_container_slot_t* image) {
+	return (const tdm_container_program_t*)((const uint8_t*)tdm.container + image->offset);
+}
+#	endif
+#endif
+
+#ifdef TDM_LZ
+/* Compressed macros
+ * are decoded while they play, TDM_LZ_CHUNK entries at a time into tdm.lz.chunk, which tdm.start
+ * and tdm.end then span. The next chunk is decoded as soon as playback is past the last one.
+ * Matches reach back at most TDM_LZ_WINDOW bytes, so only that many decoded bytes are kept.
+ */
+static void tdm_lz_fill(void) {
+	if (tdm.iterator != tdm.end || tdm.lz.left == 0) {
+		return;
+	}
+	uint8_t count = tdm.lz.left < TDM_LZ_CHUNK ? tdm.lz.left : TDM_LZ_CHUNK;
+	//decoded straight into the chunk, the state is kept in locals meanwhile
+	uint8_t* out = (uint8_t*)tdm.lz.chunk;
+	uint8_t* end = out + count * sizeof(tdm_keypress_t);
+	const uint8_t* source = tdm.lz.source;
+	uint8_t run = tdm.lz.run;
+	uint16_t distance = tdm.lz.distance;
+	uint8_t head = tdm.lz.head;
+	while (out != end) {
+		if (run == 0) {
+			uint8_t token = *source++;
+			if (token & TDM_LZ_MATCH) {
+				run = (token & ~TDM_LZ_MATCH) + TDM_LZ_MIN_MATCH;
+				distance = *source++ + 1;
+			} else {
+				run = token + 1;
+				distance = 0;
+			}
+		}
+		run--;
+		uint8_t byte = distance ? tdm.lz.window[(uint8_t)(head - distance)] : *source++;
+		tdm.lz.window[head++] = byte;
+		*out++ = byte;
+	}
+	tdm.lz.source = source;
+	tdm.lz.run = run;
+	tdm.lz.distance = distance;
+	tdm.lz.head = head;
+	for (uint8_t i = 0; i < count; i++) {
+		tdm.lz.time += tdm.lz.chunk[i].time_ms; //delta coded
+		tdm.lz.chunk[i].time_ms = tdm.lz.time;
+	}
+	tdm.lz.left -= count;
+	tdm.start = tdm.iterator = tdm.lz.chunk;
+	tdm.end = tdm.lz.chunk + count;
+}
+
+static void tdm_lz_start(const tdm_container_slot_t* image) {
+	tdm.lz.stream = (const tdm_container_lz_t*)((const uint8_t*)tdm.container + image->offset);
+	tdm.lz.source = (const uint8_t*)(tdm.lz.stream + 1);
+	tdm.lz.left = image->length;
+	tdm.lz.run = 0;
+	tdm.lz.head = 0;
+	tdm.lz.time = 0;
+	tdm.start = tdm.iterator = tdm.end = tdm.lz.chunk;
+	tdm_lz_fill();
+}
+#endif
+
+// if a slot holds a macro, wherever it's kept
+static bool tdm_has_macro(uint16_t M_id) {
+#ifdef TDM_CONTAINER
+	const tdm_container_slot_t* image = tdm_container_macro(M_id);
+	if (image) {
+		return image->length;
+	}
+#endif
+	return tdm_is_recorded(M_id);
+}
+
+// next (step 1) or previous (step -1) slot that holds a macro, or M_id if there is none
+static uint16_t tdm_find_macro(uint16_t M_id, int8_t step) {
+	uint16_t i = M_id;
+	for (uint16_t n = 0; n < TDM_NUM_MACROS; n++) {
+		i = step > 0 ? (i + 1 == TDM_NUM_MACROS ? 0 : i + 1) : (i == 0 ? TDM_NUM_MACROS - 1 : i - 1);
+		if (tdm_has_macro(i)) {
+			return i;
+		}
+	}
+	return M_id;
+}
+
+/* Trigger bindings
+ * open-addressed hash (linear probing) from a (keycode, mods) chord to the macro slot it plays.
+ * There are twice as many buckets as bindings so probe chains stay short, and tdm.binding_filter,
+ * one bit per low keycode byte, answers the usual "this key isn't bound" with a single bit test.
+ */
+static inline uint8_t tdm_binding_hash(uint16_t keycode, uint8_t mods) {
+	uint16_t hash = (keycode ^ ((uint16_t)mods << 11)) * 40503u;
+	return (hash >> 8) & (TDM_BINDING_BUCKETS - 1);
+}
+
+static inline bool tdm_binding_filtered(uint16_t keycode) {
+	return tdm.binding_filter[(keycode & 0xFF) >> 3] & (1 << (keycode & 7));
+}
+
+// bucket of the binding for the chord, or -1
+static int8_t tdm_binding_find(uint16_t keycode, uint8_t mods) {
+	if (!tdm_binding_filtered(keycode)) {
+		return -1;
+	}
+	//the table is never more than half full, so there is always an empty bucket to stop at
+	for (uint8_t i = tdm_binding_hash(keycode, mods);; i = (i + 1) & (TDM_BINDING_BUCKETS - 1)) {
+		if (tdm.bindings[i].keycode == KC_NO) {
+			return -1;
+		}
+		if (tdm.bindings[i].keycode == keycode && tdm.bindings[i].mods == mods) {
+			return i;
+		}
+	}
+}
+
+static void tdm_binding_rebuild_filter(void) {
+	memset(tdm.binding_filter, 0, sizeof(tdm.binding_filter));
+	for (uint8_t i = 0; i < TDM_BINDING_BUCKETS; i++) {
+		uint16_t keycode = tdm.bindings[i].keycode;
+		if (keycode != KC_NO) {
+			tdm.binding_filter[(keycode & 0xFF) >> 3] |= 1 << (keycode & 7);
+		}
+	}
+}
+
+// removes the binding in bucket i, shifting back the entries that probed past it
+static void tdm_unbind(uint8_t i) {
+	for (uint8_t j = (i + 1) & (TDM_BINDING_BUCKETS - 1); tdm.bindings[j].keycode != KC_NO;
+			j = (j + 1) & (TDM_BINDING_BUCKETS - 1)) {
+		uint8_t home = tdm_binding_hash(tdm.bindings[j].keycode, tdm.bindings[j].mods);
+		if (((j - home) & (TDM_BINDING_BUCKETS - 1)) >= ((j - i) & (TDM_BINDING_BUCKETS - 1))) {
+			tdm.bindings[i] = tdm.bindings[j];
+			i = j;
+		}
+	}
+	tdm.bindings[i].keycode = KC_NO;
+	tdm.binding_count--;
+	tdm_binding_rebuild_filter();
+}
+
+/* Binds the chord to the selected macro, replacing its previous binding.
+ * Binding an empty macro from idle removes the chord's binding instead.
+ */
+static void tdm_bind(uint16_t keycode, uint8_t mods) {
+	int8_t found = tdm_binding_find(keycode, mods);
+	if (tdm.bind_return == STATE_idle && !tdm_has_macro(tdm.id)) {
+		if (found >= 0) {
+			tdm_unbind(found);
+			TDM_LOG(UNBOUND, mods, keycode);
+		}
+		return;
+	}
+	if (found < 0) {
+		if (tdm.binding_count == TDM_NUM_BINDINGS) {
+			TDM_LOG(BINDINGS_FULL, TDM_NUM_BINDINGS);
+			return;
+		}
+		found = tdm_binding_hash(keycode, mods);
+		while (tdm.bindings[found].keycode != KC_NO) {
+			found = (found + 1) & (TDM_BINDING_BUCKETS - 1);
+		}
+		tdm.binding_count++;
+		tdm.binding_filter[(keycode & 0xFF) >> 3] |= 1 << (keycode & 7);
+	}
+	tdm.bindings[found] = (tdm_binding_t){.keycode = keycode, .slot = tdm.id, .mods = mods};
+	TDM_LOG(BOUND, mods, keycode, tdm.id);
+}
+
+void tdm_bind_start(void) {
+	tdm.bind_return = tdm.previous_state;
+	TDM_LOG(BIND_START, tdm.id);
+}
+
+void tdm_record_end(void);
+void tdm_bind_end(void) {
+	if (tdm.current_state == STATE_idle && tdm.bind_return == STATE_recording) {
+		tdm_record_end(); //cancelled a binding made while recording, the recording ends too
+	}
+}
+
+void tdm_reset_iterator(void) {
+	if (tdm.played_layers) {
+		layer_and(~tdm.played_layers);
+		tdm.played_layers = 0;
+	}
+	tdm.start = TDM_SLOT_START(tdm.id);
+	tdm.iterator = tdm.start;
+	tdm.end = TDM_SLOT_END(tdm.id);
+#if TDM_LIBRARY_SIZE > 0
+	if (tdm.loaded != tdm.load_length) {
+		tdm.end = tdm.start + tdm.loaded;
+	}
+#endif
+#ifdef TDM_BYTECODE
+	tdm.vm.pc = NULL;
+#endif
+#ifdef TDM_LZ
+	tdm.lz.left = 0;
+#endif
+#ifdef TDM_CONTAINER
+	const tdm_container_slot_t* image = tdm_container_macro(tdm.id);
+	if (image && tdm.current_state != STATE_recording) {
+#	ifdef TDM_BYTECODE
+		if (image->kind == TDM_CONTAINER_BYTECODE) { //the slot stays empty, tdm_play runs the program instead
+			tdm.vm = (tdm_vm_t){.pc = (const uint8_t*)(tdm_container_program(image) + 1)};
+		} else
+#	endif
+#	ifdef TDM_LZ
+		if (image->kind == TDM_CONTAINER_LZ) {
+			tdm_lz_start(image);
+		} else
+#	endif
+		{
+			tdm.start = (tdm_keypress_t*)((const uint8_t*)tdm.container + image->offset);
+			tdm.iterator = tdm.start;
+			tdm.end = tdm.start + image->length;
+		}
+	}
+#endif
+	tdm.run_played = 0;
+	tdm.play_finished = false;
+	tdm.play_started = false;
+}
+
+void tdm_record_start(void);
+void tdm_record_key(uint16_t keycode, keyrecord_t* record);
+void tdm_record_delay_start(void);
+void tdm_record_delay(uint16_t keycode);
+void tdm_record_delay_end(void);
+void tdm_record_end(void);
+bool tdm_state_transition(State next_state);
+static bool tdm_play_binding(uint16_t keycode);
+#ifdef POINTING_DEVICE_ENABLE
+static void tdm_record_motion_start(void);
+#endif
+/**
+ * Start recording of the dynamic macro.
+ *
+ * @param[in]  record  The record of the key that was pressed
+ */
+void tdm_record_start(void) {
+	TDM_LOG(RECORD_START, tdm.id);
+#if TDM_LIBRARY_SIZE > 0
+	if (!tdm_cache_record_start()) { //the cache is full of macros waiting to be written, try again later
+		TDM_LOG(RECORD_NO_SPACE);
+		tdm.current_state = STATE_idle; //nothing to end, the slot is untouched
+		return;
+	}
+#endif
+
+	tdm_record_start_user(tdm.id);
+
+	clear_keyboard();
+	layer_clear();
+	tdm.layers = layer_state;
+	tdm.held_mods = tdm.recorded_mods = 0;
+	memset(tdm.chords, 0, sizeof(tdm.chords));
+	tdm.chord_mods = 0;
+	tdm.got_first_keydown = false;
+	//the old recording is dropped and all the free space is opened up after this slot
+	tdm_move_tail(tdm.id, TDM_BUFFER_SIZE - (tdm.starts[TDM_NUM_MACROS] - tdm.starts[tdm.id + 1]));
+	tdm_reset_iterator();
+	if (tdm.iterator == tdm.end) {
+		TDM_LOG(RECORD_NO_SPACE);
+		tdm_state_transition(STATE_idle);
+		return;
+	}
+	tdm.iterator->delay_ms = 0;
+	clear_flags(tdm.iterator);
+#ifdef POINTING_DEVICE_ENABLE
+	tdm_record_motion_start();
+#endif
+}
+
+/**
+ * Append one entry at the iterator, keeping any delay already entered for it.
+ * Ends the recording and returns NULL when the macro would run into the next slot.
+ */
+static bool tdm_record_layers(void);
+void tdm_overwrite_alert(uint16_t keycode);
+static tdm_keypress_t* tdm_record_append(uint16_t keycode, uint8_t flags) {
+	//the layers the entry was made on come first
+	if ((flags & FLAG_KIND_MASK) != EVENT_layer && !tdm_record_layers()) {
+		return NULL;
+	}
+	//the entry after this one has to fit too, it holds the delay being entered
+	if (tdm.iterator + 1 >= tdm.end) {
+		tdm.counters.overflows++;
+		tdm_overwrite_alert(keycode);
+		tdm_state_transition(STATE_idle);
+		return NULL;
+	}
+	tdm_keypress_t* entry = tdm.iterator;
+	entry->keycode = keycode;
+	entry->flags = flags;
+	entry->repeat = 0;
+	entry->interval = 0;
+	tdm.counters.events_recorded++;
+
+	tdm.iterator++;
+	//clear any old data
+	tdm.iterator->delay_ms = 0;
+	clear_flags(tdm.iterator);
+	return entry;
+}
+
+/* Layer keys are handled by QMK after TDM sees them, so the change they make is only visible
+ * to the next recorded entry, which stores it first. This also keeps a layer held across a delay.
+ * Entries that extend the previous one store the change first too, so they don't extend past it.
+ * False if the macro ran out of space, which ended the recording.
+ */
+static bool tdm_record_layers(void) {
+	layer_state_t changed = layer_state ^ tdm.layers;
+	for (uint8_t layer = 0; changed; layer++, changed >>= 1) {
+		if (!(changed & 1)) {
+			continue;
+		}
+		bool on = (layer_state >> layer) & 1;
+		if (tdm_record_append(layer | (on ? LAYER_on : 0), EVENT_layer) == NULL) {
+			return false;
+		}
+		tdm.layers ^= (layer_state_t)1 << layer;
+	}
+	return true;
+}
+
+/**
+ * Record a modifier change. Changes with nothing in between (e.g. pressing ctrl then shift)
+ * are folded into the previous mods entry, so a chord's modifiers cost one entry and one report.
+ */
+static void tdm_record_mods(uint8_t added, uint8_t removed) {
+	tdm.held_mods = (tdm.held_mods & ~removed) | added;
+	if (removed & tdm.chord_mods) { //the chord is all they were held for
+		tdm.chord_mods = 0;
+	}
+	removed &= tdm.recorded_mods; //modifiers only chords used were never pressed in the macro
+	if (!added && !removed) {
+		return;
+	}
+	tdm.recorded_mods = (tdm.recorded_mods & ~removed) | added;
+	if (!tdm_record_layers()) {
+		return;
+	}
+	tdm_keypress_t* previous = tdm.iterator - 1;
+	if (tdm.iterator != tdm.start && event_kind(previous) == EVENT_mods && tdm.iterator->delay_ms == 0) {
+		//removal is applied before addition, so a later removal cancels an earlier addition
+		uint8_t previous_added = (previous->keycode & 0xFF) & ~removed;
+		uint8_t previous_removed = (previous->keycode >> 8) | removed;
+		previous->keycode = (previous_added | added) | ((uint16_t)previous_removed << 8);
+		return;
+	}
+	tdm_record_append(added | ((uint16_t)removed << 8), EVENT_mods);
+}
+
+/* Chords
+ * a basic key pressed right after modifiers, with no delay in between, is stored as one QK_MODS
+ * keycode, like LCTL(KC_C), and the modifier change is folded into it, so ctrl+c takes two entries
+ * instead of four. It's played with register_code16, which applies them as weak mods for that key
+ * only, and the modifiers' release isn't recorded since the macro never pressed them. Modifiers
+ * that are still held when something else is pressed were held for more than the chord: it's
+ * turned back into a modifier change and a plain key (see tdm_record_unfold), and the macro holds
+ * them from there, so a held modifier never drops between keys. QK_MODS holds the modifiers of one
+ * side only, other combinations are recorded as modifier changes.
+ */
+static inline uint16_t tdm_chord(uint8_t key, uint8_t mods) {
+	uint8_t side = mods & 0xF0 ? (mods >> 4) | 0x10 : mods; //the 5 bit mods of QK_MODS
+	return key | (uint16_t)side << 8;
+}
+
+static inline uint8_t tdm_chord_mods(uint16_t keycode) {
+	uint8_t mods = QK_MODS_GET_MODS(keycode);
+	return mods & 0x10 ? (mods & 0x0F) << 4 : mods; //5 bit QK_MODS mods to a report's 8
+}
+
+/* The last chord's modifiers are still held as something else is pressed: a modifier change goes
+ * back in before its press, which takes its delay, and the chord's entries become the plain key.
+ * Without room for that entry the chord stays, and the modifiers are pressed again after it.
+ */
+static void tdm_record_unfold(void) {
+	uint8_t mods = tdm.chord_mods;
+	if (mods == 0) {
+		return;
+	}
+	tdm.chord_mods = 0;
+	if (tdm.iterator + 2 >= tdm.end) {
+		return;
+	}
+	uint8_t key = QK_MODS_GET_BASIC_KEYCODE(tdm.chord_key);
+	for (uint8_t way = 0; way < TDM_CHORD_KEYS; way++) {
+		if (tdm.chords[way] == tdm.chord_key) { //still down, its release is the plain key's
+			tdm.chords[way] = key;
+		}
+	}
+	tdm_keypress_t* entry = tdm.iterator;
+	while (entry-- != tdm.start) {
+		if (event_kind(entry) == EVENT_key && entry->keycode == tdm.chord_key) {
+			entry->keycode = key;
+			if (is_set(entry, FLAG_pressed)) {
+				break;
+			}
+		}
+	}
+	memmove(entry + 1, entry, (tdm.iterator + 1 - entry) * sizeof(tdm_keypress_t)); //the delay being entered too
+	*entry = (tdm_keypress_t){.keycode = mods, .delay_ms = (entry + 1)->delay_ms, .flags = EVENT_mods};
+	(entry + 1)->delay_ms = 0;
+	tdm.iterator++;
+	tdm.recorded_mods |= mods;
+	tdm.counters.events_recorded++;
+}
+
+static uint16_t tdm_record_chord_press(uint16_t keycode) {
+	tdm_record_unfold();
+	uint8_t held = tdm.held_mods & ~tdm.recorded_mods; //still held after a chord they were folded into
+	if (held) {
+		tdm_record_mods(held, 0);
+		return keycode;
+	}
+	tdm_keypress_t* previous = tdm.iterator - 1;
+	uint8_t folded = 0;
+	if (tdm.iterator != tdm.start && event_kind(previous) == EVENT_mods && tdm.iterator->delay_ms == 0 &&
+			(previous->keycode >> 8) == 0) {
+		folded = previous->keycode;
+	}
+	uint8_t way = 0;
+	while (way < TDM_CHORD_KEYS && tdm.chords[way] != KC_NO) {
+		way++;
+	}
+	if (folded == 0 || keycode > QK_BASIC_MAX || ((folded & 0x0F) && (folded & 0xF0)) || way == TDM_CHORD_KEYS) {
+		return keycode;
+	}
+	tdm.iterator--; //keeps the delay before the modifier change
+	tdm.recorded_mods &= ~folded;
+	tdm.counters.events_recorded--;
+	keycode = tdm_chord(keycode, folded);
+	tdm.chords[way] = keycode;
+	tdm.chord_key = keycode;
+	tdm.chord_mods = folded;
+	return keycode;
+}
+
+static uint16_t tdm_record_chord_release(uint16_t keycode) {
+	for (uint8_t way = 0; keycode <= QK_BASIC_MAX && way < TDM_CHORD_KEYS; way++) {
+		if (tdm.chords[way] != KC_NO && QK_MODS_GET_BASIC_KEYCODE(tdm.chords[way]) == keycode) {
+			keycode = tdm.chords[way];
+			tdm.chords[way] = KC_NO;
+			break;
+		}
+	}
+	return keycode;
+}
+
+/**
+ * Record one encoder detent. Detents of the same keycode extend the previous entry's run,
+ * and the run's interval is kept at the average spacing so the sweep lasts as long as recorded.
+ * The keycode already holds the direction (the encoder map has one per direction).
+ */
+static void tdm_record_encoder(uint16_t keycode) {
+	uint32_t elapsed = timer_elapsed32(tdm.encoder_last);
+	tdm.encoder_last = timer_read32();
+	tdm_record_unfold();
+	if (!tdm_record_layers()) {
+		return;
+	}
+
+	tdm_keypress_t* previous = tdm.iterator - 1;
+	bool after_sweep = tdm.iterator != tdm.start && event_kind(previous) == EVENT_encoder &&
+			previous->keycode == keycode;
+	if (after_sweep && tdm.iterator->delay_ms == 0 && previous->repeat < UINT8_MAX && elapsed <= UINT8_MAX) {
+		previous->interval = (previous->interval * previous->repeat + elapsed) / (previous->repeat + 1);
+		previous->repeat++;
+		return;
+	}
+	tdm_keypress_t* entry = tdm_record_append(keycode, EVENT_encoder);
+	if (entry != NULL && after_sweep && entry->delay_ms == 0) { //keep the pause between two sweeps
+		entry->delay_ms = elapsed;
+	}
+}
+
+/**
+ * Record a single key in a dynamic macro.
+ *
+ * @param macro_buffer[in] The start of the used macro buffer.
+ * @param current_pointer[in,out] The current buffer position.
+ * @param macro2_end[in] The end of the other macro.
+ * @param record[in]	 The current keypress.
+ */
+void tdm_record_key(uint16_t keycode, keyrecord_t* record) {
+	TDM_PROFILE_SCOPE(RECORD_KEY);
+	/* If we've just started recording, ignore all the key releases. */
+	
+	if (!record->event.pressed && !tdm.got_first_keydown) {
+		TDM_LOG(RECORD_LEADING_KEYUP);
+		return;
+	} else {
+		tdm.got_first_keydown = true;
+	}
+
+	if (record->event.type == ENCODER_CW_EVENT || record->event.type == ENCODER_CCW_EVENT) {
+		if (record->event.pressed) { //the encoder map releases right away, one entry covers the detent
+			tdm_record_encoder(keycode);
+		}
+		return;
+	}
+
+	if (IS_MODIFIER_KEYCODE(keycode)) {
+		uint8_t mod = MOD_BIT(keycode);
+		tdm_record_mods(record->event.pressed ? mod : 0, record->event.pressed ? 0 : mod);
+	} else {
+		uint16_t recorded = record->event.pressed ? tdm_record_chord_press(keycode) : tdm_record_chord_release(keycode);
+		if (tdm_record_append(recorded, EVENT_key | (record->event.pressed ? FLAG_pressed : 0)) == NULL) {
+			return;
+		}
+	}
+
+	tdm_record_key_user(tdm.id, keycode);
+	// uprintf("temporal dynamic macro: slot %d length: %d/%d\n", tdm.id, TDM_CURRENT_LENGTH(tdm.iterator), TDM_CURRENT_CAPACITY(tdm.id));
+}
+
+#ifdef POINTING_DEVICE_ENABLE
+/* Pointing device recording
+ * motion is summed over windows of TDM_MOUSE_REPORT_INTERVAL ms and each window is stored as one
+ * (dx, dy) step. A step equal to the previous one in the next window extends that entry's run
+ * instead of using a new entry, so a steady sweep costs one entry.
+ */
+static inline int8_t tdm_clamp_motion(int16_t value) {
+	return value > INT8_MAX ? INT8_MAX : value < -INT8_MAX ? -INT8_MAX : (int8_t)value;
+}
+
+static void tdm_record_motion_start(void) {
+	tdm.motion_x = 0;
+	tdm.motion_y = 0;
+	tdm.motion_window = timer_read();
+	tdm.motion_last = timer_read32();
+	tdm.mouse_buttons = 0;
+}
+
+static void tdm_record_motion(void) {
+	int8_t dx = tdm_clamp_motion(tdm.motion_x);
+	int8_t dy = tdm_clamp_motion(tdm.motion_y);
+	tdm.motion_x -= dx; //anything over the step size is carried into the next window
+	tdm.motion_y -= dy;
+	uint16_t step = (uint8_t)dx | ((uint16_t)(uint8_t)dy << 8);
+	uint32_t elapsed = timer_elapsed32(tdm.motion_last);
+	tdm.motion_last = timer_read32();
+	tdm_record_unfold();
+	if (!tdm_record_layers()) {
+		return;
+	}
+
+	tdm_keypress_t* previous = tdm.iterator - 1;
+	bool after_motion = tdm.iterator != tdm.start && event_kind(previous) == EVENT_motion;
+	if (after_motion && previous->keycode == step && tdm.iterator->delay_ms == 0 &&
+			previous->repeat < UINT8_MAX && elapsed < 2 * TDM_MOUSE_REPORT_INTERVAL) {
+		previous->repeat++;
+		return;
+	}
+	tdm_keypress_t* entry = tdm_record_append(step, EVENT_motion);
+	if (entry == NULL) {
+		return;
+	}
+	entry->interval = TDM_MOUSE_REPORT_INTERVAL;
+	if (after_motion && entry->delay_ms == 0) { //keep the pause between two separate sweeps
+		entry->delay_ms = elapsed;
+	}
+}
+
+report_mouse_t tdm_pointing_device_task(report_mouse_t mouse_report) {
+	if (tdm.current_state != STATE_recording) {
+		return mouse_report;
+	}
+	//buttons on the sensor itself don't go through process_record, store them as mouse keycodes
+	uint8_t changed = (mouse_report.buttons ^ tdm.mouse_buttons) & 0x1F;
+	tdm.mouse_buttons = mouse_report.buttons;
+	for (uint8_t i = 0; changed; i++, changed >>= 1) {
+		if (changed & 1) {
+			if ((mouse_report.buttons >> i) & 1) {
+				tdm_record_unfold();
+			}
+			tdm_record_append(KC_BTN1 + i, EVENT_key | ((mouse_report.buttons >> i) & FLAG_pressed));
+		}
+		if (tdm.current_state != STATE_recording) { //the button ran the macro out of space
+			return mouse_report;
+		}
+	}
+
+	tdm.motion_x += mouse_report.x;
+	tdm.motion_y += mouse_report.y;
+	if (timer_elapsed(tdm.motion_window) >= TDM_MOUSE_REPORT_INTERVAL) {
+		tdm.motion_window = timer_read();
+		if (tdm.motion_x || tdm.motion_y) {
+			tdm_record_motion();
+		}
+	}
+	return mouse_report;
+}
+#endif
+
+void tdm_overwrite_alert(uint16_t keycode) {
+	//dprintln("temporal dynamic macro: stopping to avoid overwriting");
+	//TODO: flash leds or something
+}
+
+static inline bool tdm_is_layer_key(uint16_t keycode);
+static inline bool tdm_is_control_key(uint16_t keycode);
+
+//a layer held through the delay is stored with the next entry, nothing to trim here
+void tdm_record_delay_start(void){
+	tdm.delay_next_key_ms = 0;
+}
+
+/**
+ * Record a single key in a dynamic macro.
+ */
+void tdm_record_delay(uint16_t keycode) {
+	TDM_LOG(RECORD_DELAY_KEY, keycode);
+	if (tdm.delay_next_key_ms > 7200000) { //max delay is 2 hours (ms)
+		return;
+	}
+	int key_val = keycode_to_int(keycode);
+	if (key_val == -1) { 
+		TDM_LOG(DELAY_INVALID_KEY);
+		return;
+	}
+	tdm.delay_next_key_ms *= 10;
+	tdm.delay_next_key_ms += key_val;
+}
+
+void tdm_record_delay_end(void) {
+	print_macros();
+	//add delay to last pressed key
+	tdm_keypress_t* lookback_iterator = tdm.iterator;
+	// while (lookback_iterator != tdm.start && !is_set(lookback_iterator, FLAG_pressed)) {
+	// 	uprintf("temporal dynamic macro: trimming : iter %d, kc %d, flags %d\n", lookback_iterator, lookback_iterator->keycode, lookback_iterator->flags);
+	// 	lookback_iterator--;
+	// }
+	TDM_LOG(RECORD_DELAY_END, (int)(lookback_iterator - tdm.pool), lookback_iterator->keycode, lookback_iterator->flags);
+	lookback_iterator->delay_ms = tdm.delay_next_key_ms;
+	tdm.delay_next_key_ms = 0;
+}
+/* Compiles the recorded delays into the macro's timeline: each entry gets the time it plays at, in ms
+ * from the start of the macro, the later plays of a run following every interval. Playback then only
+ * compares times, and the end of the macro or any point in it is a lookup away.
+ */
+static void tdm_record_timeline(void) {
+	uint32_t time = 0;
+	for (tdm_keypress_t* entry = tdm.start; entry != tdm.iterator; entry++) {
+		time += entry->delay_ms;
+		entry->time_ms = time;
+		time += (uint32_t)entry->repeat * entry->interval;
+	}
+}
+
+/**
+ * End recording of the dynamic macro. Essentially just update the
+ * pointer to the end of the macro.
+ */
+void tdm_record_end(void) {
+	/* Do not save the keys being held when stopping the recording,
+	* i.e. the keys used to access the layer DM_RSTP is on.
+	*/
+	TDM_LOG(RECORD_END, (int)(tdm.iterator - tdm.pool), tdm.iterator->keycode, tdm.iterator->flags);
+	print_macros();
+	while (tdm.iterator != tdm.start && event_kind(tdm.iterator - 1) == EVENT_key &&
+			(!is_set((tdm.iterator - 1), FLAG_pressed) || 
+			 tdm_is_control_key((tdm.iterator - 1)->keycode) || 
+			 tdm_is_layer_key((tdm.iterator - 1)->keycode))) 
+	{
+		TDM_LOG(RECORD_TRIM, (int)(tdm.iterator - 1 - tdm.pool), (tdm.iterator - 1)->keycode, (tdm.iterator - 1)->flags);
+		tdm.iterator--;
+	}
+	TDM_LOG(RECORD_SAVED, tdm.id, (int)TDM_CURRENT_LENGTH(tdm.iterator));
+	tdm_record_timeline();
+	tdm_move_tail(tdm.id, tdm.iterator - tdm.pool); //close the gap
+	tdm.end = tdm.iterator;
+#ifdef POINTING_DEVICE_ENABLE
+	tdm_record_motion_start(); //motion left over isn't carried into the next recording
+#endif
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_record_end();
+#endif
+	tdm_record_end_user(tdm.id);
+}
+void tdm_play_start(void);
+void tdm_play(void);
+
+typedef uint32_t (*DeferCallback)(uint32_t trigger_time, void* cb_arg);
+static uint32_t tdm_delay_callback(uint32_t trigger_time, void* cb_arg);
+static uint32_t tdm_loop_callback(uint32_t trigger_time, void* cb_arg);
+
+// we could save this defer_exec slot when not using tap selecto tdm.id
 // if there's a way to interrupt a blocking loop, or if we disable looping
-static deferred_token play_token = INVALID_DEFERRED_TOKEN;
-static deferred_token delay_token = INVALID_DEFERRED_TOKEN;
+// remembers when playback needs the CPU next, for tdm_lowpower_idle_ms
+static inline void tdm_wake_at(uint32_t delay_ms) {
+#ifdef TDM_LOWPOWER
+	tdm.wake_at = timer_read32() + delay_ms;
+#endif
+}
 static inline void tdm_clear_tokens(void) {
-	if (play_token != INVALID_DEFERRED_TOKEN) {
-		cancel_deferred_exec(play_token);
-		play_token = INVALID_DEFERRED_TOKEN;
+	if (tdm.play_token != INVALID_DEFERRED_TOKEN) {
+		cancel_deferred_exec(tdm.play_token);
+		tdm.play_token = INVALID_DEFERRED_TOKEN;
+	}
+	if (tdm.delay_token != INVALID_DEFERRED_TOKEN) {
+		cancel_deferred_exec(tdm.delay_token);
+		tdm.delay_token = INVALID_DEFERRED_TOKEN;
+	}
+}
+
+/* Keeps track of the chords playback holds down. Returns the modifiers of keycode a press adds,
+ * or those a release may let go of: the ones no other held chord needs.
+ */
+static uint8_t tdm_play_chord(uint16_t keycode, bool pressed) {
+	uint8_t others = 0;
+	bool tracked = keycode <= QK_BASIC_MAX || keycode > QK_MODS_MAX;
+	for (uint8_t way = 0; way < TDM_CHORD_KEYS; way++) {
+		if (!tracked && tdm.played_chords[way] == (pressed ? KC_NO : keycode)) {
+			tdm.played_chords[way] = pressed ? keycode : KC_NO;
+			tracked = true;
+		} else if (tdm.played_chords[way] != KC_NO) {
+			others |= tdm_chord_mods(tdm.played_chords[way]);
+		}
+	}
+	return tdm_chord_mods(keycode) & (pressed ? 0xFF : ~others);
+}
+
+#ifdef TDM_REPORT_MIX
+/* Report mixing
+ * playback presses keys in a report of its own, and the host driver is wrapped to merge it into
+ * every keyboard report on the way out: keys ORed in, modifiers united. The user keeps typing while
+ * a macro plays, and neither stream clears the other. What tdm_play presses and releases goes out
+ * in one report at the end of the call. An entry that changes a key or modifier the report already
+ * changed would cancel it out before the host sees it, a tap would be lost: it waits for the next
+ * tick instead (see tdm_mix_ready).
+ * Keycodes that aren't in the keyboard report (media, mouse, QMK's own) still go through
+ * register_code16.
+ */
+static void tdm_mix_send_keyboard(report_keyboard_t* report) {
+	report_keyboard_t mixed = *report;
+	mixed.mods |= tdm.mix_report.mods | tdm.mix_weak_mods;
+	for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (tdm.mix_report.keys[i]) {
+			add_key_byte(&mixed, tdm.mix_report.keys[i]);
+		}
+	}
+	tdm.mix_send_keyboard(&mixed);
+}
+
+#	ifdef NKRO_ENABLE
+static void tdm_mix_send_nkro(report_nkro_t* report) {
+	report_nkro_t mixed = *report;
+	mixed.mods |= tdm.mix_report.mods | tdm.mix_weak_mods;
+	for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (tdm.mix_report.keys[i]) {
+			add_key_bit(&mixed, tdm.mix_report.keys[i]);
+		}
+	}
+	tdm.mix_send_nkro(&mixed);
+}
+#	endif
+
+// the host driver is only set once the USB stack is up, after tdm_init, so it's wrapped at play start
+static void tdm_mix_attach(void) {
+	host_driver_t* driver = host_get_driver();
+	if (driver == NULL || driver == &tdm.mix_driver) {
+		return;
+	}
+	tdm.mix_driver = *driver;
+	tdm.mix_send_keyboard = driver->send_keyboard;
+	tdm.mix_driver.send_keyboard = tdm_mix_send_keyboard;
+#	ifdef NKRO_ENABLE
+	tdm.mix_send_nkro = driver->send_nkro;
+	tdm.mix_driver.send_nkro = tdm_mix_send_nkro;
+#	endif
+	host_set_driver(&tdm.mix_driver);
+}
+
+// resends the user's last report, with the macro's merged in
+static void tdm_mix_send(void) {
+	tdm.mix_pending = false;
+	tdm.mix_touched_count = 0;
+	tdm.mix_touched_mods = 0;
+#	ifdef NKRO_ENABLE
+	if (keymap_config.nkro) {
+		host_nkro_send(nkro_report);
+		return;
+	}
+#	endif
+	host_keyboard_send(keyboard_report);
+}
+
+static inline void tdm_mix_flush(void) {
+	if (tdm.mix_pending) {
+		tdm_mix_send();
+	}
+}
+
+// if the report being built can take a change of key (KC_NO for none) and mods
+static bool tdm_mix_fits(uint8_t key, uint8_t mods) {
+	if (mods & tdm.mix_touched_mods) {
+		return false;
+	}
+	if (key == KC_NO) {
+		return true;
+	}
+	for (uint8_t i = 0; i < tdm.mix_touched_count; i++) {
+		if (tdm.mix_touched[i] == key) {
+			return false;
+		}
+	}
+	return tdm.mix_touched_count < KEYBOARD_REPORT_KEYS;
+}
+
+// notes the change, a change that doesn't fit sends the report before it (bytecode can't wait a tick)
+static void tdm_mix_touch(uint8_t key, uint8_t mods) {
+	if (!tdm_mix_fits(key, mods)) {
+		tdm_mix_send();
 	}
-	if (delay_token != INVALID_DEFERRED_TOKEN) {
-		cancel_deferred_exec(delay_token);
-		delay_token = INVALID_DEFERRED_TOKEN;
+	if (key != KC_NO) {
+		tdm.mix_touched[tdm.mix_touched_count++] = key;
 	}
+	tdm.mix_touched_mods |= mods;
+	tdm.mix_pending = true;
 }
 
-void tdm_play_start(void) {
+// false if the entry has to wait for the next report, see tdm_mix_touch
+static bool tdm_mix_ready(tdm_keypress_t* keypress) {
+	if (event_kind(keypress) == EVENT_mods) {
+		return tdm_mix_fits(KC_NO, (keypress->keycode & 0xFF) | (keypress->keycode >> 8));
+	}
+	uint8_t key = QK_MODS_GET_BASIC_KEYCODE(keypress->keycode);
+	if (event_kind(keypress) != EVENT_key || keypress->keycode > QK_MODS_MAX) {
+		return true;
+	}
+	if (IS_MODIFIER_KEYCODE(key)) {
+		return tdm_mix_fits(KC_NO, tdm_chord_mods(keypress->keycode) | MOD_BIT(key));
+	}
+	return !IS_BASIC_KEYCODE(key) || tdm_mix_fits(key, tdm_chord_mods(keypress->keycode));
+}
+
+static void tdm_mix_mods(uint8_t added, uint8_t removed) {
+	tdm_mix_touch(KC_NO, added | removed);
+	tdm.mix_report.mods = (tdm.mix_report.mods & ~removed) | added;
+}
+
+// false for keycodes that have no place in the keyboard report
+static bool tdm_mix_key(uint16_t keycode, bool pressed) {
+	uint8_t key = QK_MODS_GET_BASIC_KEYCODE(keycode);
+	if (keycode > QK_MODS_MAX || !(IS_BASIC_KEYCODE(key) || IS_MODIFIER_KEYCODE(key))) {
+		return false;
+	}
+	uint8_t mods = tdm_play_chord(keycode, pressed);
+	if (IS_MODIFIER_KEYCODE(key)) {
+		mods |= MOD_BIT(key);
+	}
+	tdm_mix_touch(IS_BASIC_KEYCODE(key) ? key : KC_NO, mods);
+	if (IS_BASIC_KEYCODE(key)) {
+		(pressed ? add_key_byte : del_key_byte)(&tdm.mix_report, key);
+	}
+	tdm.mix_weak_mods = pressed ? tdm.mix_weak_mods | mods : tdm.mix_weak_mods & ~mods;
+	return true;
+}
+
+// if the macro holds a key or modifier
+static bool tdm_mix_holds(void) {
+	if (tdm.mix_report.mods || tdm.mix_weak_mods) {
+		return true;
+	}
+	for (uint8_t i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (tdm.mix_report.keys[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// releases everything the macro holds, the user's keys stay down
+static void tdm_mix_clear(void) {
+	if (!tdm_mix_holds()) {
+		return;
+	}
+	memset(&tdm.mix_report, 0, sizeof(tdm.mix_report));
+	tdm.mix_weak_mods = 0;
+	tdm_mix_send();
+}
+#endif
+
+/* Modifiers the user held when playback started.
+ * With TDM_REPORT_MIX the macro has a report of its own, and the user's modifiers are left alone.
+ * Otherwise the macro plays on clean modifiers, so the OS sees the user's drop when it starts.
+ * Modifier keys pressed or released during playback update the saved ones, and those still
+ * held are put back in the same report that releases the macro's keys.
+ */
+static void tdm_save_mods(void) {
+#ifdef TDM_REPORT_MIX
+	tdm_mix_attach();
+#else
+	if (tdm.mods_saved) { //restarting a loop, the macro's own modifiers are active now
+		return;
+	}
+	tdm.saved_mods = get_mods();
+	tdm.saved_oneshot_mods = get_oneshot_mods();
+	tdm.mods_saved = true;
+	clear_oneshot_mods();
 	clear_keyboard();
+#endif
+}
+
+static void tdm_track_mods(uint16_t keycode, bool pressed) {
+#ifndef TDM_REPORT_MIX
+	if (!tdm.mods_saved || !IS_MODIFIER_KEYCODE(keycode)) {
+		return;
+	}
+	uint8_t mod = MOD_BIT(keycode);
+	tdm.saved_mods = pressed ? tdm.saved_mods | mod : tdm.saved_mods & ~mod;
+#endif
+}
+
+static void tdm_restore_mods(void) {
+	memset(tdm.played_chords, 0, sizeof(tdm.played_chords));
+#ifdef TDM_REPORT_MIX
+	tdm_mix_clear();
+#else
+	if (!tdm.mods_saved) {
+		clear_keyboard();
+		return;
+	}
+	set_mods(tdm.saved_mods);
+	set_oneshot_mods(tdm.saved_oneshot_mods);
+	tdm.mods_saved = false;
+	clear_keyboard_but_mods(); //releases the macro's keys and sends the restored modifiers in one report
+#endif
+}
+
+/* Timing of the macro being played, resolved from the config once at play start
+ * so the playback path only does plain reads
+ */
+static void tdm_resolve_config(void) {
+	const tdm_macro_config_t* found = tdm_macro_config(tdm.id, false);
+	tdm_macro_config_t macro = found ? *found : (tdm_macro_config_t){0};
+	uint16_t debounce_ms = tdm.config.debounce_ms;
+	uint16_t loop_gap_ms = tdm.config.loop_gap_ms;
+	uint8_t time_scale = tdm.config.time_scale;
+#ifdef TDM_CONTAINER
+	const tdm_container_slot_t* image = tdm_container_macro(tdm.id);
+	if (image) { //the image's timing comes after the slot's own, before the global one
+		debounce_ms = tdm_override(image->debounce_ms, debounce_ms);
+		loop_gap_ms = tdm_override(image->loop_gap_ms, loop_gap_ms);
+		time_scale = tdm_override(image->time_scale, time_scale);
+	}
+#endif
+	tdm.debounce_ms = tdm_override(macro.debounce_ms, debounce_ms);
+	tdm.loop_gap_ms = tdm_override(macro.loop_gap_ms, loop_gap_ms);
+	tdm.time_scale = tdm_override(macro.time_scale, time_scale);
+}
+
+// when a point of the timeline plays at the macro's speed, 32 bit math good for 74 hours
+static inline uint32_t tdm_scale_time(uint32_t time_ms) {
+	return (time_ms >> 4) * tdm.time_scale + (((time_ms & 15) * tdm.time_scale) >> 4);
+}
+
+// one run of the selected macro at normal speed, the end of its last entry
+static uint32_t tdm_macro_duration(void) {
+#ifdef TDM_BYTECODE
+	if (tdm.vm.pc != NULL) { //worked out by the compiler
+		return tdm_container_program(tdm_container_macro(tdm.id))->duration_ms;
+	}
+#endif
+#ifdef TDM_LZ
+	if (tdm.start == tdm.lz.chunk) { //only a chunk is there
+		return tdm.lz.stream->duration_ms;
+	}
+#endif
+	if (TDM_SLOT_LENGTH(tdm.id) == 0) {
+#ifdef TDM_CONTAINER
+		if (tdm.start != tdm.end) { //played out of the image, all of it is there
+			return (tdm.end - 1)->time_ms + (uint32_t)(tdm.end - 1)->repeat * (tdm.end - 1)->interval;
+		}
+#endif
+		return 0;
+	}
+	tdm_keypress_t last = *(TDM_SLOT_END(tdm.id) - 1);
+#if TDM_LIBRARY_SIZE > 0
+	if (tdm.loaded != tdm.load_length) { //not in the pool yet
+		tdm_library_read(tdm.load_address + (tdm.load_length - 1) * sizeof(tdm_keypress_t), &last, sizeof(last));
+	}
+#endif
+	return last.time_ms + (uint32_t)last.repeat * last.interval;
+}
+
+void tdm_play_start(void) {
+	tdm_resolve_config();
+	tdm_save_mods();
+#ifndef TDM_REPORT_MIX //the user's layers stay on while the macro plays next to them
 	layer_clear();
-	uprintf("SAFE_RANGE: %d\n", TURBO);
-	tdm_play_user(MACRO_id);
+#endif
+	TDM_LOG(SAFE_RANGE, TURBO);
+	tdm_play_user(tdm.id);
+#if TDM_LIBRARY_SIZE > 0
+	if (!tdm_cache_prepare()) {
+		tdm_state_transition(STATE_idle);
+		return;
+	}
+#endif
 	tdm_reset_iterator();
-	uprintf("play start: %d -> %d (Macro_iterator) %d\n", MACRO_start, MACRO_end, MACRO_iterator);
+	tdm.play_duration = tdm_macro_duration();
+	TDM_LOG(PLAY_START, tdm.id, (int)(tdm.end - tdm.start), (int)(tdm.iterator - tdm.start));
 	tdm_play();
-	if (play_finished){ //only go to idle if it's not waiting on a delay
-		uprintf("not in a delay\n");
+	if (tdm.play_finished){ //only go to idle if it's not waiting on a delay
+		TDM_LOG(NOT_IN_DELAY);
 		tdm_clear_tokens();
 		tdm_state_transition(STATE_idle);
 	}
 }
 
 void tdm_loop_start(void) {
-	tdm_play_user(MACRO_id);
-	if (play_token != INVALID_DEFERRED_TOKEN) { //restart if already looping or delayed
+	tdm_resolve_config();
+	tdm_save_mods();
+	tdm_play_user(tdm.id);
+	if (tdm.play_token != INVALID_DEFERRED_TOKEN) { //restart if already looping or delayed
 		tdm_clear_tokens();
 	}
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_abort();
+	if (!tdm_cache_prepare()) {
+		tdm_state_transition(STATE_idle);
+		return;
+	}
+#endif
+	tdm.staged_id = TDM_NUM_MACROS;
+	tdm_reset_iterator();
+	tdm.play_duration = tdm_macro_duration();
+	TDM_LOG(LOOP_START, tdm.id, (int)(tdm.end - tdm.start), (int)(tdm.iterator - tdm.start));
+	tdm.play_token = defer_exec(tdm.debounce_ms + (tdm.debounce_ms == 0), tdm_loop_callback, NULL);
+	tdm_wake_at(tdm.debounce_ms);
+}
+
+/* Armed start
+ * everything play start does that takes time, the blocking feedback and loading the start of a
+ * macro from the library included, is done when TDM_ARM is released. Pressing TDM_PLAY then only
+ * has to clear the modifiers and play, so the first report goes out in the same scan.
+ */
+void tdm_arm_start(void) {
+	tdm_resolve_config();
+	tdm_play_user(tdm.id);
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_abort(); //re-arming
+	if (!tdm_cache_prepare()) {
+		tdm_state_transition(STATE_idle);
+		return;
+	}
+#endif
 	tdm_reset_iterator();
-	uprintf("loop start: %d -> %d (Macro_iterator) %d\n", MACRO_start, MACRO_end, MACRO_iterator);
-	play_token = defer_exec(TDM_DEBOUNCE_DELAY, tdm_loop_callback, NULL);
+	tdm.play_duration = tdm_macro_duration();
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_fill();
+#endif
+	TDM_LOG(ARMED, tdm.id);
+}
+
+void tdm_arm_fire(void) {
+	tdm_save_mods();
+#ifndef TDM_REPORT_MIX
+	layer_clear();
+#endif
+	tdm_play();
+	if (tdm.play_finished) {
+		tdm_clear_tokens();
+		tdm_state_transition(STATE_idle);
+	}
+}
+
+void tdm_arm_cancel(void) {
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_abort();
+#endif
+	tdm_play_stop_user(tdm.id);
+}
+
+/* Hot swap
+ * a macro staged while another one loops takes over at the next loop boundary: only the playback
+ * descriptor (slot, bounds and timing) changes, between two runs, so the loop keeps its pace and
+ * no entries are copied. Staging again before the boundary replaces the staged macro.
+ */
+bool tdm_loop_stage(uint16_t M_id) {
+	if (tdm.current_state != STATE_looping || M_id >= TDM_NUM_MACROS || !tdm_has_macro(M_id)) {
+		return false;
+	}
+	tdm.staged_id = M_id == tdm.id ? TDM_NUM_MACROS : M_id;
+	TDM_LOG(STAGED, M_id);
+	return true;
+}
+
+/* False if the staged macro can't be loaded, the old one then keeps looping. Making room for the
+ * staged one may have evicted it, so it's prepared again, and the loop stops if that fails too.
+ */
+static bool tdm_loop_swap(void) {
+	uint16_t previous_id = tdm.id;
+	tdm.id = tdm.staged_id;
+	tdm.staged_id = TDM_NUM_MACROS;
+#if TDM_LIBRARY_SIZE > 0
+	if (!tdm_cache_prepare()) {
+		tdm.id = previous_id;
+		if (!tdm_cache_prepare()) {
+			tdm_state_transition(STATE_idle);
+		}
+		return false;
+	}
+#endif
+	tdm_resolve_config();
+	TDM_LOG(SWAPPED, previous_id, tdm.id);
+	return true;
 }
 
 static uint32_t tdm_delay_callback(uint32_t trigger_time, void* cb_arg) {
-	uprintf("play debounce\n");
+	TDM_PROFILE_SCOPE(DELAY_CALLBACK);
+	tdm_counters_lateness(trigger_time);
+	TDM_LOG(PLAY_DEBOUNCE);
 	tdm_play();
-	if (play_finished) { //only go to idle if it's not waiting on a delay
-		uprintf("done with delay\n");
+	if (tdm.play_finished) { //only go to idle if it's not waiting on a delay
+		TDM_LOG(DELAY_DONE);
 		tdm_state_transition(STATE_idle);
 		tdm_clear_tokens();
 	}
@@ -522,55 +2593,448 @@ static uint32_t tdm_delay_callback(uint32_t trigger_time, void* cb_arg) {
 }
 
 static uint32_t tdm_loop_callback(uint32_t trigger_time, void* cb_arg) {
-	uprintf("play loop: t= %d\n", trigger_time);
+	TDM_PROFILE_SCOPE(LOOP_CALLBACK);
+	tdm_counters_lateness(trigger_time);
+	TDM_LOG(PLAY_LOOP, (long)trigger_time);
 	tdm_play();
 	//since a delay ends tdm_play and schedules another one, looping needs to pause
 	// 
-	if (play_finished) {
+	if (tdm.play_finished) {
+		tdm.counters.loops_completed++;
+		bool swapped = tdm.staged_id != TDM_NUM_MACROS && tdm_loop_swap();
+		if (tdm.current_state != STATE_looping) { //neither macro could be loaded
+			return 0;
+		}
 		tdm_reset_iterator(); // start loop at beginning
-		return TDM_DEBOUNCE_DELAY;
+		if (swapped) {
+			tdm.play_duration = tdm_macro_duration();
+		}
+		tdm_wake_at(tdm.loop_gap_ms);
+		return tdm.loop_gap_ms;
 	} else {
 		return 0;
 	}
 }
+static void tdm_play_layer(uint8_t change) {
+	uint8_t layer = change & ~LAYER_on;
+	if (change & LAYER_on) {
+		layer_on(layer);
+		tdm.played_layers |= (layer_state_t)1 << layer;
+	} else {
+		layer_off(layer);
+		tdm.played_layers &= ~((layer_state_t)1 << layer);
+	}
+}
+
+static void tdm_play_mods(uint16_t change) {
+#ifdef TDM_REPORT_MIX
+	tdm_mix_mods(change & 0xFF, change >> 8);
+#else
+	del_mods(change >> 8);
+	add_mods(change & 0xFF);
+	send_keyboard_report();
+#endif
+}
+
+static void tdm_play_motion(uint16_t step) {
+#ifdef POINTING_DEVICE_ENABLE
+	report_mouse_t report = pointing_device_get_report();
+	report.x += (int8_t)(step & 0xFF);
+	report.y += (int8_t)(step >> 8);
+	pointing_device_set_report(report);
+	pointing_device_send();
+#endif
+}
+
 void tdm_play_key(tdm_keypress_t* keypress) {
-	if(is_set(keypress, FLAG_pressed)) {
-		register_code(keypress->keycode);
-	} else if( !is_set(keypress, FLAG_pressed)) {
-		unregister_code(keypress->keycode);
+	tdm_play_trace_user(tdm.id, event_kind(keypress) >> 1, keypress->keycode, is_set(keypress, FLAG_pressed), timer_read32());
+	switch (event_kind(keypress)) {
+		case EVENT_motion:
+			tdm_play_motion(keypress->keycode);
+			break;
+		case EVENT_encoder:
+			tap_code16(keypress->keycode);
+			break;
+		case EVENT_layer:
+			tdm_play_layer(keypress->keycode);
+			break;
+		case EVENT_mods:
+			tdm_play_mods(keypress->keycode);
+			break;
+		default:
+#ifdef TDM_REPORT_MIX
+			if (tdm_mix_key(keypress->keycode, is_set(keypress, FLAG_pressed))) {
+				break;
+			}
+#endif
+			if(is_set(keypress, FLAG_pressed)) {
+				tdm_play_chord(keypress->keycode, true);
+				register_code16(keypress->keycode);
+			} else { //the same chord without the modifiers another one still holds
+				uint16_t keycode = keypress->keycode;
+				uint8_t mods = tdm_play_chord(keycode, false);
+				unregister_code16(keycode > QK_MODS_MAX ? keycode : tdm_chord(QK_MODS_GET_BASIC_KEYCODE(keycode), mods));
+			}
+			break;
+	}
+}
+
+//continue playing or looping the macro after delaying, but don't block
+// use defer exec instead of wait so it's possible to cancel play/loop
+static void tdm_play_defer(uint32_t delay_ms) {
+	DeferCallback tdm_continue = tdm.current_state == STATE_looping ? tdm_loop_callback : tdm_delay_callback;
+	tdm.delay_token = defer_exec(delay_ms + (delay_ms == 0), tdm_continue, NULL);
+	tdm_wake_at(delay_ms);
+}
+
+#ifdef TDM_BYTECODE
+/* Bytecode interpreter
+ * plays a program of the mounted image (opcodes in tdm_container.h) straight from flash, on the
+ * same timeline as recorded macros: waits only move the program's clock, and everything up to the
+ * time that's due plays in one call. Repeats and calls share one stack of TDM_VM_DEPTH frames,
+ * a program that goes deeper than that stops there, and so does one that runs more than
+ * TDM_VM_STEPS instructions, which bounds the work of a call even with nested repeats.
+ */
+static void tdm_vm_emit(uint16_t keycode, uint8_t flags) {
+	if (tdm.vm.silent) {
+		return;
+	}
+	tdm_keypress_t event = {.keycode = keycode, .flags = flags};
+	tdm_play_key(&event);
+	tdm.counters.events_played++;
+}
+
+// plays the program up to elapsed ms into the run, true while it waits for a later instruction
+static bool tdm_vm_run(uint32_t elapsed) {
+	if (tdm_scale_time(tdm.vm.time) > elapsed) { //called early, after a seek
+		return true;
+	}
+	const uint8_t* pc = tdm.vm.pc;
+	while (pc != NULL && tdm.vm.steps != TDM_VM_STEPS) {
+		tdm.vm.steps++;
+		uint8_t op = *pc++;
+		uint8_t operands = TDM_OP_OPERANDS(op);
+		uint16_t operand = operands == 0 ? 0 : operands == 1 ? pc[0] : pc[0] | pc[1] << 8;
+		pc += operands;
+		uint32_t wait = 0;
+		switch (op) {
+			case TDM_OP_PRESS:
+			case TDM_OP_PRESS16:
+				tdm_vm_emit(operand, EVENT_key | FLAG_pressed);
+				break;
+			case TDM_OP_TAP:
+			case TDM_OP_TAP16:
+				tdm_vm_emit(operand, EVENT_key | FLAG_pressed);
+				//fall through
+			case TDM_OP_RELEASE:
+			case TDM_OP_RELEASE16:
+				tdm_vm_emit(operand, EVENT_key);
+				break;
+			case TDM_OP_MODS:
+				if ((uint8_t)operand != tdm.vm.mods) {
+					tdm_vm_emit((operand & ~tdm.vm.mods & 0xFF) | ((tdm.vm.mods & ~operand & 0xFF) << 8), EVENT_mods);
+					tdm.vm.mods = operand;
+				}
+				break;
+			case TDM_OP_WAIT16:
+				wait = operand;
+				break;
+			case TDM_OP_REPEAT:
+				if (tdm.vm.depth == TDM_VM_DEPTH) {
+					pc = NULL;
+					break;
+				}
+				tdm.vm.frames[tdm.vm.depth++] = (tdm_vm_frame_t){pc, operand - 1};
+				break;
+			case TDM_OP_NEXT:
+				if (tdm.vm.frames[tdm.vm.depth - 1].left > 0) {
+					tdm.vm.frames[tdm.vm.depth - 1].left--;
+					pc = tdm.vm.frames[tdm.vm.depth - 1].pc;
+				} else {
+					tdm.vm.depth--;
+				}
+				break;
+			case TDM_OP_CALL: {
+				const tdm_container_slot_t* callee = tdm_container_find(operand);
+				if (tdm.vm.depth == TDM_VM_DEPTH || callee == NULL || callee->kind != TDM_CONTAINER_BYTECODE) {
+					pc = NULL;
+					break;
+				}
+				tdm.vm.frames[tdm.vm.depth++] = (tdm_vm_frame_t){pc, TDM_VM_CALL};
+				pc = (const uint8_t*)(tdm_container_program(callee) + 1);
+				break;
+			}
+			case TDM_OP_END:
+				while (tdm.vm.depth > 0 && tdm.vm.frames[tdm.vm.depth - 1].left != TDM_VM_CALL) { //left from inside a block
+					tdm.vm.depth--;
+				}
+				pc = tdm.vm.depth > 0 ? tdm.vm.frames[--tdm.vm.depth].pc : NULL;
+				break;
+			default: //the image was checked at mount, only TDM_OP_WAIT is left
+				wait = op & ~TDM_OP_WAIT;
+				break;
+		}
+		if (wait) {
+			tdm.vm.time += wait;
+			if (tdm_scale_time(tdm.vm.time) > elapsed) {
+				tdm.vm.pc = pc;
+				return true;
+			}
+		}
 	}
+	tdm.vm.pc = NULL;
+	return false;
 }
+#endif
+
 /**
  * Play the dynamic macro.
  */
 void tdm_play() {
-	uprintf("temporal dynamic macro: playing slot %d \n", MACRO_id);
-	uprintf("play start: %d -> %d (Macro_iterator) %d\n", MACRO_start, MACRO_end, MACRO_iterator);
+	TDM_PROFILE_SCOPE(PLAY);
+	TDM_LOG(PLAYING_SLOT, tdm.id);
+	TDM_LOG(PLAY_START, tdm.id, (int)(tdm.end - tdm.start), (int)(tdm.iterator - tdm.start));
 	
-	//iterates until the end of the macro or until there's a delay
-	while (MACRO_iterator != MACRO_end) {
-		uprintf("iter %d KC: %d, down? %d, delay: %d\n", MACRO_iterator, MACRO_iterator->keycode, (MACRO_iterator->flags)&FLAG_pressed, MACRO_iterator->delay_ms);
-		tdm_play_key(MACRO_iterator);
-		MACRO_iterator += MACRO_direction;
-		if(MACRO_iterator->delay_ms) {
-			uprintf("delaying: %d\n", MACRO_iterator->delay_ms);
-			//continue playing or looping the macro after delaying, but don't block TODO: profiling
-			// use defer exec instead of wait so it's possible to cancel play/loop
-			DeferCallback tdm_continue = MACRO_current_state == STATE_looping ? tdm_loop_callback : tdm_delay_callback;
-			delay_token = defer_exec(MACRO_iterator->delay_ms, tdm_continue, NULL);
+	//plays everything that's due, until the end of the macro or until the next entry isn't
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_fill();
+#endif
+	if (!tdm.play_started) {
+		tdm.play_origin = timer_read32();
+		tdm.play_started = true;
+	}
+	uint32_t elapsed = timer_elapsed32(tdm.play_origin);
+#ifdef TDM_BYTECODE
+	if (tdm.vm.pc != NULL && tdm_vm_run(elapsed)) {
+		uint32_t due = tdm_scale_time(tdm.vm.time);
+#	ifdef TDM_REPORT_MIX
+		tdm_mix_flush();
+#	endif
+		TDM_LOG(PLAY_DELAY, (long)(due - elapsed));
+		tdm_play_defer(due - elapsed);
+		return;
+	}
+#endif
+	while (tdm.iterator != tdm.end) {
+		uint32_t due = tdm_scale_time(tdm.iterator->time_ms + (uint32_t)tdm.run_played * tdm.iterator->interval);
+		if (due > elapsed) { //timed from the start of the run, so late callbacks don't add up
+#ifdef TDM_REPORT_MIX
+			tdm_mix_flush();
+#endif
+			TDM_LOG(PLAY_DELAY, (long)(due - elapsed));
+			tdm_play_defer(due - elapsed);
 			return; //skip clearing the token
-		} 	
+		}
+#ifdef TDM_REPORT_MIX
+		if (!tdm_mix_ready(tdm.iterator)) { //plays in the next tick, after the host got this report
+			tdm_mix_flush();
+			tdm_play_defer(0);
+			return;
+		}
+#endif
+		TDM_LOG(PLAY_KEY, (int)(tdm.iterator - tdm.start), tdm.iterator->keycode, (tdm.iterator->flags)&FLAG_pressed, (long)tdm.iterator->time_ms);
+		tdm_play_key(tdm.iterator);
+		tdm.counters.events_played++;
+		if (tdm.run_played < tdm.iterator->repeat) { //play the rest of the run before moving on
+			tdm.run_played++;
+			continue;
+		}
+		tdm.run_played = 0;
+		tdm.iterator++;
+#if TDM_LIBRARY_SIZE > 0
+		tdm_cache_fill();
+#endif
+#ifdef TDM_LZ
+		tdm_lz_fill();
+#endif
+	}
+#ifdef TDM_REPORT_MIX
+	if (tdm.mix_pending && tdm_mix_holds()) { //released when it stops, in the next tick
+		tdm_mix_flush();
+		tdm_play_defer(0);
+		return;
+	}
+	tdm_mix_flush();
+#endif
+	TDM_LOG(PLAY_FINISHED, tdm.play_finished);
+	tdm.play_finished = true;
+}
+
+static inline bool tdm_is_playing(void) {
+	return tdm.current_state == STATE_playing || tdm.current_state == STATE_looping;
+}
+
+#ifdef TDM_LOWPOWER
+/* Low power
+ * between two entries nothing runs until the pending callback is due, so the board can sleep that
+ * long. If its timer stops while it sleeps, the time it missed moves the start of the run back,
+ * which keeps the rest of the macro on the wall clock, and the callback is rescheduled to match.
+ */
+uint32_t tdm_lowpower_idle_ms(void) {
+	if (tdm.config_token != INVALID_DEFERRED_TOKEN) { //saved in a moment
+		return 0;
+	}
+#	if TDM_LIBRARY_SIZE > 0
+	if (tdm_library_dirty()) { //writes a few bytes every TDM_WRITE_INTERVAL ms
+		return 0;
+	}
+#	endif
+	if (tdm.play_token == INVALID_DEFERRED_TOKEN && tdm.delay_token == INVALID_DEFERRED_TOKEN) {
+		return UINT32_MAX;
+	}
+	int32_t left = tdm.wake_at - timer_read32();
+	return left > 0 ? left : 0;
+}
+
+void tdm_lowpower_wake(uint32_t slept_ms) {
+	if (slept_ms == 0 || !tdm_is_playing()) {
+		return;
+	}
+	int32_t left = tdm.wake_at - timer_read32() - slept_ms;
+	tdm.play_origin -= slept_ms;
+	tdm_clear_tokens();
+	tdm_play_defer(left > 0 ? left : 0);
+}
+#endif
+
+uint32_t tdm_play_remaining(void) {
+	if (!tdm_is_playing()) {
+		return 0;
+	}
+	uint32_t duration = tdm_scale_time(tdm.play_duration);
+	uint32_t elapsed = tdm.play_started ? timer_elapsed32(tdm.play_origin) : 0;
+	return elapsed < duration ? duration - elapsed : 0;
+}
+
+/* Moves playback to ms into the current run: a binary search for the first entry due after it, then
+ * the plays of a run at that point are counted. Entries skipped over aren't sent, and what the macro
+ * holds is released, so the user's own modifiers are only put back when playback stops.
+ */
+bool tdm_play_seek(uint32_t ms) {
+	if (!tdm_is_playing()) {
+		return false;
 	}
-	uprintf("play finished %d\n", play_finished);
-	play_finished = true;
+	tdm_clear_tokens();
+	memset(tdm.played_chords, 0, sizeof(tdm.played_chords));
+#ifdef TDM_REPORT_MIX
+	tdm_mix_clear();
+#else
+	clear_keyboard();
+#endif
+	if (tdm.played_layers) {
+		layer_and(~tdm.played_layers);
+		tdm.played_layers = 0;
+	}
+#ifdef TDM_BYTECODE
+	if (tdm.vm.pc != NULL) { //replayed without playing from the start up to ms
+		tdm_reset_iterator();
+		tdm.vm.silent = true;
+		tdm_vm_run(ms);
+		tdm.vm.silent = false;
+		if (tdm.vm.mods) { //the keyboard was cleared, the program's modifiers go back on
+			tdm_vm_emit(tdm.vm.mods, EVENT_mods);
+		}
+	} else
+#endif
+	{
+#ifdef TDM_LZ
+		if (tdm.start == tdm.lz.chunk) { //decoded again from the start, up to the chunk ms falls in
+			tdm_reset_iterator();
+			while (tdm.lz.left != 0 &&
+					tdm_scale_time((tdm.end - 1)->time_ms + (uint32_t)(tdm.end - 1)->repeat * (tdm.end - 1)->interval) <= ms) {
+				tdm.iterator = tdm.end;
+				tdm_lz_fill();
+			}
+		}
+#endif
+#if TDM_LIBRARY_SIZE > 0
+		//seeking past what's loaded loads the entries in between
+		while (tdm.loaded != tdm.load_length && (tdm.end == tdm.start || tdm_scale_time((tdm.end - 1)->time_ms) <= ms)) {
+			tdm.iterator = tdm.end;
+			tdm_cache_fill();
+		}
+#endif
+		tdm_keypress_t* low = tdm.start;
+		tdm_keypress_t* high = tdm.end;
+		while (low != high) {
+			tdm_keypress_t* middle = low + (high - low) / 2;
+			if (tdm_scale_time(middle->time_ms) <= ms) {
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+		tdm.iterator = low;
+		tdm.run_played = 0;
+		if (low != tdm.start) { //the run of the entry before may still have plays left
+			tdm_keypress_t* previous = low - 1;
+			uint16_t played = 1;
+			while (played <= previous->repeat &&
+					tdm_scale_time(previous->time_ms + (uint32_t)played * previous->interval) <= ms) {
+				played++;
+			}
+			if (played <= previous->repeat) {
+				tdm.iterator = previous;
+				tdm.run_played = played;
+			}
+		}
+	}
+	tdm.play_origin = timer_read32() - ms;
+	tdm.play_started = true;
+	tdm.play_finished = false;
+	tdm_play_defer(0);
+	return true;
 }
 
 // Stops playing (or looping), cancels the callback.
 static void tdm_play_stop(void) {
-	clear_keyboard();
+	tdm.staged_id = TDM_NUM_MACROS;
+	tdm_restore_mods();
+#ifdef TDM_REPORT_MIX
+	layer_and(~tdm.played_layers); //only the layers the macro turned on, the user's stay
+	tdm.played_layers = 0;
+#else
 	layer_clear();
+#endif
 	tdm_clear_tokens();
-	tdm_play_stop_user(MACRO_id);
+#if TDM_LIBRARY_SIZE > 0
+	tdm_cache_abort();
+#endif
+	tdm_play_stop_user(tdm.id);
+}
+
+/* Steps the selected macro's playback speed by a quarter and saves it.
+ * Applies from the next play, or the next loop run.
+ */
+static void tdm_step_time_scale(bool slower) {
+	tdm_macro_config_t* macro = tdm_macro_config(tdm.id, true);
+	if (macro == NULL) {
+		TDM_LOG(OVERRIDES_FULL, TDM_NUM_OVERRIDES, tdm.id);
+		return;
+	}
+	uint8_t scale = tdm_override(macro->time_scale, tdm.config.time_scale);
+	uint8_t step = (scale >> 2) + 1;
+	if (slower) {
+		scale = scale > UINT8_MAX - step ? UINT8_MAX : scale + step;
+	} else {
+		scale = scale > step ? scale - step : 1;
+	}
+	macro->time_scale = scale;
+	tdm_config_changed();
+	TDM_LOG(TIME_SCALE, tdm.id, scale);
+}
+
+// plays the macro bound to the chord, if there is one
+static bool tdm_play_binding(uint16_t keycode) {
+	int8_t found = tdm_binding_find(keycode, get_mods() | get_oneshot_mods());
+	if (found < 0) {
+		return false;
+	}
+	clear_oneshot_mods(); //used up by the trigger, like any other key would
+	tdm.id = tdm.bindings[found].slot;
+	tdm.bound_keycode = keycode;
+	tdm_state_transition(STATE_playing);
+	return true;
 }
 
 static inline bool tdm_is_control_key(uint16_t keycode);
@@ -590,8 +3054,64 @@ static inline bool tdm_is_valid_number(uint16_t keycode);
  *   }
  */
 bool process_temporal_dynamic_macro(uint16_t keycode, keyrecord_t* record) {
-	// const char* str = state_to_string(MACRO_current_state);
+	TDM_PROFILE_SCOPE(PROCESS);
+	// const char* str = state_to_string(tdm.current_state);
 	// uprintf("current_state: %s\n", str);
+	if (keycode == tdm.bound_keycode && !record->event.pressed) {
+		tdm.bound_keycode = KC_NO;
+		return false;
+	}
+	if (keycode == TDM_NEXT || keycode == TDM_PREV) {
+		if (record->event.pressed && tdm.current_state == STATE_idle) {
+			tdm.id = tdm_find_macro(tdm.id, keycode == TDM_NEXT ? 1 : -1);
+			TDM_LOG(SELECTED, tdm.id);
+		} else if (record->event.pressed && tdm.current_state == STATE_looping) { //steps from the staged one
+			uint16_t from = tdm.staged_id != TDM_NUM_MACROS ? tdm.staged_id : tdm.id;
+			tdm_loop_stage(tdm_find_macro(from, keycode == TDM_NEXT ? 1 : -1));
+		}
+		return false;
+	}
+	if (keycode == TDM_STATS) {
+		if (record->event.pressed) {
+			tdm_counters_print();
+#ifdef TDM_PROFILE
+			tdm_profile_print();
+#endif
+#ifdef TDM_COUNTERS_PERSIST
+			tdm_counters_save();
+#endif
+		}
+		return false;
+	}
+	if (keycode == TDM_FLUSH) {
+		if (record->event.pressed) {
+			if (tdm.config_token != INVALID_DEFERRED_TOKEN) {
+				tdm_config_save();
+			}
+#if TDM_LIBRARY_SIZE > 0
+			tdm_library_flush();
+#endif
+		}
+		return false;
+	}
+	if (keycode == TDM_FASTER || keycode == TDM_SLOWER) {
+		if (record->event.pressed) {
+			tdm_step_time_scale(keycode == TDM_SLOWER);
+		}
+		return false;
+	}
+	if (keycode == TDM_PLAY && record->event.pressed && tdm.current_state == STATE_armed) {
+		tdm.bound_keycode = TDM_PLAY; //its release isn't a new play
+		tdm_state_transition(STATE_playing);
+		uint16_t latency = timer_elapsed(record->event.time);
+		if (latency > UINT16_MAX / 2) { //QMK stamps events with timer_read() | 1, a ms ahead on even ones
+			latency = 0;
+		}
+		if (latency > tdm.counters.max_arm_latency_ms) {
+			tdm.counters.max_arm_latency_ms = latency;
+		}
+		return false;
+	}
 	if (tdm_is_control_key(keycode)) {
 		if(!record->event.pressed) { //is a control key in idle state
 			State next_state = keycode_to_state(keycode);
@@ -600,16 +3120,23 @@ bool process_temporal_dynamic_macro(uint16_t keycode, keyrecord_t* record) {
 	} else if (tdm_is_layer_key(keycode)) {
 		return true; // don't handle layer keys, only the resulting keycode
 	} else {
-		switch (MACRO_current_state) {
+		switch (tdm.current_state) {
 			case STATE_idle:
-				 return true;
-				break;
+				return !(record->event.pressed && tdm_play_binding(keycode));
+			case STATE_binding:
+				if (!record->event.pressed || IS_MODIFIER_KEYCODE(keycode)) {
+					return true; //modifiers are held down as part of the chord
+				}
+				tdm_bind(keycode, get_mods() | get_oneshot_mods());
+				tdm.bound_keycode = keycode;
+				tdm_state_transition(tdm.bind_return);
+				return false;
 			case STATE_recording:
 				if(tdm_is_valid_key(keycode)) {
 					tdm_record_key(keycode, record);
 				} else if(record->event.pressed){
 					tdm_state_transition(STATE_idle);
-					return !TDM_SILENT_INVALID_KEYS; // user decides if invalid keys continue processing
+					return !tdm.config.silent_invalid_keys; // user decides if invalid keys continue processing
 				}
 				break;
 			case STATE_recording_delay:
@@ -617,37 +3144,87 @@ bool process_temporal_dynamic_macro(uint16_t keycode, keyrecord_t* record) {
 					tdm_record_delay(keycode);
 				} else if (!record->event.pressed && !tdm_is_valid_number(keycode)) {
 					tdm_state_transition(STATE_recording);
-					return !TDM_SILENT_RECORDED_KEYS; //make sure the keyup is processed if keydown was in record_delay
+					return !tdm.config.silent_recorded_keys; //make sure the keyup is processed if keydown was in record_delay
 				}
 				break;
 			case STATE_selecting: 
 				if(!record->event.pressed)
-					return !TDM_SILENT_RECORDED_KEYS;
+					return !tdm.config.silent_recorded_keys;
 				if(tdm_is_valid_number(keycode)) {
 					tdm_select_macro(keycode);
 				} else {
 					tdm_state_transition(STATE_idle);
-					return !TDM_SILENT_INVALID_KEYS;
+					return !tdm.config.silent_invalid_keys;
 				}
 				break;
-// #if TDM_EXIT_STATE_ON_ANY_KEY
-// 			case STATE_playing:
-// 			case STATE_looping: 
-// 				if(!record->event.pressed) {
-// 					tdm_state_transition(STATE_idle);
-// 					return !TDM_SILENT_INVALID_KEYS;
-// 				}
-// 				break;
-// #endif
+			case STATE_playing:
+			case STATE_looping: 
+				tdm_track_mods(keycode, record->event.pressed);
+				if(tdm.config.exit_state_on_any_key && !record->event.pressed) {
+					tdm_state_transition(STATE_idle);
+					return !tdm.config.silent_invalid_keys;
+				}
+				return true;
 			default:
 				return true;
 		}
 	}
-	return !TDM_SILENT_RECORDED_KEYS; // user decides if recorded keys continue processing
+	return !tdm.config.silent_recorded_keys; // user decides if recorded keys continue processing
+}
+
+#ifdef TDM_KEY_FILTER
+/* Key filter
+ * the ALLOW and DENY ranges of TDM_KEY_FILTER are folded at compile time into a const table with a
+ * bit per basic keycode: each range ORs in its mask over each quarter of them (TDM_KEY_RANGE_0..3,
+ * the quarter can't be passed through the ranges any other way), and TDM_KEY_BYTE slices the masks
+ * into bytes. A modded keycode, like LCTL(KC_C), is recorded when its basic keycode is, so both are
+ * a single bit test. Other keycodes are compared with the ranges inline.
+ */
+#	define TDM_KEY_IN(low, high) || (keycode >= (low) && keycode <= (high))
+#	define TDM_KEY_SKIP(low, high)
+#	define TDM_KEY_COUNT(low, high) +1
+#	define TDM_KEY_MIN(a, b) ((a) < (b) ? (a) : (b))
+#	define TDM_KEY_MAX(a, b) ((a) > (b) ? (a) : (b))
+// the keycodes of [low, high] among the 64 of quarter q
+#	define TDM_KEY_MASK(q, low, high)                                          \
+		((low) > (q) * 64 + 63 || (high) < (q) * 64                             \
+				 ? 0                                                            \
+				 : (~0ull << (TDM_KEY_MAX(low, (q) * 64) - (q) * 64)) &         \
+						   (~0ull >> ((q) * 64 + 63 - TDM_KEY_MIN(high, (q) * 64 + 63))))
+#	define TDM_KEY_RANGE_0(low, high) | TDM_KEY_MASK(0, low, high)
+#	define TDM_KEY_RANGE_1(low, high) | TDM_KEY_MASK(1, low, high)
+#	define TDM_KEY_RANGE_2(low, high) | TDM_KEY_MASK(2, low, high)
+#	define TDM_KEY_RANGE_3(low, high) | TDM_KEY_MASK(3, low, high)
+#	define TDM_KEY_ALLOWED(q) \
+		((0 TDM_KEY_FILTER(TDM_KEY_COUNT, TDM_KEY_SKIP)) == 0 ? ~0ull : 0 TDM_KEY_FILTER(TDM_KEY_RANGE_##q, TDM_KEY_SKIP))
+#	define TDM_KEY_DENIED(q) (0 TDM_KEY_FILTER(TDM_KEY_SKIP, TDM_KEY_RANGE_##q))
+#	define TDM_KEY_BYTE(q, n) (uint8_t)((TDM_KEY_ALLOWED(q) & ~TDM_KEY_DENIED(q)) >> (n) * 8)
+#	define TDM_KEY_BYTES(q) \
+		TDM_KEY_BYTE(q, 0), TDM_KEY_BYTE(q, 1), TDM_KEY_BYTE(q, 2), TDM_KEY_BYTE(q, 3), \
+		TDM_KEY_BYTE(q, 4), TDM_KEY_BYTE(q, 5), TDM_KEY_BYTE(q, 6), TDM_KEY_BYTE(q, 7)
+
+static const uint8_t tdm_key_filter_bits[256 / 8] = {TDM_KEY_BYTES(0), TDM_KEY_BYTES(1), TDM_KEY_BYTES(2), TDM_KEY_BYTES(3)};
+
+static inline bool tdm_key_filter(uint16_t keycode) {
+	if (keycode <= QK_MODS_MAX) {
+		uint8_t key = QK_MODS_GET_BASIC_KEYCODE(keycode);
+		return tdm_key_filter_bits[key >> 3] & (1 << (key & 7));
+	}
+	bool allowed = (0 TDM_KEY_FILTER(TDM_KEY_COUNT, TDM_KEY_SKIP)) == 0 TDM_KEY_FILTER(TDM_KEY_IN, TDM_KEY_SKIP);
+	bool denied = false TDM_KEY_FILTER(TDM_KEY_SKIP, TDM_KEY_IN);
+	return allowed && !denied;
 }
+#endif
 
 static inline bool tdm_is_valid_key(uint16_t keycode) {
-	return !tdm_is_control_key(keycode) && tdm_is_valid_key_user(keycode);
+	return !tdm_is_control_key(keycode)
+#ifdef TDM_KEY_FILTER
+	       && tdm_key_filter(keycode)
+#endif
+#ifdef TDM_VALID_KEY_USER
+	       && tdm_is_valid_key_user(keycode)
+#endif
+	       ;
 }
 static inline bool tdm_is_valid_number(uint16_t keycode) {
 	return (keycode >= KC_1 && keycode <= KC_9) || keycode == KC_0
@@ -670,6 +3247,8 @@ static inline bool tdm_is_control_key(uint16_t keycode) {
 	        keycode == TDM_DELAY  ||
 	        keycode == TDM_END    ||
 	        keycode == TDM_PLAY   ||
+	        keycode == TDM_BIND   ||
+	        keycode == TDM_ARM    ||
 	        keycode == TDM_LOOP)  ;
 }
 
@@ -679,89 +3258,75 @@ static inline bool tdm_is_control_key(uint16_t keycode) {
 * tracks what state the system is in to validate the control keys (record, play, etc)
 */
 typedef void (*TransitionFunction)(void);
-// Define the transition matrix
-TransitionFunction transition_matrix[STATE_idle+1][STATE_idle+1];
-
-void tdm_init_state_machine(void){
-	transition_matrix[STATE_idle][STATE_recording] = tdm_record_start;
-	transition_matrix[STATE_recording][STATE_recording_delay] = tdm_record_delay_start;
-	transition_matrix[STATE_recording_delay][STATE_recording] = tdm_record_delay_end;
-	transition_matrix[STATE_recording][STATE_idle] = tdm_record_end;
-	transition_matrix[STATE_idle][STATE_playing] = tdm_play_start;
-	transition_matrix[STATE_playing][STATE_idle] = tdm_play_stop;
-	transition_matrix[STATE_idle][STATE_looping] = tdm_loop_start;
-	transition_matrix[STATE_looping][STATE_looping] = tdm_loop_start;
-	transition_matrix[STATE_looping][STATE_idle] = tdm_play_stop;
-	transition_matrix[STATE_idle][STATE_selecting] = tdm_select_start;
-	transition_matrix[STATE_selecting][STATE_idle] = tdm_select_end;
-}
+// Define the transition matrix, constant so instances can share it
+static const TransitionFunction transition_matrix[STATE_idle+1][STATE_idle+1] = {
+	[STATE_idle][STATE_recording] = tdm_record_start,
+	[STATE_recording][STATE_recording_delay] = tdm_record_delay_start,
+	[STATE_recording_delay][STATE_recording] = tdm_record_delay_end,
+	[STATE_recording][STATE_idle] = tdm_record_end,
+	[STATE_idle][STATE_playing] = tdm_play_start,
+	[STATE_playing][STATE_idle] = tdm_play_stop,
+	[STATE_idle][STATE_looping] = tdm_loop_start,
+	[STATE_looping][STATE_looping] = tdm_loop_start,
+	[STATE_looping][STATE_idle] = tdm_play_stop,
+	[STATE_idle][STATE_selecting] = tdm_select_start,
+	[STATE_selecting][STATE_idle] = tdm_select_end,
+	[STATE_idle][STATE_binding] = tdm_bind_start,
+	[STATE_recording][STATE_binding] = tdm_bind_start,
+	[STATE_binding][STATE_idle] = tdm_bind_end,
+	[STATE_binding][STATE_recording] = tdm_bind_end,
+	[STATE_idle][STATE_armed] = tdm_arm_start,
+	[STATE_armed][STATE_armed] = tdm_arm_start,
+	[STATE_armed][STATE_playing] = tdm_arm_fire,
+	[STATE_armed][STATE_idle] = tdm_arm_cancel,
+};
 
 bool tdm_state_transition(State next_state) {
+	TDM_PROFILE_SCOPE(TRANSITION);
 	bool valid_transition = true;
-	TransitionFunction transition = transition_matrix[MACRO_current_state][next_state];
+	TransitionFunction transition = transition_matrix[tdm.current_state][next_state];
 	if (transition == NULL) {
 		tdm_invalid_transition(next_state);
 		valid_transition = false;
 	} else {
-		uprintf("transitioning to state: %d\n", next_state);
-		uprintf("MacroEnds: %d[", MACRO_buffers[MACRO_id]);
-		for (int i = 0; i < TDM_NUM_MACROS; i++) {
-			uprintf("%d, ", MACRO_ends[i]);
+		TDM_LOG(TRANSITION, next_state);
+		TDM_LOG(STARTS_BEGIN);
+		for (int i = 0; i <= TDM_NUM_MACROS; i++) {
+			TDM_LOG(STARTS_ITEM, tdm.starts[i]);
 		}
-		uprintf("]\n");
-		MACRO_current_state = next_state;
+		TDM_LOG(LIST_END);
+		tdm.previous_state = tdm.current_state;
+		tdm.current_state = next_state;
 		transition();
 	}
 	return valid_transition;
 }
 
 void tdm_invalid_transition(State next_state){
-	uprintf("temporal dynamic macro: invalid transition: %d to %d\n", MACRO_current_state, next_state);
+	tdm.counters.invalid_transitions++;
+	TDM_LOG(INVALID_TRANSITION, tdm.current_state, next_state);
 }
 
 void print_macros(void) {
-	// if(MACRO_iterator MACRO_ends[MACRO_id] == TDM_CURRENT_START(MACRO_id)) //update macro end if we're currently recording
-		MACRO_ends[MACRO_id] = MACRO_iterator; //since macro ends normally doesn't update until record end
-	uprintf("\n==========\n");
-	uprintf("MACRO_ends[%d] = [", TDM_NUM_MACROS);
-	for( int e; e < TDM_NUM_MACROS; e++) {
-		uprintf("%d,", MACRO_ends[e] - TDM_BUFFER_START(e));
-	}
-	uprintf("]\n");
+	TDM_LOG(DUMP_BEGIN);
+	TDM_LOG(DUMP_STARTS, TDM_NUM_MACROS);
+	for (int e = 0; e <= TDM_NUM_MACROS; e++) {
+		TDM_LOG(DUMP_START, tdm.starts[e]);
+	}
+	TDM_LOG(LIST_END);
 	int buffer_length = TDM_BUFFER_SIZE;
-	uprintf("%d\n", buffer_length);
+	TDM_LOG(DUMP_BUFFER_SIZE, buffer_length);
 	for (int i = 0; i < TDM_NUM_MACROS; i++) {
-		uprintf("\nMacro# %d\n", i);
-		for (tdm_keypress_t* iter = TDM_CURRENT_START(i); iter != MACRO_ends[i]; iter += DIRECTION(i)) {
-			uprintf("KC: %d, down? %d, delay: %d\n", iter->keycode, (iter->flags)&FLAG_pressed, iter->delay_ms);
-		}
-	}
-	uprintf("==========\n");
-	// for (int i = 0; i < (TDM_NUM_MACROS+1)/2; i++) {
-	// 	tdm_keypress_t* buffer_start = MACRO_buffers[i];
-	// 	uprintf("buffer #%d %d\n", i, &MACRO_buffers[i]);
-	// 	// Print recorded key information
-	// 	for (int j = 0; j < TDM_BUFFER_SIZE; j++) {
-	// 		uprintf("%05d,", buffer_start[j].keycode);
-	// 	}
-	// 	uprintf("\n");
-	// 	// print the pointer indicators
-	// 	for (int k = 0; k < TDM_BUFFER_SIZE; k++) {
-	// 		// Print buffer's left macro end
-	// 		if (&buffer_start[k] == MACRO_ends[i*2]) {
-	// 			uprintf("^%dend ", i*2);
-	// 		}// Print buffer's right macro end
-	// 		else if (&buffer_start[k] == MACRO_ends[(i*2)+1]) {
-	// 			uprintf(" end%d^", (i*2)+1);  // Pointer for current macro's start
-	// 		}
-	// 		else if (&buffer_start[k] == MACRO_iterator) {  // Current iterator's position
-	// 			uprintf("^i[%d] ", k);
-	// 		} else {
-	// 			uprintf("     ,");
-	// 		}
-	// 	}
-
-	// 	// Print "macro X last recorded key"
-	// 	uprintf("\n");
-	// }
+		//the slot being recorded only ends at the iterator, its end isn't saved until record end
+		bool recording = i == tdm.id && (tdm.current_state == STATE_recording || tdm.current_state == STATE_recording_delay);
+		tdm_keypress_t* end = recording ? tdm.iterator : TDM_SLOT_END(i);
+		if (TDM_SLOT_START(i) == end) {
+			continue;
+		}
+		TDM_LOG(DUMP_MACRO, i);
+		for (tdm_keypress_t* iter = TDM_SLOT_START(i); iter != end; iter++) {
+			TDM_LOG(DUMP_KEY, iter->keycode, (iter->flags)&FLAG_pressed, (long)iter->time_ms);
+		}
+	}
+	TDM_LOG(DUMP_END);
 }
@@ -38,10 +38,10 @@ extern "C" {
 #endif
 
 
-/* May be overridden with a custom value. Be aware that the effective
- * macro length is half of this value: each keypress is recorded twice
- * because of the down-event and up-event. This is not a bug, it's the
- * intended behavior.
+/* May be overridden with a custom value. This is the number of entries
+ * shared by all macros, any macro can use whatever the others leave free.
+ * Be aware that each keypress is recorded twice because of the down-event
+ * and up-event. This is not a bug, it's the intended behavior.
  *
  * Usually it should be fine to set the macro size to at least 256 but
  * there have been reports of it being too much in some users' cases,
@@ -51,23 +51,156 @@ extern "C" {
 #	define TDM_BUFFER_SIZE 50
 #endif
 
-//how many macros can be recorded. 2 macros in each buffer. I suggest this to be even
-#define TDM_NUM_MACROS 2
+/* How many macros can be recorded. An empty slot takes no pool entries, but each slot still costs
+ * 2 bytes of RAM for its place in the pool, and 2 bits more with a macro library (TDM_LIBRARY_SIZE).
+ */
+#ifndef TDM_NUM_MACROS
+#	define TDM_NUM_MACROS 2
+#endif
+
+/* The following are only the defaults of the runtime config (see tdm_config_t),
+ * which is kept in EEPROM and can be changed without reflashing.
+ */
 
 //if recorded keys output characters to OS.
-#define TDM_SILENT_RECORDED_KEYS false
+#ifndef TDM_SILENT_RECORDED_KEYS
+#	define TDM_SILENT_RECORDED_KEYS false
+#endif
 
 // if invalid keys pressed during recording output characters to OS
-#define TDM_SILENT_INVALID_KEYS true
+#ifndef TDM_SILENT_INVALID_KEYS
+#	define TDM_SILENT_INVALID_KEYS true
+#endif
 
-#define TDM_EXIT_STATE_ON_ANY_KEY true
+// if releasing any key while a macro plays or loops stops it
+#ifndef TDM_EXIT_STATE_ON_ANY_KEY
+#	define TDM_EXIT_STATE_ON_ANY_KEY false
+#endif
 
-//TODO add 
+/* How many key chords can be bound to macros with TDM_BIND (power of two, at
+ * most 64). Each costs 10 bytes of RAM.
+ */
+#ifndef TDM_NUM_BINDINGS
+#	define TDM_NUM_BINDINGS 8
+#endif
 
 // milliseconds btw last tap and play/record start, tap in this time to select next macro
 // this can be 0 if you don't use tap select macro_id
+#ifndef TDM_DEBOUNCE_DELAY
+#	define TDM_DEBOUNCE_DELAY 100
+#endif
+
+// milliseconds between the end of a looping macro and its next run
+#ifndef TDM_LOOP_GAP
+#	define TDM_LOOP_GAP TDM_DEBOUNCE_DELAY
+#endif
+
+/* Playback speed, in sixteenths of the recorded timing: 16 plays as recorded,
+ * 8 plays twice as fast and 32 half as fast. TDM_FASTER/TDM_SLOWER step it
+ * for the selected macro.
+ */
+#define TDM_TIME_SCALE_NORMAL 16
+#ifndef TDM_TIME_SCALE
+#	define TDM_TIME_SCALE TDM_TIME_SCALE_NORMAL
+#endif
+
+// where the runtime config is kept in EEPROM, move it if it collides with VIA or other user data
+#ifndef TDM_EEPROM_ADDR
+#	define TDM_EEPROM_ADDR EECONFIG_SIZE
+#endif
+
+/* Config changes from TDM_FASTER/TDM_SLOWER or raw HID are saved this many ms
+ * after the last one, so the key press doesn't wait on EEPROM and a run of
+ * changes is written once. TDM_FLUSH saves them right away.
+ */
+#ifndef TDM_CONFIG_SAVE_DELAY
+#	define TDM_CONFIG_SAVE_DELAY 1000
+#endif
+
+/* Define TDM_COUNTERS_PERSIST to keep the counters (see tdm_counters_t) in
+ * EEPROM, right after the runtime config. They're saved when TDM_STATS is
+ * pressed or tdm_counters_save() is called, never on their own.
+ */
+#ifdef TDM_COUNTERS_PERSIST
+#	ifndef TDM_COUNTERS_ADDR
+#		define TDM_COUNTERS_ADDR (TDM_EEPROM_ADDR + sizeof(tdm_config_t))
+#	endif
+#	define TDM_COUNTERS_END (TDM_COUNTERS_ADDR + sizeof(tdm_counters_t))
+#else
+#	define TDM_COUNTERS_END (TDM_EEPROM_ADDR + sizeof(tdm_config_t))
+#endif
+
+/* Macro library: set TDM_LIBRARY_SIZE to a number of entries to also save
+ * every recorded macro to EEPROM (right after the runtime config by default),
+ * so macros survive a power cycle and there can be more of them than fit in
+ * RAM. TDM_BUFFER_SIZE then only needs to hold the macros in use: up to
+ * TDM_CACHE_WAYS of them stay in RAM, and others are loaded TDM_CACHE_CHUNK
+ * entries at a time while they play. Override tdm_library_read/write/erase
+ * to keep the library in external flash instead.
+ * The library is a journal in two banks, each holding TDM_LIBRARY_SIZE
+ * entries plus an 8 byte header per macro, so it takes about
+ * 2 * (TDM_LIBRARY_SIZE * sizeof(tdm_keypress_t) + 8 * TDM_NUM_MACROS) bytes.
+ */
+#ifndef TDM_LIBRARY_SIZE
+#	define TDM_LIBRARY_SIZE 0
+#endif
+#ifndef TDM_LIBRARY_ADDR
+#	define TDM_LIBRARY_ADDR TDM_COUNTERS_END
+#endif
+#ifndef TDM_CACHE_WAYS
+#	define TDM_CACHE_WAYS 8
+#endif
+#ifndef TDM_CACHE_CHUNK
+#	define TDM_CACHE_CHUNK 8
+#endif
+
+/* Saved macros are written in the background, TDM_WRITE_BYTES changed bytes
+ * every TDM_WRITE_INTERVAL ms, so typing goes on while a long macro is saved.
+ * An AVR EEPROM byte write takes about 3.4ms, keep the interval above that.
+ */
+#ifndef TDM_WRITE_BYTES
+#	define TDM_WRITE_BYTES 1
+#endif
+#ifndef TDM_WRITE_INTERVAL
+#	define TDM_WRITE_INTERVAL 4
+#endif
+
+/* Define TDM_LZ (with TDM_CONTAINER) to play the compressed macros of a
+ * container image. They're decoded TDM_LZ_CHUNK entries at a time, just ahead
+ * of playback, so a macro of any length only needs that many entries and a
+ * 256 byte window of RAM.
+ */
+#ifndef TDM_LZ_CHUNK
+#	define TDM_LZ_CHUNK 8
+#endif
+
+/* Which keys can be recorded, as keycode ranges (inclusive), for example:
+ *
+ * #define TDM_KEY_FILTER(ALLOW, DENY) \
+ * 	ALLOW(KC_A, KC_0) \
+ * 	ALLOW(KC_LEFT_CTRL, KC_RIGHT_GUI) \
+ * 	DENY(KC_Q, KC_Q)
+ *
+ * A key is recorded when it's in an ALLOW range, or there are none, and in no
+ * DENY range, and a modded key like LCTL(KC_C) when its basic key is. Those are
+ * one bit test in a const table the ranges are folded into at compile time,
+ * others are compared with the ranges. Without it every key is recorded.
+ * Define TDM_VALID_KEY_USER to also ask tdm_is_valid_key_user() for each key.
+ */
+
+/* Pointing device motion is summed over windows of this many ms while
+ * recording, and replayed one step per window. Steady motion is stored as a
+ * single run entry no matter how long it lasts.
+ */
+#ifndef TDM_MOUSE_REPORT_INTERVAL
+#	define TDM_MOUSE_REPORT_INTERVAL 10
+#endif
 
-#define TDM_DEBOUNCE_DELAY 100
+/* Define TDM_REPORT_MIX to play macros into a keyboard report of their own,
+ * merged with what the user types when reports are sent, instead of into the
+ * keyboard's state. Typing during playback then neither disturbs the macro
+ * nor gets cleared by it. The host driver is wrapped for this at play start.
+ */
 
 /**
  * Handler function for Temporal Dynamic Macro.
@@ -92,6 +225,57 @@ extern "C" {
  * }
  */
 
+/* Per-macro overrides, a field left at 0 uses the global value */
+typedef struct __attribute__((packed)) {
+	uint16_t loop_gap_ms;
+	uint8_t debounce_ms;
+	uint8_t time_scale;
+} tdm_macro_config_t;
+
+/* Only a few macros have overrides, so the config holds a small table of them rather than one per
+ * slot: its size is fixed, whatever TDM_NUM_MACROS is, and so is where it is for raw HID.
+ * An entry whose fields are all 0 is free, the first entry with a macro's id is its overrides.
+ */
+#define TDM_NUM_OVERRIDES 4
+typedef struct __attribute__((packed)) {
+	uint16_t id;
+	tdm_macro_config_t config;
+} tdm_macro_override_t;
+
+/* Runtime config, stored as-is in EEPROM at TDM_EEPROM_ADDR.
+ * The raw HID commands read and write it by byte offset, so the layout is part of the protocol:
+ * only append fields and bump TDM_CONFIG_VERSION when it changes.
+ */
+#define TDM_CONFIG_VERSION 2
+typedef struct __attribute__((packed)) {
+	uint8_t version;
+	bool silent_recorded_keys : 1;
+	bool silent_invalid_keys : 1;
+	bool exit_state_on_any_key : 1;
+	uint8_t reserved : 5;
+	uint16_t debounce_ms;
+	uint16_t loop_gap_ms;
+	uint8_t time_scale;
+	tdm_macro_override_t overrides[TDM_NUM_OVERRIDES];
+} tdm_config_t;
+
+/* Counters, read them with tdm_get_counters(), TDM_STATS (printed to the console) or raw HID.
+ * Like the config, the layout is part of the raw HID protocol.
+ */
+#define TDM_COUNTERS_VERSION 3
+typedef struct __attribute__((packed)) {
+	uint8_t version;
+	uint32_t events_recorded; //entries appended while recording
+	uint32_t events_played;
+	uint32_t loops_completed;
+	uint16_t overflows; //recordings cut short because the pool was full
+	uint16_t invalid_transitions;
+	uint16_t max_lateness_ms; //how late a playback callback ran at worst
+	uint16_t high_water; //most pool entries ever holding macros
+	uint16_t max_arm_latency_ms; //from pressing TDM_PLAY on an armed macro to its first report
+	uint16_t cache_refused; //plays and recordings refused because every cache way held an unsaved macro
+} tdm_counters_t;
+
 void tdm_init(void);
 void tdm_init_user(void);
 bool process_temporal_dynamic_macro(uint16_t keycode, keyrecord_t* record);
@@ -99,12 +283,130 @@ bool select_macro_id(uint16_t new_macro_id);
 
 void tdm_led_blink(void);
 void tdm_rgb_user(void);
-void tdm_record_start_user(uint8_t macro_id);
-void tdm_play_user(uint8_t macro_id);
-void tdm_record_key_user(uint8_t macro_id, uint16_t keycode);
-void tdm_record_end_user(uint8_t macro_id);
+void tdm_record_start_user(uint16_t macro_id);
+void tdm_play_user(uint16_t macro_id);
+void tdm_record_key_user(uint16_t macro_id, uint16_t keycode);
+#ifdef TDM_VALID_KEY_USER
+bool tdm_is_valid_key_user(uint16_t keycode);
+#endif
+void tdm_record_end_user(uint16_t macro_id);
+/* Called for every event a macro plays, before it's sent, with the time it goes out.
+ * kind is 0 for a key, 1 pointing device motion, 2 an encoder detent, 3 a layer change and 4 a
+ * modifier change, payload is the keycode or the packed change. Logging these from a host build
+ * gives the exact sequence and timing playback produces, to compare before and after a change.
+ */
+void tdm_play_trace_user(uint16_t macro_id, uint8_t kind, uint16_t payload, bool pressed, uint32_t time);
 void tdm_stop_recording(void);
 
+/* Playback runs on the macro's timeline, compiled when the recording ends. Both take the macro's speed
+ * into account; while looping they're about the current run.
+ */
+uint32_t tdm_play_remaining(void); //ms until the playing macro ends, 0 when nothing plays
+bool tdm_play_seek(uint32_t ms); //continues playing from ms into the macro, false when nothing plays
+/* While a macro loops, switches to another one at the end of the current run, without a pause or a
+ * restart. TDM_NEXT/TDM_PREV do the same from the keyboard. False when nothing loops or the slot is empty.
+ */
+bool tdm_loop_stage(uint16_t macro_id);
+
+#ifdef TDM_LOWPOWER
+/* For boards that sleep between scans (wireless, battery powered). Before sleeping, ask how long
+ * TDM can go without the CPU (UINT32_MAX when it has nothing scheduled) and arm a timer wake source
+ * for it. After waking, call tdm_lowpower_wake with how long the board slept while timer_read32
+ * didn't count (0 if the timer keeps running), so playback stays on time.
+ */
+uint32_t tdm_lowpower_idle_ms(void);
+void tdm_lowpower_wake(uint32_t slept_ms);
+#endif
+
+#if TDM_LIBRARY_SIZE > 0
+void tdm_library_read(uint32_t address, void* data, uint16_t size);
+void tdm_library_write(uint32_t address, const void* data, uint16_t size);
+void tdm_library_erase(uint32_t address, uint32_t size);
+bool tdm_library_dirty(void); //some saved macros aren't written yet
+void tdm_library_flush(void); //writes them now, blocking
+#endif
+
+#ifdef TDM_CONTAINER
+/* Macros packed on a host into a container image (see tdm_container.h and tools/tdm_container.py)
+ * and placed in memory-mapped flash play straight from there, nothing is copied to RAM. A slot
+ * plays the image's macro as long as nothing was recorded in it; recording one, or deleting the
+ * recording, switches between them. Mount after tdm_init, NULL unmounts. Returns false and
+ * mounts nothing when the image doesn't check out. The events are used in place, so this needs a
+ * little-endian 32 bit target (ARM) or a host build, where the entries have the container's layout.
+ * With TDM_BYTECODE, the image can also hold bytecode macros (from tools/tdm_compile.py), which
+ * are interpreted as they play, and with TDM_LZ compressed ones; an image holding a kind the build
+ * can't play is refused.
+ */
+bool tdm_container_mount(const void* image, uint32_t size);
+#endif
+
+tdm_config_t* tdm_get_config(void);
+void tdm_config_save(void);
+void tdm_config_reset(void);
+
+tdm_counters_t* tdm_get_counters(void);
+void tdm_counters_print(void);
+void tdm_counters_reset(void);
+#ifdef TDM_COUNTERS_PERSIST
+void tdm_counters_save(void);
+#endif
+
+#ifdef TDM_MULTI_INSTANCE
+/* Independent engine instances, for host builds (simulators, replay tools) that run many side by side.
+ * Allocate tdm_context_size() bytes, tdm_context_init() them, select the instance and call tdm_init().
+ * Every call, deferred callbacks and user hooks included, works on the instance selected on the
+ * calling thread, so give each worker thread its own instances. NULL selects the default one.
+ */
+typedef struct tdm_context tdm_context_t;
+size_t tdm_context_size(void);
+void tdm_context_init(tdm_context_t* context);
+tdm_context_t* tdm_context_select(tdm_context_t* context); //returns the previous one
+#endif
+
+#ifdef RAW_ENABLE
+/* Raw HID commands for the runtime config, the first byte of the packet is TDM_HID_COMMAND.
+ * Call it from `raw_hid_receive` and skip your own handling when it returns true:
+ *
+ * void raw_hid_receive(uint8_t *data, uint8_t length) {
+ * 	if (tdm_raw_hid_receive(data, length)) { return; }
+ * 	...
+ * }
+ *
+ * Requests, the offset is 16 bits little-endian and the data starts at byte 5:
+ *  [TDM_HID_COMMAND, TDM_HID_CONFIG_GET, offset lo, offset hi, count]    -> the config bytes at [5]
+ *  [TDM_HID_COMMAND, TDM_HID_CONFIG_SET, offset lo, offset hi, count, bytes...] writes them, saved after TDM_CONFIG_SAVE_DELAY
+ *  [TDM_HID_COMMAND, TDM_HID_CONFIG_RESET]                                  restores the compiled defaults
+ *  [TDM_HID_COMMAND, TDM_HID_COUNTERS_GET, offset lo, offset hi, count]  -> the counter bytes at [5]
+ *  [TDM_HID_COMMAND, TDM_HID_COUNTERS_RESET]                                zeroes the counters
+ *
+ * The reply is the request sent back with the status over byte 2, the offset's low byte: 0 on
+ * success, 1 for an unknown command or a range past the struct or the packet.
+ */
+#ifndef TDM_HID_COMMAND
+#	define TDM_HID_COMMAND 0x74
+#endif
+enum {
+	TDM_HID_CONFIG_GET = 1,
+	TDM_HID_CONFIG_SET,
+	TDM_HID_CONFIG_RESET,
+	TDM_HID_COUNTERS_GET,
+	TDM_HID_COUNTERS_RESET,
+};
+bool tdm_raw_hid_receive(uint8_t* data, uint8_t length);
+#endif
+
+#ifdef POINTING_DEVICE_ENABLE
+/**
+ * Records pointing device motion and buttons while a macro is being recorded.
+ * Call it from `pointing_device_task_user`:
+ *
+ * report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
+ * 	return tdm_pointing_device_task(mouse_report);
+ * }
+ */
+report_mouse_t tdm_pointing_device_task(report_mouse_t mouse_report);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,118 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "flash.h"
+#include "temporal_dynamic_macro.h"
+
+static FILE* flash_file;
+static uint32_t flash_size;
+static uint32_t flash_budget = UINT32_MAX;
+static uint32_t flash_done;
+static bool flash_lost;
+static void (*flash_cut)(void);
+
+bool flash_open(const char* path, uint32_t size) {
+	flash_file = fopen(path, "r+b");
+	if (flash_file == NULL) {
+		flash_file = fopen(path, "w+b");
+		if (flash_file == NULL) {
+			return false;
+		}
+		for (uint32_t i = 0; i < size; i++) {
+			fputc(0xFF, flash_file);
+		}
+	}
+	flash_size = size;
+	return true;
+}
+
+void flash_close(void) {
+	fclose(flash_file);
+	flash_file = NULL;
+}
+
+bool flash_copy(const char* from, const char* to) {
+	FILE* in = fopen(from, "rb");
+	FILE* out = fopen(to, "wb");
+	bool copied = in != NULL && out != NULL;
+	for (int c; copied && (c = fgetc(in)) != EOF;) {
+		fputc(c, out);
+	}
+	if (in != NULL) {
+		fclose(in);
+	}
+	if (out != NULL) {
+		copied = fclose(out) == 0 && copied;
+	}
+	return copied;
+}
+
+void flash_power_cut(uint32_t operations, void (*cut)(void)) {
+	flash_budget = operations;
+	flash_done = 0;
+	flash_lost = false;
+	flash_cut = cut;
+}
+
+bool flash_powered(void) {
+	return !flash_lost;
+}
+
+uint32_t flash_operations(void) {
+	return flash_done;
+}
+
+// false once power is gone
+static bool flash_operation(void) {
+	if (flash_done == flash_budget && !flash_lost) {
+		flash_lost = true;
+		if (flash_cut != NULL) {
+			flash_cut();
+		}
+	}
+	if (flash_lost) {
+		return false;
+	}
+	flash_done++;
+	return true;
+}
+
+void tdm_library_read(uint32_t address, void* data, uint16_t size) {
+	assert(address + size <= flash_size);
+	fseek(flash_file, address, SEEK_SET);
+	size_t read = fread(data, 1, size, flash_file);
+	assert(read == size);
+}
+
+void tdm_library_write(uint32_t address, const void* data, uint16_t size) {
+	assert(address + size <= flash_size);
+	for (uint16_t i = 0; i < size && flash_operation(); i++) {
+		fseek(flash_file, address + i, SEEK_SET);
+		fputc(((const uint8_t*)data)[i], flash_file);
+	}
+}
+
+void tdm_library_erase(uint32_t address, uint32_t size) {
+	assert(address + size <= flash_size);
+	if (!flash_operation()) {
+		return;
+	}
+	fseek(flash_file, address, SEEK_SET);
+	for (uint32_t i = 0; i < size; i++) {
+		fputc(0xFF, flash_file);
+	}
+}
@@ -0,0 +1,40 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file flash.h
+ * @brief A flash chip kept in a file, holding the macro library of a host build.
+ *
+ * It backs tdm_library_read/write/erase. Like QMK's wear-leveling EEPROM it
+ * takes byte writes anywhere, and erased bytes read 0xFF. Power can be cut
+ * after a number of operations (one byte written, or one erase): from then on
+ * nothing reaches the file, as if the keyboard was unplugged mid-write, until
+ * flash_power_cut is called again. The file stays behind to look at.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool flash_open(const char* path, uint32_t size); //a new file starts erased
+void flash_close(void);
+bool flash_copy(const char* from, const char* to); //snapshots, of closed files
+
+/* Cuts power after that many more operations (UINT32_MAX never), calling cut (if not NULL) right
+ * before the first one that's lost.
+ */
+void flash_power_cut(uint32_t operations, void (*cut)(void));
+bool flash_powered(void); //false once an operation was lost
+uint32_t flash_operations(void); //done since flash_power_cut, lost ones excluded
@@ -0,0 +1,31 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The simulated keyboard's keymap, set up like the README says
+
+#include "sim.h"
+#include "temporal_dynamic_macro.h"
+
+bool process_record_user(uint16_t keycode, keyrecord_t* record) {
+	if (!process_temporal_dynamic_macro(keycode, record)) {
+		return false;
+	}
+	return true;
+}
+
+#ifdef POINTING_DEVICE_ENABLE
+report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
+	return tdm_pointing_device_task(mouse_report);
+}
+#endif
@@ -0,0 +1,251 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file quantum.h
+ * @brief The part of QMK's API temporal_dynamic_macro.c uses, for host builds.
+ *
+ * Declarations match QMK's, the definitions are in tests/sim.c, which
+ * simulates the keyboard around the module. State that QMK keeps in globals
+ * is per thread here, so every thread can run a keyboard of its own.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+int uprintf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+int8_t sendchar(uint8_t c);
+
+/* Key events */
+typedef struct {
+	uint8_t col;
+	uint8_t row;
+} keypos_t;
+
+typedef enum keyevent_type_t {
+	TICK_EVENT = 0,
+	KEY_EVENT = 1,
+	ENCODER_CW_EVENT = 2,
+	ENCODER_CCW_EVENT = 3,
+	COMBO_EVENT = 4
+} keyevent_type_t;
+
+typedef struct {
+	keypos_t key;
+	uint16_t time;
+	keyevent_type_t type;
+	bool pressed;
+} keyevent_t;
+
+typedef struct {
+	bool interrupted : 1;
+	uint8_t count : 4;
+} tap_t;
+
+typedef struct {
+	keyevent_t event;
+	tap_t tap;
+	uint16_t keycode;
+} keyrecord_t;
+
+/* Keycodes */
+enum {
+	KC_NO = 0x00,
+	KC_A = 0x04,
+	KC_C = 0x06,
+	KC_Z = 0x1D,
+	KC_1 = 0x1E,
+	KC_9 = 0x26,
+	KC_0 = 0x27,
+	KC_ENTER = 0x28,
+	KC_ESCAPE = 0x29,
+	KC_BACKSPACE = 0x2A,
+	KC_TAB = 0x2B,
+	KC_SPACE = 0x2C,
+	KC_F1 = 0x3A,
+	KC_RIGHT = 0x4F,
+	KC_LEFT = 0x50,
+	KC_DOWN = 0x51,
+	KC_UP = 0x52,
+	KC_P1 = 0x59,
+	KC_P9 = 0x61,
+	KC_P0 = 0x62,
+	KC_BTN1 = 0xD1,
+	KC_LEFT_CTRL = 0xE0,
+	KC_LEFT_SHIFT = 0xE1,
+	KC_LEFT_ALT = 0xE2,
+	KC_LEFT_GUI = 0xE3,
+	KC_RIGHT_CTRL = 0xE4,
+	KC_RIGHT_SHIFT = 0xE5,
+	KC_RIGHT_ALT = 0xE6,
+	KC_RIGHT_GUI = 0xE7,
+	QK_BASIC_MAX = 0x00FF,
+	QK_MODS = 0x0100,
+	QK_MODS_MAX = 0x1FFF,
+	QK_TO = 0x5200,
+	QK_TO_MAX = 0x521F,
+	QK_MOMENTARY = 0x5220,
+	QK_MOMENTARY_MAX = 0x523F,
+	QK_TOGGLE_LAYER = 0x5260,
+	QK_TOGGLE_LAYER_MAX = 0x527F,
+	QK_ONE_SHOT_LAYER = 0x5280,
+	QK_ONE_SHOT_LAYER_MAX = 0x529F,
+	QK_ONE_SHOT_MOD = 0x52A0,
+	QK_LAYER_TAP_TOGGLE = 0x52C0,
+	QK_LAYER_TAP_TOGGLE_MAX = 0x52DF,
+	QK_TRI_LAYER_LOWER = 0x7C77,
+	QK_TRI_LAYER_UPPER = 0x7C78,
+	SAFE_RANGE = 0x7E40
+};
+#define KC_LCTL KC_LEFT_CTRL
+#define KC_LSFT KC_LEFT_SHIFT
+#define KC_LALT KC_LEFT_ALT
+#define KC_LGUI KC_LEFT_GUI
+#define KC_RCTL KC_RIGHT_CTRL
+#define KC_RSFT KC_RIGHT_SHIFT
+#define KC_RALT KC_RIGHT_ALT
+#define KC_RGUI KC_RIGHT_GUI
+
+#define IS_MODIFIER_KEYCODE(code) ((code) >= KC_LEFT_CTRL && (code) <= KC_RIGHT_GUI)
+#define IS_BASIC_KEYCODE(code) ((code) >= KC_A && (code) <= 0xA4)
+#define IS_MOUSE_KEYCODE(code) ((code) >= 0xCD && (code) <= 0xDF)
+#define MOD_BIT(code) (1 << ((code) & 0x07))
+#define MOD_MASK_CSAG 0x0F
+#define QK_MODS_GET_MODS(kc) (((kc) >> 8) & 0x1F)
+#define QK_MODS_GET_BASIC_KEYCODE(kc) ((kc) & 0xFF)
+#define LCTL(kc) (QK_MODS | 0x0100 | (kc))
+#define LSFT(kc) (QK_MODS | 0x0200 | (kc))
+#define MO(layer) (QK_MOMENTARY | ((layer) & 0x1F))
+
+/* Layers */
+typedef uint32_t layer_state_t;
+extern _Thread_local layer_state_t layer_state;
+void layer_state_set(layer_state_t state);
+void layer_clear(void);
+void layer_on(uint8_t layer);
+void layer_off(uint8_t layer);
+void layer_and(layer_state_t state);
+
+/* Modifiers and the keyboard report */
+uint8_t get_mods(void);
+void add_mods(uint8_t mods);
+void del_mods(uint8_t mods);
+void set_mods(uint8_t mods);
+void clear_mods(void);
+uint8_t get_weak_mods(void);
+void add_weak_mods(uint8_t mods);
+void del_weak_mods(uint8_t mods);
+void clear_weak_mods(void);
+uint8_t get_oneshot_mods(void);
+void set_oneshot_mods(uint8_t mods);
+void clear_oneshot_mods(void);
+void register_mods(uint8_t mods);
+void unregister_mods(uint8_t mods);
+
+void register_code(uint8_t code);
+void unregister_code(uint8_t code);
+void register_code16(uint16_t code);
+void unregister_code16(uint16_t code);
+void tap_code16(uint16_t code);
+void clear_keys(void);
+void clear_keyboard(void);
+void clear_keyboard_but_mods(void);
+void send_keyboard_report(void);
+
+#define KEYBOARD_REPORT_KEYS 6
+typedef struct {
+	uint8_t mods;
+	uint8_t reserved;
+	uint8_t keys[KEYBOARD_REPORT_KEYS];
+} report_keyboard_t;
+
+typedef struct {
+	uint8_t report_id;
+	uint8_t mods;
+	uint8_t bits[30];
+} report_nkro_t;
+
+typedef struct {
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+	int8_t v;
+	int8_t h;
+} report_mouse_t;
+
+void add_key_byte(report_keyboard_t* report, uint8_t code);
+void del_key_byte(report_keyboard_t* report, uint8_t code);
+void add_key_bit(report_nkro_t* report, uint8_t code);
+
+typedef struct {
+	uint8_t (*keyboard_leds)(void);
+	void (*send_keyboard)(report_keyboard_t* report);
+	void (*send_nkro)(report_nkro_t* report);
+	void (*send_mouse)(report_mouse_t* report);
+	void (*send_extra)(void* report);
+} host_driver_t;
+
+host_driver_t* host_get_driver(void);
+void host_set_driver(host_driver_t* driver);
+void host_keyboard_send(report_keyboard_t* report);
+void host_nkro_send(report_nkro_t* report);
+
+extern _Thread_local report_keyboard_t* keyboard_report;
+extern _Thread_local report_nkro_t* nkro_report;
+typedef struct {
+	bool nkro;
+} keymap_config_t;
+extern _Thread_local keymap_config_t keymap_config;
+
+/* Pointing device */
+report_mouse_t pointing_device_get_report(void);
+void pointing_device_set_report(report_mouse_t report);
+bool pointing_device_send(void);
+
+/* Timers and deferred execution */
+uint16_t timer_read(void);
+uint32_t timer_read32(void);
+#define timer_elapsed(last) ((uint16_t)(timer_read() - (last)))
+#define timer_elapsed32(last) (timer_read32() - (last))
+void wait_ms(uint32_t ms);
+
+typedef uint8_t deferred_token;
+#define INVALID_DEFERRED_TOKEN 0
+typedef uint32_t (*deferred_exec_callback)(uint32_t trigger_time, void* cb_arg);
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void* cb_arg);
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms);
+bool cancel_deferred_exec(deferred_token token);
+
+/* EEPROM */
+#define EECONFIG_SIZE 37
+uint8_t eeprom_read_byte(const uint8_t* addr);
+void eeprom_write_byte(uint8_t* addr, uint8_t value);
+void eeprom_update_byte(uint8_t* addr, uint8_t value);
+void eeprom_read_block(void* buf, const void* addr, size_t len);
+void eeprom_update_block(const void* buf, void* addr, size_t len);
+
+/* Raw HID */
+#define RAW_EPSIZE 32
+void raw_hid_send(uint8_t* data, uint8_t length);
+
+/* Feedback */
+void backlight_toggle(void);
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define memcpy_P memcpy
@@ -0,0 +1,173 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "script.h"
+#include "sim.h"
+#include "custom_keycodes.h"
+
+#define KEY(name) {#name, name},
+static const struct {
+	const char* name;
+	uint16_t keycode;
+} script_keys[] = {
+	KEY(KC_NO) KEY(KC_ENTER) KEY(KC_ESCAPE) KEY(KC_BACKSPACE) KEY(KC_TAB) KEY(KC_SPACE)
+	KEY(KC_RIGHT) KEY(KC_LEFT) KEY(KC_DOWN) KEY(KC_UP) KEY(KC_BTN1)
+	KEY(KC_LCTL) KEY(KC_LSFT) KEY(KC_LALT) KEY(KC_LGUI) KEY(KC_RCTL) KEY(KC_RSFT) KEY(KC_RALT) KEY(KC_RGUI)
+	KEY(TDM_RECORD) KEY(TDM_DELAY) KEY(TDM_END) KEY(TDM_PLAY) KEY(TDM_LOOP) KEY(TDM_SELECT)
+	KEY(TDM_FASTER) KEY(TDM_SLOWER) KEY(TDM_NEXT) KEY(TDM_PREV) KEY(TDM_BIND) KEY(TDM_FLUSH)
+	KEY(TDM_STATS) KEY(TDM_ARM)
+};
+#undef KEY
+
+// a keycode, -1 if there's no such key
+static long script_keycode(const char* text) {
+	char* end;
+	long number = strtol(text, &end, 0);
+	if (*text != '\0' && *end == '\0') {
+		return number >= 0 && number <= 0xFFFF ? number : -1;
+	}
+	if (strlen(text) == 4 && strncmp(text, "KC_", 3) == 0) {
+		char c = text[3];
+		if (c >= 'A' && c <= 'Z') {
+			return KC_A + c - 'A';
+		}
+		if (c >= '0' && c <= '9') {
+			return c == '0' ? KC_0 : KC_1 + c - '1';
+		}
+	}
+	if (strncmp(text, "KC_F", 4) == 0 && text[4] != '\0') {
+		long n = strtol(text + 4, &end, 10);
+		if (*end == '\0' && n >= 1 && n <= 12) {
+			return KC_F1 + n - 1;
+		}
+	}
+	size_t length = strlen(text);
+	if (length > 3 && text[length - 1] == ')') { //MO(1), LCTL(KC_C)
+		char inner[32];
+		const char* open = strchr(text, '(');
+		if (open == NULL || (size_t)(text + length - 1 - open) > sizeof(inner)) {
+			return -1;
+		}
+		snprintf(inner, sizeof(inner), "%.*s", (int)(text + length - 2 - open), open + 1);
+		long key = script_keycode(inner);
+		if (key < 0) {
+			return -1;
+		}
+		if (strncmp(text, "MO(", 3) == 0) {
+			return key < 32 ? MO(key) : -1;
+		}
+		if (key > QK_BASIC_MAX) {
+			return -1;
+		}
+		if (strncmp(text, "LCTL(", 5) == 0) {
+			return LCTL(key);
+		}
+		if (strncmp(text, "LSFT(", 5) == 0) {
+			return LSFT(key);
+		}
+		return -1;
+	}
+	for (size_t i = 0; i < sizeof(script_keys) / sizeof(script_keys[0]); i++) {
+		if (strcmp(text, script_keys[i].name) == 0) {
+			return script_keys[i].keycode;
+		}
+	}
+	return -1;
+}
+
+static bool script_number(const char* text, long low, long high, long* value) {
+	char* end;
+	if (text == NULL) {
+		return false;
+	}
+	*value = strtol(text, &end, 0);
+	return *text != '\0' && *end == '\0' && *value >= low && *value <= high;
+}
+
+#define SCRIPT_SPACE " \t\r\n"
+
+// runs one line, false when it doesn't make sense
+static bool script_statement(char* line) {
+	char* words;
+	char* statement = strtok_r(line, SCRIPT_SPACE, &words);
+	if (statement == NULL) {
+		return true;
+	}
+	if (strcmp(statement, "press") == 0 || strcmp(statement, "release") == 0 || strcmp(statement, "tap") == 0) {
+		char* name = strtok_r(NULL, SCRIPT_SPACE, &words);
+		if (name == NULL) {
+			return false;
+		}
+		for (; name != NULL; name = strtok_r(NULL, SCRIPT_SPACE, &words)) {
+			long keycode = script_keycode(name);
+			if (keycode < 0) {
+				return false;
+			}
+			if (statement[0] == 't') {
+				sim_tap(keycode);
+				sim_wait(SIM_TAP_MS);
+			} else {
+				sim_key(keycode, statement[0] == 'p');
+			}
+		}
+		return true;
+	}
+	if (strcmp(statement, "wait") == 0) {
+		long ms;
+		if (!script_number(strtok_r(NULL, SCRIPT_SPACE, &words), 0, 24 * 3600 * 1000L, &ms)) {
+			return false;
+		}
+		sim_wait(ms);
+		return strtok_r(NULL, SCRIPT_SPACE, &words) == NULL;
+	}
+	if (strcmp(statement, "move") == 0) {
+		long x, y, ms = 1;
+		char* duration;
+		if (!script_number(strtok_r(NULL, SCRIPT_SPACE, &words), -127, 127, &x) ||
+			!script_number(strtok_r(NULL, SCRIPT_SPACE, &words), -127, 127, &y) ||
+			((duration = strtok_r(NULL, SCRIPT_SPACE, &words)) != NULL && !script_number(duration, 1, 60000, &ms))) {
+			return false;
+		}
+		while (ms--) {
+			sim_motion(x, y);
+			sim_wait(1);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool script_run(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return false;
+	}
+	char line[256];
+	bool ok = true;
+	for (unsigned number = 1; ok && fgets(line, sizeof(line), file) != NULL; number++) {
+		char text[sizeof(line)];
+		strcpy(text, line);
+		line[strcspn(line, "#")] = '\0';
+		ok = script_statement(line);
+		if (!ok) {
+			fprintf(stderr, "%s:%u: can't run %s", path, number, text);
+		}
+	}
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,35 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file script.h
+ * @brief Scripted sessions on the simulated keyboard.
+ *
+ * One statement per line, # starts a comment:
+ *
+ *   press KC_LCTL          a key goes down
+ *   release KC_LCTL
+ *   tap KC_A KC_B          each key held SIM_TAP_MS ms, then as long before the next
+ *   wait 250               ms
+ *   move 3 -2 40           pointing device motion at every scan for 40 ms (1 when left out)
+ *
+ * Keys are written like in a keymap: KC_A, KC_1, KC_LCTL, LCTL(KC_C), MO(1), TDM_PLAY... or a
+ * number. Running a script only drives the keyboard, the caller resets it and calls tdm_init.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+bool script_run(const char* path); //false, after printing why, when the script can't be read or run
@@ -0,0 +1,643 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sim.h"
+#include "rgblight.h"
+
+/* Host log, grown as needed */
+static _Thread_local char* sim_log_text;
+static _Thread_local size_t sim_log_length;
+static _Thread_local size_t sim_log_capacity;
+static _Thread_local uint32_t sim_report_count;
+static _Thread_local FILE* sim_console_file;
+
+static void sim_logf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void sim_logf(const char* format, ...) {
+	va_list args;
+	for (;;) {
+		va_start(args, format);
+		int length = vsnprintf(sim_log_text + sim_log_length, sim_log_capacity - sim_log_length, format, args);
+		va_end(args);
+		assert(length >= 0);
+		if (sim_log_length + length < sim_log_capacity) {
+			sim_log_length += length;
+			return;
+		}
+		sim_log_capacity = (sim_log_capacity + length) * 2;
+		sim_log_text = realloc(sim_log_text, sim_log_capacity);
+		assert(sim_log_text != NULL);
+	}
+}
+
+const char* sim_log(void) {
+	return sim_log_length ? sim_log_text : "";
+}
+
+void sim_log_clear(void) {
+	sim_log_length = 0;
+}
+
+void sim_free(void) {
+	free(sim_log_text);
+	sim_log_text = NULL;
+	sim_log_length = sim_log_capacity = 0;
+}
+
+uint32_t sim_reports(void) {
+	return sim_report_count;
+}
+
+void sim_console(FILE* file) {
+	sim_console_file = file;
+}
+
+int uprintf(const char* format, ...) {
+	if (sim_console_file == NULL) {
+		return 0;
+	}
+	va_list args;
+	va_start(args, format);
+	int length = vfprintf(sim_console_file, format, args);
+	va_end(args);
+	return length;
+}
+
+int8_t sendchar(uint8_t c) {
+	if (sim_console_file != NULL) {
+		fputc(c, sim_console_file);
+	}
+	return 0;
+}
+
+/* Timer and deferred executors (quantum/deferred_exec.c) */
+#define SIM_DEFERRED_EXECUTORS 8
+
+typedef struct {
+	deferred_token token;
+	uint32_t trigger_time;
+	deferred_exec_callback callback;
+	void* cb_arg;
+} sim_executor_t;
+
+static _Thread_local uint32_t sim_now;
+static _Thread_local sim_executor_t sim_executors[SIM_DEFERRED_EXECUTORS];
+static _Thread_local deferred_token sim_last_token;
+static _Thread_local uint32_t sim_last_check;
+
+uint16_t timer_read(void) {
+	return (uint16_t)sim_now;
+}
+
+uint32_t timer_read32(void) {
+	return sim_now;
+}
+
+// busy waits, nothing else runs meanwhile
+void wait_ms(uint32_t ms) {
+	sim_now += ms;
+}
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void* cb_arg) {
+	if (delay_ms == 0 || callback == NULL) {
+		return INVALID_DEFERRED_TOKEN;
+	}
+	for (int i = 0; i < SIM_DEFERRED_EXECUTORS; i++) {
+		sim_executor_t* entry = &sim_executors[i];
+		if (entry->token != INVALID_DEFERRED_TOKEN) {
+			continue;
+		}
+		do {
+			sim_last_token++;
+		} while (sim_last_token == INVALID_DEFERRED_TOKEN);
+		*entry = (sim_executor_t){sim_last_token, sim_now + delay_ms, callback, cb_arg};
+		return entry->token;
+	}
+	return INVALID_DEFERRED_TOKEN;
+}
+
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms) {
+	for (int i = 0; token != INVALID_DEFERRED_TOKEN && i < SIM_DEFERRED_EXECUTORS; i++) {
+		if (sim_executors[i].token == token) {
+			sim_executors[i].trigger_time = sim_now + delay_ms;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool cancel_deferred_exec(deferred_token token) {
+	for (int i = 0; token != INVALID_DEFERRED_TOKEN && i < SIM_DEFERRED_EXECUTORS; i++) {
+		if (sim_executors[i].token == token) {
+			sim_executors[i] = (sim_executor_t){INVALID_DEFERRED_TOKEN};
+			return true;
+		}
+	}
+	return false;
+}
+
+// once per ms at most, a repeating callback is rescheduled from its trigger time like QMK does
+static void sim_deferred_exec_task(void) {
+	if ((int32_t)(sim_now - sim_last_check) <= 0) {
+		return;
+	}
+	sim_last_check = sim_now;
+	for (int i = 0; i < SIM_DEFERRED_EXECUTORS; i++) {
+		sim_executor_t* entry = &sim_executors[i];
+		if (entry->token == INVALID_DEFERRED_TOKEN || (int32_t)(entry->trigger_time - sim_now) > 0) {
+			continue;
+		}
+		uint32_t delay_ms = entry->callback(entry->trigger_time, entry->cb_arg);
+		if (delay_ms > 0) {
+			entry->trigger_time += delay_ms;
+		} else {
+			*entry = (sim_executor_t){INVALID_DEFERRED_TOKEN};
+		}
+	}
+}
+
+/* Layers */
+_Thread_local layer_state_t layer_state;
+
+void layer_state_set(layer_state_t state) {
+	if (state != layer_state) {
+		sim_logf("%6lu L %08lx\n", (unsigned long)sim_now, (unsigned long)state);
+	}
+	layer_state = state;
+}
+
+void layer_clear(void) {
+	layer_state_set(0);
+}
+
+void layer_on(uint8_t layer) {
+	layer_state_set(layer_state | (layer_state_t)1 << layer);
+}
+
+void layer_off(uint8_t layer) {
+	layer_state_set(layer_state & ~((layer_state_t)1 << layer));
+}
+
+void layer_and(layer_state_t state) {
+	layer_state_set(layer_state & state);
+}
+
+/* Latency from a trigger's press to the next keyboard report */
+static _Thread_local uint16_t sim_trigger;
+static _Thread_local bool sim_triggered; //waiting for the report
+static _Thread_local bool sim_timed;
+static _Thread_local uint32_t sim_trigger_ms;
+static _Thread_local uint64_t sim_trigger_ns;
+static _Thread_local sim_latency_t sim_last_latency;
+
+static uint64_t sim_host_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+void sim_latency_trigger(uint16_t keycode) {
+	sim_trigger = keycode;
+	sim_triggered = sim_timed = false;
+}
+
+bool sim_latency(sim_latency_t* latency) {
+	*latency = sim_last_latency;
+	return sim_timed;
+}
+
+/* Host driver */
+static void sim_send_keyboard(report_keyboard_t* report) {
+	if (sim_triggered) {
+		sim_last_latency = (sim_latency_t){sim_now - sim_trigger_ms, sim_host_ns() - sim_trigger_ns};
+		sim_triggered = false;
+		sim_timed = true;
+	}
+	sim_report_count++;
+	sim_logf("%6lu K %02x", (unsigned long)sim_now, report->mods);
+	for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		sim_logf(" %02x", report->keys[i]);
+	}
+	sim_logf("\n");
+}
+
+static void sim_send_mouse(report_mouse_t* report) {
+	sim_report_count++;
+	sim_logf("%6lu M %02x %d %d\n", (unsigned long)sim_now, report->buttons, report->x, report->y);
+}
+
+static void sim_send_nkro(report_nkro_t* report) {}
+
+static host_driver_t sim_driver = {
+	.send_keyboard = sim_send_keyboard,
+	.send_nkro = sim_send_nkro,
+	.send_mouse = sim_send_mouse,
+};
+static _Thread_local host_driver_t* sim_host_driver;
+
+host_driver_t* host_get_driver(void) {
+	return sim_host_driver;
+}
+
+void host_set_driver(host_driver_t* driver) {
+	sim_host_driver = driver;
+}
+
+void host_keyboard_send(report_keyboard_t* report) {
+	if (sim_host_driver != NULL && sim_host_driver->send_keyboard != NULL) {
+		sim_host_driver->send_keyboard(report);
+	}
+}
+
+void host_nkro_send(report_nkro_t* report) {
+	if (sim_host_driver != NULL && sim_host_driver->send_nkro != NULL) {
+		sim_host_driver->send_nkro(report);
+	}
+}
+
+static void host_mouse_send(report_mouse_t* report) {
+	if (sim_host_driver != NULL && sim_host_driver->send_mouse != NULL) {
+		sim_host_driver->send_mouse(report);
+	}
+}
+
+/* Keyboard report (quantum/action_util.c, quantum/action.c) */
+static _Thread_local report_keyboard_t sim_keyboard_report;
+static _Thread_local report_keyboard_t sim_last_report;
+_Thread_local report_keyboard_t* keyboard_report; //set by sim_reboot
+_Thread_local report_nkro_t* nkro_report;
+_Thread_local keymap_config_t keymap_config;
+static _Thread_local uint8_t sim_real_mods;
+static _Thread_local uint8_t sim_weak_mods;
+static _Thread_local uint8_t sim_oneshot_mods;
+
+uint8_t get_mods(void) {
+	return sim_real_mods;
+}
+void add_mods(uint8_t mods) {
+	sim_real_mods |= mods;
+}
+void del_mods(uint8_t mods) {
+	sim_real_mods &= ~mods;
+}
+void set_mods(uint8_t mods) {
+	sim_real_mods = mods;
+}
+void clear_mods(void) {
+	sim_real_mods = 0;
+}
+uint8_t get_weak_mods(void) {
+	return sim_weak_mods;
+}
+void add_weak_mods(uint8_t mods) {
+	sim_weak_mods |= mods;
+}
+void del_weak_mods(uint8_t mods) {
+	sim_weak_mods &= ~mods;
+}
+void clear_weak_mods(void) {
+	sim_weak_mods = 0;
+}
+uint8_t get_oneshot_mods(void) {
+	return sim_oneshot_mods;
+}
+void set_oneshot_mods(uint8_t mods) {
+	sim_oneshot_mods = mods;
+}
+void clear_oneshot_mods(void) {
+	sim_oneshot_mods = 0;
+}
+
+void add_key_byte(report_keyboard_t* report, uint8_t code) {
+	int empty = -1;
+	for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (report->keys[i] == code) {
+			return;
+		}
+		if (empty == -1 && report->keys[i] == 0) {
+			empty = i;
+		}
+	}
+	if (empty != -1) {
+		report->keys[empty] = code;
+	}
+}
+
+void del_key_byte(report_keyboard_t* report, uint8_t code) {
+	for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (report->keys[i] == code) {
+			report->keys[i] = 0;
+		}
+	}
+}
+
+void add_key_bit(report_nkro_t* report, uint8_t code) {
+	report->bits[code / 8] |= 1 << (code % 8);
+}
+
+static bool sim_any_key(void) {
+	for (int i = 0; i < KEYBOARD_REPORT_KEYS; i++) {
+		if (keyboard_report->keys[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// only a report that differs from the last one is sent
+void send_keyboard_report(void) {
+	keyboard_report->mods = sim_real_mods | sim_weak_mods;
+	if (sim_oneshot_mods) {
+		keyboard_report->mods |= sim_oneshot_mods;
+		if (sim_any_key()) {
+			clear_oneshot_mods();
+		}
+	}
+	if (memcmp(keyboard_report, &sim_last_report, sizeof(sim_last_report)) != 0) {
+		sim_last_report = *keyboard_report;
+		host_keyboard_send(keyboard_report);
+	}
+}
+
+void register_mods(uint8_t mods) {
+	if (mods) {
+		add_mods(mods);
+		send_keyboard_report();
+	}
+}
+
+void unregister_mods(uint8_t mods) {
+	if (mods) {
+		del_mods(mods);
+		send_keyboard_report();
+	}
+}
+
+static void register_weak_mods(uint8_t mods) {
+	if (mods) {
+		add_weak_mods(mods);
+		send_keyboard_report();
+	}
+}
+
+static void unregister_weak_mods(uint8_t mods) {
+	if (mods) {
+		del_weak_mods(mods);
+		send_keyboard_report();
+	}
+}
+
+/* Mouse keys, only the buttons */
+static _Thread_local report_mouse_t sim_mousekey_report;
+
+static void sim_mousekey(uint8_t code, bool pressed) {
+	uint8_t button = 1 << (code - KC_BTN1);
+	uint8_t buttons = pressed ? sim_mousekey_report.buttons | button : sim_mousekey_report.buttons & ~button;
+	if (buttons != sim_mousekey_report.buttons) {
+		sim_mousekey_report.buttons = buttons;
+		host_mouse_send(&sim_mousekey_report);
+	}
+}
+
+void register_code(uint8_t code) {
+	if (code == KC_NO) {
+		return;
+	}
+	if (IS_MODIFIER_KEYCODE(code)) {
+		add_mods(MOD_BIT(code));
+		send_keyboard_report();
+	} else if (IS_BASIC_KEYCODE(code)) {
+		add_key_byte(keyboard_report, code);
+		send_keyboard_report();
+	} else if (code >= KC_BTN1 && code < KC_BTN1 + 8) {
+		sim_mousekey(code, true);
+	}
+}
+
+void unregister_code(uint8_t code) {
+	if (code == KC_NO) {
+		return;
+	}
+	if (IS_MODIFIER_KEYCODE(code)) {
+		del_mods(MOD_BIT(code));
+		send_keyboard_report();
+	} else if (IS_BASIC_KEYCODE(code)) {
+		del_key_byte(keyboard_report, code);
+		send_keyboard_report();
+	} else if (code >= KC_BTN1 && code < KC_BTN1 + 8) {
+		sim_mousekey(code, false);
+	}
+}
+
+// the modifiers of a QK_MODS keycode as a mod mask, 0x1000 is the right hand flag
+static uint8_t sim_code16_mods(uint16_t code) {
+	uint8_t mods = (code >> 8) & 0x0F;
+	return code & 0x1000 ? mods << 4 : mods;
+}
+
+void register_code16(uint16_t code) {
+	if (IS_MODIFIER_KEYCODE(code) || code == KC_NO) {
+		register_mods(sim_code16_mods(code));
+	} else {
+		register_weak_mods(sim_code16_mods(code));
+	}
+	register_code(code);
+}
+
+void unregister_code16(uint16_t code) {
+	unregister_code(code);
+	if (IS_MODIFIER_KEYCODE(code) || code == KC_NO) {
+		unregister_mods(sim_code16_mods(code));
+	} else {
+		unregister_weak_mods(sim_code16_mods(code));
+	}
+}
+
+void tap_code16(uint16_t code) {
+	register_code16(code);
+	unregister_code16(code);
+}
+
+void clear_keys(void) {
+	memset(keyboard_report->keys, 0, sizeof(keyboard_report->keys));
+}
+
+void clear_keyboard_but_mods(void) {
+	clear_keys();
+	clear_weak_mods();
+	send_keyboard_report();
+	if (sim_mousekey_report.buttons) {
+		sim_mousekey_report.buttons = 0;
+		host_mouse_send(&sim_mousekey_report);
+	}
+}
+
+void clear_keyboard(void) {
+	clear_mods();
+	clear_keyboard_but_mods();
+}
+
+/* Pointing device (quantum/pointing_device/pointing_device.c) */
+static _Thread_local report_mouse_t sim_pointing_report;
+static _Thread_local report_mouse_t sim_pointing_sent;
+static _Thread_local report_mouse_t sim_sensor;
+
+report_mouse_t pointing_device_get_report(void) {
+	return sim_pointing_report;
+}
+
+void pointing_device_set_report(report_mouse_t report) {
+	sim_pointing_report = report;
+}
+
+// motion is sent every time, a change of buttons once, then all but the buttons is zeroed
+bool pointing_device_send(void) {
+	bool changed = memcmp(&sim_pointing_report, &sim_pointing_sent, sizeof(sim_pointing_sent)) != 0 ||
+				   sim_pointing_report.x || sim_pointing_report.y || sim_pointing_report.v || sim_pointing_report.h;
+	if (changed) {
+		host_mouse_send(&sim_pointing_report);
+	}
+	sim_pointing_report = (report_mouse_t){.buttons = sim_pointing_report.buttons};
+	sim_pointing_sent = sim_pointing_report;
+	return changed || sim_pointing_report.buttons;
+}
+
+void sim_motion(int8_t x, int8_t y) {
+	sim_sensor.x = x;
+	sim_sensor.y = y;
+}
+
+static void sim_pointing_device_task(void) {
+	sim_pointing_report.x = sim_sensor.x;
+	sim_pointing_report.y = sim_sensor.y;
+	sim_sensor.x = sim_sensor.y = 0;
+	sim_pointing_report = pointing_device_task_user(sim_pointing_report);
+	pointing_device_send();
+}
+
+__attribute__((weak)) report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
+	return mouse_report;
+}
+
+/* EEPROM */
+static _Thread_local uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+static uint8_t* sim_eeprom_at(const void* addr, size_t length) {
+	uintptr_t offset = (uintptr_t)addr;
+	assert(offset + length <= SIM_EEPROM_SIZE);
+	return sim_eeprom + offset;
+}
+
+uint8_t eeprom_read_byte(const uint8_t* addr) {
+	return *sim_eeprom_at(addr, 1);
+}
+
+void eeprom_write_byte(uint8_t* addr, uint8_t value) {
+	*sim_eeprom_at(addr, 1) = value;
+}
+
+void eeprom_update_byte(uint8_t* addr, uint8_t value) {
+	*sim_eeprom_at(addr, 1) = value;
+}
+
+void eeprom_read_block(void* buf, const void* addr, size_t len) {
+	memcpy(buf, sim_eeprom_at(addr, len), len);
+}
+
+void eeprom_update_block(const void* buf, void* addr, size_t len) {
+	memcpy(sim_eeprom_at(addr, len), buf, len);
+}
+
+/* Feedback and raw HID, nothing to see on a host */
+void backlight_toggle(void) {}
+void rgblight_setrgb_at(uint8_t r, uint8_t g, uint8_t b, int index) {}
+void raw_hid_send(uint8_t* data, uint8_t length) {}
+
+/* The keyboard */
+__attribute__((weak)) bool process_record_user(uint16_t keycode, keyrecord_t* record) {
+	return true;
+}
+
+void sim_reboot(void) {
+	sim_now = 0;
+	sim_last_check = 0;
+	sim_last_token = INVALID_DEFERRED_TOKEN;
+	memset(sim_executors, 0, sizeof(sim_executors));
+	layer_state = 0;
+	sim_real_mods = sim_weak_mods = sim_oneshot_mods = 0;
+	sim_keyboard_report = sim_last_report = (report_keyboard_t){0};
+	sim_mousekey_report = sim_pointing_report = sim_pointing_sent = sim_sensor = (report_mouse_t){0};
+	keyboard_report = &sim_keyboard_report;
+	keymap_config = (keymap_config_t){0};
+	sim_host_driver = &sim_driver;
+	sim_report_count = 0;
+	sim_triggered = sim_timed = false;
+	sim_log_clear();
+}
+
+void sim_reset(void) {
+	memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+	sim_reboot();
+}
+
+// what QMK does with a keycode the keymap let through
+static void sim_process_action(uint16_t keycode, bool pressed) {
+	if (keycode >= QK_MOMENTARY && keycode <= QK_MOMENTARY_MAX) {
+		if (pressed) {
+			layer_on(keycode & 0x1F);
+		} else {
+			layer_off(keycode & 0x1F);
+		}
+	} else if (keycode <= QK_MODS_MAX) {
+		if (pressed) {
+			register_code16(keycode);
+		} else {
+			unregister_code16(keycode);
+		}
+	}
+}
+
+void sim_key(uint16_t keycode, bool pressed) {
+	keyrecord_t record = {
+		.event = {.time = timer_read() | 1, .type = KEY_EVENT, .pressed = pressed},
+		.keycode = keycode,
+	};
+	if (pressed && keycode == sim_trigger && sim_trigger != KC_NO) {
+		sim_triggered = true;
+		sim_timed = false;
+		sim_trigger_ms = sim_now;
+		sim_trigger_ns = sim_host_ns();
+	}
+	if (process_record_user(keycode, &record)) {
+		sim_process_action(keycode, pressed);
+	}
+}
+
+void sim_wait(uint32_t ms) {
+	while (ms--) {
+		sim_now++;
+		sim_pointing_device_task();
+		sim_deferred_exec_task();
+	}
+}
+
+void sim_tap(uint16_t keycode) {
+	sim_key(keycode, true);
+	sim_wait(SIM_TAP_MS);
+	sim_key(keycode, false);
+}
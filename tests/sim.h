@@ -0,0 +1,70 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+ * @file sim.h
+ * @brief A simulated QMK keyboard to run temporal_dynamic_macro.c on a host.
+ *
+ * It has QMK's millisecond timer and deferred executors, layers, modifiers,
+ * the keyboard report with its duplicate suppression, mouse keys, a pointing
+ * device and EEPROM, all behaving like QMK's. Key events go through
+ * process_record_user, and when it returns true QMK's own handling of the
+ * keycode. The host logs everything it receives, with the time it arrived:
+ *
+ *   <ms> K <mods> <6 keys>     keyboard report, hex
+ *   <ms> M <buttons> <x> <y>   mouse report
+ *   <ms> L <layer state>       layers changed (not sent to the host, logged for the tests)
+ *
+ * It also times the path from a trigger key's press to the next keyboard
+ * report, in keyboard milliseconds, blocking waits included, and in host
+ * nanoseconds for the code that runs in between (see sim_latency).
+ *
+ * Everything is per thread: each thread has a keyboard of its own.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "quantum.h"
+
+#define SIM_EEPROM_SIZE 4096
+#define SIM_TAP_MS 20 //how long sim_tap holds a key
+
+void sim_reset(void); //a new keyboard: nothing held, time 0, the log and EEPROM empty
+void sim_reboot(void); //power cycle, only EEPROM is kept
+void sim_free(void); //before the thread exits
+void sim_key(uint16_t keycode, bool pressed); //a key event in the current scan
+void sim_tap(uint16_t keycode); //press, SIM_TAP_MS ms, release
+void sim_wait(uint32_t ms); //scans ms times, deferred callbacks run as they come due
+void sim_motion(int8_t x, int8_t y); //what the pointing device reads at the next scan
+void sim_console(FILE* file); //where uprintf and sendchar go, NULL drops them (the default)
+
+const char* sim_log(void); //what the host received since the reset, as above
+void sim_log_clear(void);
+uint32_t sim_reports(void); //keyboard and mouse reports sent since the reset
+
+typedef struct {
+	uint32_t ms; //keyboard time, wait_ms included
+	uint64_t ns; //host time the code took
+} sim_latency_t;
+
+void sim_latency_trigger(uint16_t keycode); //whose presses are timed, KC_NO (the default) for none
+bool sim_latency(sim_latency_t* latency); //from the last timed press to the report after it, false if none came yet
+
+// the keymap's hooks, as in QMK, the defaults do nothing
+bool process_record_user(uint16_t keycode, keyrecord_t* record);
+report_mouse_t pointing_device_task_user(report_mouse_t mouse_report);
@@ -0,0 +1,242 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Replays a corpus of recorded sessions (scripts, see script.h) on worker threads, each session on
+ * a new keyboard with an engine instance of its own (TDM_MULTI_INSTANCE), and sums up what they
+ * did: pool capacity used, events recorded and played, reports sent and how late playback ran.
+ *
+ *   tdm_replay [-j threads] [-n times] [-v] [--check] path...
+ *
+ * A path is a script or a directory of them (*.txt). -n replays each one that many times, -v prints
+ * a line per session. --check also replays every session alone on the main thread first, and fails
+ * unless each replay sent the very same reports: instances must not share any state.
+ */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "script.h"
+#include "sim.h"
+#include "temporal_dynamic_macro.h"
+
+typedef struct {
+	const char* path;
+	bool ok;
+	uint32_t ms; //keyboard time
+	uint64_t hash; //of the reports
+	uint32_t reports;
+	tdm_counters_t counters;
+} replay_t;
+
+static char** paths;
+static size_t path_count;
+static replay_t* replays;
+static size_t replay_count;
+static atomic_size_t replay_next;
+static bool verbose;
+
+static void add_path(const char* path) {
+	paths = realloc(paths, (path_count + 1) * sizeof(*paths));
+	paths[path_count++] = strdup(path);
+}
+
+static int compare_paths(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// a script, or the *.txt of a directory in name order
+static bool add_corpus(const char* path) {
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		if (access(path, R_OK) != 0) {
+			perror(path);
+			return false;
+		}
+		add_path(path);
+		return true;
+	}
+	size_t first = path_count;
+	for (struct dirent* entry; (entry = readdir(dir)) != NULL;) {
+		size_t length = strlen(entry->d_name);
+		if (length > 4 && strcmp(entry->d_name + length - 4, ".txt") == 0) {
+			char file[4096];
+			snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+			add_path(file);
+		}
+	}
+	closedir(dir);
+	qsort(paths + first, path_count - first, sizeof(*paths), compare_paths);
+	return true;
+}
+
+// FNV-1a
+static uint64_t hash_text(const char* text) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (; *text; text++) {
+		hash = (hash ^ (uint8_t)*text) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// on a new keyboard and engine instance, selected on the calling thread
+static void replay(replay_t* replay, tdm_context_t* context) {
+	tdm_context_init(context);
+	tdm_context_select(context);
+	sim_reset();
+	tdm_init();
+	replay->ok = script_run(replay->path);
+	replay->ms = timer_read32();
+	replay->hash = hash_text(sim_log());
+	replay->reports = sim_reports();
+	replay->counters = *tdm_get_counters();
+	tdm_context_select(NULL);
+}
+
+static void* worker(void* arg) {
+	tdm_context_t* context = malloc(tdm_context_size());
+	for (size_t i; (i = atomic_fetch_add(&replay_next, 1)) < replay_count;) {
+		replay(&replays[i], context);
+	}
+	free(context);
+	sim_free();
+	return NULL;
+}
+
+static double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int usage(const char* name) {
+	fprintf(stderr, "usage: %s [-j threads] [-n times] [-v] [--check] path...\n", name);
+	return 2;
+}
+
+int main(int argc, char** argv) {
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long times = 1;
+	bool check = false;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+			threads = atol(argv[++arg]);
+		} else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+			times = atol(argv[++arg]);
+		} else if (strcmp(argv[arg], "-v") == 0) {
+			verbose = true;
+		} else if (strcmp(argv[arg], "--check") == 0) {
+			check = true;
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (arg == argc || threads < 1 || times < 1) {
+		return usage(argv[0]);
+	}
+	for (; arg < argc; arg++) {
+		if (!add_corpus(argv[arg])) {
+			return 1;
+		}
+	}
+	if (path_count == 0) {
+		fprintf(stderr, "no sessions to replay\n");
+		return 1;
+	}
+
+	replay_count = path_count * times;
+	replays = calloc(replay_count, sizeof(*replays));
+	for (size_t i = 0; i < replay_count; i++) {
+		replays[i].path = paths[i % path_count];
+	}
+	replay_t* alone = calloc(path_count, sizeof(*alone));
+	if (check) {
+		tdm_context_t* context = malloc(tdm_context_size());
+		for (size_t i = 0; i < path_count; i++) {
+			alone[i].path = paths[i];
+			replay(&alone[i], context);
+		}
+		free(context);
+	}
+
+	double start = seconds();
+	pthread_t* workers = calloc(threads, sizeof(*workers));
+	for (long i = 0; i < threads; i++) {
+		pthread_create(&workers[i], NULL, worker, NULL);
+	}
+	for (long i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	double elapsed = seconds() - start;
+
+	int failed = 0;
+	uint64_t ms = 0, recorded = 0, played = 0, loops = 0, reports = 0, high_water = 0;
+	uint16_t most = 0, lateness = 0;
+	size_t late = 0;
+	for (size_t i = 0; i < replay_count; i++) {
+		replay_t* r = &replays[i];
+		if (verbose) {
+			printf("%s: %lu ms, %u/%u entries, %lu recorded, %lu played, %lu reports, %u ms late\n", r->path,
+				   (unsigned long)r->ms, r->counters.high_water, TDM_BUFFER_SIZE,
+				   (unsigned long)r->counters.events_recorded, (unsigned long)r->counters.events_played,
+				   (unsigned long)r->reports, r->counters.max_lateness_ms);
+		}
+		if (!r->ok) {
+			failed++;
+			continue;
+		}
+		replay_t* reference = &alone[i % path_count];
+		if (check && (r->hash != reference->hash || r->ms != reference->ms)) {
+			printf("FAIL %s: sent other reports in parallel than alone\n", r->path);
+			failed++;
+		}
+		ms += r->ms;
+		recorded += r->counters.events_recorded;
+		played += r->counters.events_played;
+		loops += r->counters.loops_completed;
+		reports += r->reports;
+		high_water += r->counters.high_water;
+		if (r->counters.high_water > most) {
+			most = r->counters.high_water;
+		}
+		if (r->counters.max_lateness_ms > lateness) {
+			lateness = r->counters.max_lateness_ms;
+		}
+		late += r->counters.max_lateness_ms > 0;
+	}
+	printf("replayed %lu sessions (%lu x %ld) on %ld threads in %.2f s, %.1f h of keyboard time\n",
+		   (unsigned long)replay_count, (unsigned long)path_count, times, threads, elapsed, ms / 3600000.0);
+	printf("  events: %llu recorded, %llu played, %llu loops, %llu reports\n", (unsigned long long)recorded,
+		   (unsigned long long)played, (unsigned long long)loops, (unsigned long long)reports);
+	printf("  pool: %u of %u entries at most, %.1f on average\n", most, TDM_BUFFER_SIZE,
+		   (double)high_water / replay_count);
+	printf("  timing: playback ran %u ms late at worst, late in %lu sessions\n", lateness, (unsigned long)late);
+	if (check && !failed) {
+		printf("  every session sent the same reports in parallel as alone\n");
+	}
+	for (size_t i = 0; i < path_count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(replays);
+	free(alone);
+	free(workers);
+	sim_free();
+	return failed ? 1 : 0;
+}
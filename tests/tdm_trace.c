@@ -0,0 +1,47 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Runs a script (see script.h) on a new keyboard and prints every report the host got, with the
+ * time it arrived (see sim.h). The golden traces in tests/golden are its output for the scenarios,
+ * so a change that alters what playback sends shows up as a diff:
+ *
+ *   tdm_trace [-v] scenarios/chords.txt
+ *
+ * -v prints the module's console to stderr.
+ */
+
+#include <string.h>
+
+#include "script.h"
+#include "sim.h"
+#include "temporal_dynamic_macro.h"
+
+int main(int argc, char** argv) {
+	int arg = 1;
+	if (arg < argc && strcmp(argv[arg], "-v") == 0) {
+		sim_console(stderr);
+		arg++;
+	}
+	if (arg + 1 != argc) {
+		fprintf(stderr, "usage: %s [-v] script\n", argv[0]);
+		return 2;
+	}
+	sim_reset();
+	tdm_init();
+	if (!script_run(argv[arg])) {
+		return 1;
+	}
+	fputs(sim_log(), stdout);
+	return 0;
+}
@@ -0,0 +1,108 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Trigger-to-first-report latency of a normal and an armed start.
+ *
+ * A macro is played many times both ways and the simulator times each start from the press of
+ * TDM_PLAY to the first keyboard report (see sim_latency): in keyboard time, which includes the
+ * release and tdm_play_user's blocking feedback of a normal start, and in host time, what the code in
+ * between costs. An armed start must send its first report in the same scan as the press, and the
+ * module's own counter (max_arm_latency_ms) must agree with what the simulator measured.
+ *
+ *   test_latency [-v]
+ *
+ * -v prints the module's console.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "custom_keycodes.h"
+#include "temporal_dynamic_macro.h"
+
+#define ROUNDS 101
+
+static int compare_ns(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// the latencies of ROUNDS plays, armed or not, false if one sent nothing
+static bool measure(bool armed, uint32_t* max_ms, uint64_t ns[ROUNDS]) {
+	*max_ms = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		if (armed) {
+			sim_tap(TDM_ARM);
+			sim_wait(TDM_DEBOUNCE_DELAY);
+		}
+		sim_tap(TDM_PLAY);
+		sim_wait(1000);
+		sim_latency_t latency;
+		if (!sim_latency(&latency)) {
+			return false;
+		}
+		if (latency.ms > *max_ms) {
+			*max_ms = latency.ms;
+		}
+		ns[i] = latency.ns;
+	}
+	qsort(ns, ROUNDS, sizeof(*ns), compare_ns);
+	return true;
+}
+
+static void print(const char* start, uint32_t max_ms, const uint64_t ns[ROUNDS]) {
+	printf("  %-6s start: %3lu ms at most, %6.1f us median, %6.1f us at worst on this host\n", start,
+		   (unsigned long)max_ms, ns[ROUNDS / 2] / 1e3, ns[ROUNDS - 1] / 1e3);
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		sim_console(stdout);
+	}
+	sim_reset();
+	tdm_init();
+	sim_tap(TDM_RECORD);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	sim_tap(KC_A);
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	sim_latency_trigger(TDM_PLAY);
+
+	uint32_t normal_ms, armed_ms;
+	uint64_t normal_ns[ROUNDS], armed_ns[ROUNDS];
+	if (!measure(false, &normal_ms, normal_ns) || !measure(true, &armed_ms, armed_ns)) {
+		printf("FAIL the macro sent nothing after TDM_PLAY\n");
+		return 1;
+	}
+	printf("latency: from pressing TDM_PLAY to the first report, over %d plays\n", ROUNDS);
+	print("normal", normal_ms, normal_ns);
+	print("armed", armed_ms, armed_ns);
+
+	int failed = 0;
+	if (armed_ms != 0) {
+		printf("FAIL an armed start sent its first report %lu ms after the press\n", (unsigned long)armed_ms);
+		failed = 1;
+	}
+	if (tdm_get_counters()->max_arm_latency_ms != armed_ms) {
+		printf("FAIL the module counted %u ms for an armed start\n", tdm_get_counters()->max_arm_latency_ms);
+		failed = 1;
+	}
+	if (normal_ms <= armed_ms) {
+		printf("FAIL a normal start is as quick as an armed one\n");
+		failed = 1;
+	}
+	sim_free();
+	return failed;
+}
@@ -0,0 +1,103 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Macros the library has no room for.
+ *
+ * The library is filled by one macro, then two more are recorded past it. They only live in RAM and
+ * take both cache ways, so playing the saved macro, which would need one of them, or recording a
+ * fourth slot must be refused and counted, and the two unsaved macros must still play in full.
+ *
+ *   test_library [-v]
+ *
+ * -v prints the module's console.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+#include "custom_keycodes.h"
+#include "temporal_dynamic_macro.h"
+
+static void select_slot(uint16_t slot) {
+	sim_tap(TDM_SELECT);
+	sim_tap(slot == 0 ? KC_0 : KC_1 + slot - 1);
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+}
+
+// slot's key, taps times, written to the library as far as it fits
+static void record(uint16_t slot, uint8_t taps) {
+	select_slot(slot);
+	sim_tap(TDM_RECORD);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	for (uint8_t i = 0; i < taps; i++) {
+		sim_tap(KC_A + slot);
+		sim_wait(10);
+	}
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	tdm_library_flush();
+}
+
+// presses of the slot's key when it's played
+static uint32_t plays(uint16_t slot) {
+	select_slot(slot);
+	sim_log_clear();
+	sim_tap(TDM_PLAY);
+	sim_wait(2000);
+	uint32_t presses = 0;
+	char key[8];
+	snprintf(key, sizeof(key), " %02x ", KC_A + slot);
+	for (const char* line = strstr(sim_log(), " K 00"); line != NULL; line = strstr(line + 1, " K 00")) {
+		presses += strncmp(line + 5, key, 4) == 0;
+	}
+	return presses;
+}
+
+static int failures;
+
+static void expect(uint32_t got, uint32_t expected, const char* what) {
+	if (got != expected) {
+		printf("FAIL %s: %lu instead of %lu\n", what, (unsigned long)got, (unsigned long)expected);
+		failures++;
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		sim_console(stdout);
+	}
+	sim_reset();
+	tdm_init();
+	record(0, 6); //fills the library
+	record(1, 5); //these two don't fit, and take both ways
+	record(2, 4);
+	expect(plays(1), 5, "presses of the first unsaved macro");
+	expect(plays(2), 4, "presses of the second unsaved macro");
+
+	expect(plays(0), 0, "presses of a saved macro that has no way");
+	expect(tdm_get_counters()->cache_refused, 1, "refusals after playing it");
+	record(3, 2);
+	expect(tdm_get_counters()->cache_refused, 2, "refusals after recording a new slot");
+	expect(plays(3), 0, "presses of the slot that couldn't be recorded");
+
+	expect(plays(1), 5, "presses of the first unsaved macro afterwards");
+	expect(plays(2), 4, "presses of the second unsaved macro afterwards");
+	sim_free();
+	if (failures) {
+		return 1;
+	}
+	printf("library: macros it had no room for stay in RAM, what needs their ways is refused\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Reports per scan with TDM_REPORT_MIX.
+ *
+ * A macro recorded without delays plays all at once, so everything it changes lands in the same
+ * tdm_play calls. It must send at most one report per scan, and still every tap: a key pressed
+ * twice in a row, keys under a held modifier and a chord must each reach the host as separate
+ * presses, with their modifiers.
+ *
+ *   test_mix [-v]
+ *
+ * -v prints the module's console.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+#include "custom_keycodes.h"
+#include "temporal_dynamic_macro.h"
+
+#define SCANS 200
+
+static const struct {
+	uint8_t key;
+	uint8_t mods;
+	uint8_t presses;
+} expected[] = {
+	{KC_A, MOD_BIT(KC_LSFT), 1},
+	{KC_A + 1, MOD_BIT(KC_LSFT), 1},
+	{KC_A + 2, 0, 2},
+	{KC_A + 3, 0, 1},
+	{KC_A + 4, MOD_BIT(KC_LCTL), 1},
+	{KC_A + 5, 0, 1},
+};
+
+static int failures;
+
+// presses of the key in the log, false if one of them didn't have the modifiers
+static bool presses(uint8_t key, uint8_t mods, uint8_t* count) {
+	bool held = false, right = true;
+	*count = 0;
+	for (const char* line = strstr(sim_log(), " K "); line != NULL; line = strstr(line + 1, " K ")) {
+		unsigned report[7];
+		if (sscanf(line, " K %x %x %x %x %x %x %x", &report[0], &report[1], &report[2], &report[3], &report[4],
+				   &report[5], &report[6]) != 7) {
+			continue;
+		}
+		bool down = false;
+		for (int i = 1; i < 7; i++) {
+			down |= report[i] == key;
+		}
+		if (down && !held) {
+			(*count)++;
+			right &= report[0] == mods;
+		}
+		held = down;
+	}
+	return right;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		sim_console(stdout);
+	}
+	sim_reset();
+	tdm_init();
+	sim_tap(TDM_RECORD);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	sim_key(KC_LSFT, true);
+	sim_tap(KC_A);
+	sim_tap(KC_A + 1);
+	sim_key(KC_LSFT, false);
+	sim_tap(KC_A + 2);
+	sim_tap(KC_A + 3);
+	sim_tap(KC_A + 2);
+	sim_key(KC_LCTL, true);
+	sim_tap(KC_A + 4);
+	sim_key(KC_LCTL, false);
+	sim_tap(KC_A + 5);
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+
+	sim_log_clear();
+	uint32_t most = 0, total = sim_reports();
+	for (int scan = 0; scan < SCANS; scan++) {
+		uint32_t before = sim_reports();
+		sim_wait(1);
+		if (scan < 2) { //the keys of a millisecond come after its callbacks
+			sim_key(TDM_PLAY, scan == 0);
+		}
+		if (sim_reports() - before > most) {
+			most = sim_reports() - before;
+		}
+	}
+	total = sim_reports() - total;
+	if (most > 1) {
+		printf("FAIL a scan sent %lu reports\n", (unsigned long)most);
+		failures++;
+	}
+	for (uint8_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+		uint8_t count;
+		bool mods = presses(expected[i].key, expected[i].mods, &count);
+		if (count != expected[i].presses || !mods) {
+			printf("FAIL key %02x: %u presses instead of %u%s\n", expected[i].key, count, expected[i].presses,
+				   mods ? "" : ", with the wrong modifiers");
+			failures++;
+		}
+	}
+	sim_free();
+	if (failures) {
+		return 1;
+	}
+	printf("mix: %lu reports for 7 taps, one per scan at most, none lost\n", (unsigned long)total);
+	return 0;
+}
@@ -0,0 +1,227 @@
+// Copyright 2024 Jack Bellinger
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/* Power cuts while the macro library is written.
+ *
+ * A workload re-records macros while earlier ones are still being written, abandons a record by
+ * re-recording its slot, and fills the bank so it gets compacted. It's run once to count the flash
+ * operations it takes, then once per operation with power cut right before it. Each time, the
+ * keyboard boots again from the flash file and must recover exactly the library that was committed
+ * when power went: for every slot the record whose header was written last, entry for entry, which
+ * then plays, counted in the pool's high water. Then it must go on saving over whatever the cut left
+ * behind.
+ *
+ * The module is included to see what it had committed (tdm_library_find) at the cut.
+ */
+
+#include <stdlib.h>
+
+#include "../temporal_dynamic_macro.c"
+#include "flash.h"
+#include "sim.h"
+
+#define FLASH_SIZE (2 * TDM_LIBRARY_BANK_SIZE)
+#define MAX_TAPS 12
+
+static const char* baseline_path = "powercut_baseline.bin";
+static const char* flash_path = "powercut.bin";
+
+// what a recording of slot with taps taps holds, indexed by taps as every version has its own count
+static uint8_t versions[TDM_NUM_MACROS][MAX_TAPS + 1][4 * MAX_TAPS * sizeof(tdm_keypress_t)];
+static uint16_t version_lengths[TDM_NUM_MACROS][MAX_TAPS + 1];
+
+static tdm_library_slot_t committed[TDM_NUM_MACROS];
+
+static void snapshot(void) {
+	for (uint16_t slot = 0; slot < TDM_NUM_MACROS; slot++) {
+		committed[slot] = tdm_library_find(slot);
+	}
+}
+
+static void boot(void) {
+	tdm = (tdm_context_t)TDM_CONTEXT_INIT;
+	sim_reboot();
+	tdm_init();
+	sim_wait(TDM_DEBOUNCE_DELAY);
+}
+
+static void select_slot(uint16_t slot) {
+	sim_tap(TDM_SELECT);
+	sim_tap(slot == 0 ? KC_0 : KC_1 + slot - 1);
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+}
+
+// slot's key, taps times
+static void record(uint16_t slot, uint8_t taps) {
+	select_slot(slot);
+	sim_tap(TDM_RECORD);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	for (uint8_t i = 0; i < taps; i++) {
+		sim_tap(KC_A + slot);
+		sim_wait(10);
+	}
+	sim_tap(TDM_END);
+	sim_wait(TDM_DEBOUNCE_DELAY);
+	uint16_t length = TDM_SLOT_LENGTH(slot);
+	if (version_lengths[slot][taps] == 0) {
+		version_lengths[slot][taps] = length;
+		memcpy(versions[slot][taps], TDM_SLOT_START(slot), length * sizeof(tdm_keypress_t));
+	}
+}
+
+static void workload(void) {
+	record(0, 4);
+	record(1, 5);
+	record(1, 1); //while the first one is written
+	record(2, 6);
+	record(0, 7);
+	record(2, 3);
+	record(1, 8);
+	while (tdm_library_dirty()) {
+		sim_wait(TDM_WRITE_INTERVAL);
+	}
+}
+
+static int failures;
+
+static void fail(uint32_t cut, const char* what, uint16_t slot) {
+	printf("FAIL cut at operation %lu: slot %u %s\n", (unsigned long)cut, slot, what);
+	failures++;
+}
+
+// the taps of the slot's version that many entries long, 0 if there's none
+static uint8_t taps_of(uint16_t slot, uint16_t length) {
+	for (uint8_t taps = 1; taps <= MAX_TAPS; taps++) {
+		if (version_lengths[slot][taps] == length) {
+			return taps;
+		}
+	}
+	return 0;
+}
+
+static uint32_t plays(uint16_t slot) {
+	select_slot(slot);
+	sim_log_clear();
+	sim_tap(TDM_PLAY);
+	sim_wait(2000);
+	uint32_t presses = 0;
+	char key[8];
+	snprintf(key, sizeof(key), " %02x ", KC_A + slot);
+	for (const char* line = strstr(sim_log(), " K 00"); line != NULL; line = strstr(line + 1, " K 00")) {
+		presses += strncmp(line + 5, key, 4) == 0;
+	}
+	return presses;
+}
+
+// after booting from the flash, every slot holds what was committed
+static bool check(uint32_t cut) {
+	int before = failures;
+	for (uint16_t slot = 0; slot < TDM_NUM_MACROS; slot++) {
+		tdm_library_slot_t got = tdm_library_find(slot);
+		if (got.length != committed[slot].length || (got.length && got.seq != committed[slot].seq)) {
+			printf("  expected %u entries seq %u, got %u entries seq %u\n", committed[slot].length,
+				   committed[slot].seq, got.length, got.seq);
+			fail(cut, "isn't the last committed record", slot);
+			continue;
+		}
+		if (got.length == 0) {
+			continue;
+		}
+		uint8_t taps = taps_of(slot, got.length);
+		uint8_t entries[4 * MAX_TAPS * sizeof(tdm_keypress_t)];
+		tdm_library_read(got.address, entries, got.length * sizeof(tdm_keypress_t));
+		if (taps == 0 || memcmp(entries, versions[slot][taps], got.length * sizeof(tdm_keypress_t)) != 0) {
+			fail(cut, "has entries that weren't recorded", slot);
+			continue;
+		}
+		uint32_t played = plays(slot);
+		if (played != taps) {
+			printf("  %lu presses instead of %u\n", (unsigned long)played, taps);
+			fail(cut, "doesn't play back", slot);
+		}
+		if (tdm.counters.high_water < got.length) { //loaded into an empty pool
+			printf("  the pool's high water is %u\n", tdm.counters.high_water);
+			fail(cut, "was loaded without counting it", slot);
+		}
+	}
+	return failures == before;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		sim_console(stdout);
+	}
+	sim_reset();
+	remove(baseline_path);
+	if (!flash_open(baseline_path, FLASH_SIZE)) {
+		perror(baseline_path);
+		return 1;
+	}
+	boot();
+	record(0, 2);
+	record(1, 3);
+	tdm_library_flush();
+	flash_close();
+
+	flash_copy(baseline_path, flash_path);
+	flash_open(flash_path, FLASH_SIZE);
+	boot();
+	flash_power_cut(UINT32_MAX, NULL);
+	workload();
+	uint32_t operations = flash_operations();
+	bool compacted = tdm.library_epoch != 0;
+	flash_close();
+	if (!compacted) {
+		printf("FAIL the workload doesn't compact the library, make it longer\n");
+		return 1;
+	}
+
+	for (uint32_t cut = 0; cut <= operations; cut++) {
+		flash_copy(baseline_path, flash_path);
+		flash_open(flash_path, FLASH_SIZE);
+		boot();
+		flash_power_cut(cut, snapshot);
+		workload();
+		if (flash_powered()) { //nothing lost
+			snapshot();
+		}
+		flash_close();
+
+		flash_open(flash_path, FLASH_SIZE);
+		flash_power_cut(UINT32_MAX, NULL);
+		boot();
+		if (!check(cut)) {
+			break;
+		}
+		// the next save goes over whatever the cut left
+		record(2, 9);
+		tdm_library_flush();
+		snapshot();
+		flash_close();
+		flash_open(flash_path, FLASH_SIZE);
+		boot();
+		bool saved = check(cut);
+		flash_close();
+		if (!saved) {
+			break;
+		}
+	}
+	if (failures) {
+		printf("the flash is left in %s\n", flash_path);
+		return 1;
+	}
+	printf("powercut: the library was recovered after a cut at each of %lu operations\n", (unsigned long)operations + 1);
+	return 0;
+}
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+# Copyright 2024 Jack Bellinger
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compiles macros written as text to bytecode, in a container image.
+
+One statement per line, # starts a comment:
+
+    macro 3 time_scale=8       # the slot, then optional timing like in JSON
+    tap ctrl+c                 # keys: a, f5, enter, lsft, 0x68... with mods+ in front
+    press lsft
+    wait 250                   # ms
+    repeat 5                   # 1 to 255 times, up to the matching end
+        type hello
+        wait 40
+    end
+    release lsft
+    mods lctl+lalt             # the modifiers held from now on, or none
+    call 4                     # plays the bytecode macro of slot 4, then goes on
+
+A chord like ctrl+c is played as one LCTL(KC_C) keycode, so its modifiers
+must all be left-hand or all right-hand ones. type taps each character of a
+word, shifting the capitals.
+
+The keyboard stops a program after 65535 instructions, counting every run of
+a repeat and the programs it calls, so programs that would go further are
+refused. How long one run lasts is stored with it.
+
+    python3 tools/tdm_compile.py macros.txt -o macros.tdmc
+    python3 tools/tdm_compile.py --disassemble macros.tdmc
+"""
+
+import argparse
+import sys
+
+import tdm_container
+from tdm_container import BYTECODE, OPCODES, OP_WAIT, VM_DEPTH
+
+OP = {name: index for index, name in enumerate(OPCODES)}
+
+MODS = {'lctl': 0x01, 'lsft': 0x02, 'lalt': 0x04, 'lgui': 0x08,
+        'rctl': 0x10, 'rsft': 0x20, 'ralt': 0x40, 'rgui': 0x80}
+MOD_ALIASES = {'ctrl': 'lctl', 'shift': 'lsft', 'alt': 'lalt', 'gui': 'lgui', 'cmd': 'lgui', 'win': 'lgui',
+               'altgr': 'ralt'}
+
+KEYS = {chr(ord('a') + i): 0x04 + i for i in range(26)}
+KEYS.update({str((i + 1) % 10): 0x1E + i for i in range(10)})
+KEYS.update({'f%d' % (i + 1): 0x3A + i for i in range(12)})
+KEYS.update({'f%d' % (i + 13): 0x68 + i for i in range(12)})
+KEYS.update({
+    'enter': 0x28, 'esc': 0x29, 'bspc': 0x2A, 'tab': 0x2B, 'space': 0x2C, 'minus': 0x2D, 'equal': 0x2E,
+    'lbrc': 0x2F, 'rbrc': 0x30, 'bsls': 0x31, 'scln': 0x33, 'quot': 0x34, 'grave': 0x35, 'comma': 0x36,
+    'dot': 0x37, 'slash': 0x38, 'caps': 0x39, 'pscr': 0x46, 'scrl': 0x47, 'pause': 0x48, 'ins': 0x49,
+    'home': 0x4A, 'pgup': 0x4B, 'del': 0x4C, 'end': 0x4D, 'pgdn': 0x4E, 'right': 0x4F, 'left': 0x50,
+    'down': 0x51, 'up': 0x52, 'app': 0x65,
+})
+KEYS.update({name: 0xE0 + bit for bit, name in enumerate(MODS)})
+
+# the characters type spells with other keys, and the ones it shifts
+SYMBOL_KEYS = ['minus', 'equal', 'lbrc', 'rbrc', 'bsls', 'scln', 'quot', 'grave', 'comma', 'dot', 'slash']
+SYMBOLS = dict(zip(' -=[]\\;\'`,./', ['space'] + SYMBOL_KEYS))
+SHIFTED = dict(zip('!@#$%^&*()_+{}|:"~<>?', list('1234567890') + SYMBOL_KEYS))
+
+MAX_WAIT = OP_WAIT - 1
+
+
+class CompileError(Exception):
+    pass
+
+
+def mods_of(names):
+    mods = 0
+    for name in names:
+        name = MOD_ALIASES.get(name, name)
+        if name not in MODS:
+            raise CompileError('unknown modifier %r' % name)
+        mods |= MODS[name]
+    return mods
+
+
+def keycode(text):
+    """A key with optional mods+ in front, as a keycode (QK_MODS ones for chords)."""
+    *mods, key = text.lower().split('+')
+    if key.startswith('0x'):
+        code = int(key, 16)
+    elif key in KEYS:
+        code = KEYS[key]
+    else:
+        raise CompileError('unknown key %r' % key)
+    if not mods:
+        return code
+    mods = mods_of(mods)
+    if code > 0xFF:
+        raise CompileError('%r: only basic keys can have modifiers' % text)
+    if mods & 0x0F and mods & 0xF0:
+        raise CompileError('%r mixes left and right modifiers, a chord has one side' % text)
+    # QK_MODS: 4 bits of mods, and 0x10 for the right-hand ones
+    return (mods & 0x0F or mods >> 4 | 0x10) << 8 | code
+
+
+def typed(char):
+    if char.isalnum() and char.isascii():
+        code = KEYS[char.lower()]
+        return code | 0x200 if char.isupper() else code
+    if char in SYMBOLS:
+        return KEYS[SYMBOLS[char]]
+    if char in SHIFTED:
+        return KEYS[SHIFTED[char]] | 0x200
+    raise CompileError('type: no key for %r' % char)
+
+
+def key_op(name, code):
+    if code > 0xFF:
+        return bytes([OP[name + '16']]) + code.to_bytes(2, 'little')
+    return bytes([OP[name], code])
+
+
+def wait(ms):
+    code = bytearray()
+    while ms > MAX_WAIT:
+        chunk = min(ms, 0xFFFF)
+        code += bytes([OP['wait16']]) + chunk.to_bytes(2, 'little')
+        ms -= chunk
+    if ms:
+        code.append(OP_WAIT | ms)
+    return bytes(code)
+
+
+def number(text, low, high, what):
+    try:
+        value = int(text, 0)
+    except ValueError:
+        raise CompileError('%s: %r is not a number' % (what, text))
+    if not low <= value <= high:
+        raise CompileError('%s: %d is not within %d-%d' % (what, value, low, high))
+    return value
+
+
+def compile_text(lines):
+    """Macros as tdm_container.pack takes them, from the lines of a program."""
+    macros = []
+    lines_of = {}
+    macro = None
+    depth = 0
+    for line_number, line in enumerate(lines, 1):
+        words = line.split('#', 1)[0].split()
+        if not words:
+            continue
+        statement, args = words[0].lower(), words[1:]
+        try:
+            if statement == 'macro':
+                if depth:
+                    raise CompileError('repeat without end before the next macro')
+                if not args:
+                    raise CompileError('macro needs a slot')
+                macro = {'slot': number(args[0], 0, 0xFFFF, 'slot'), 'bytecode': bytearray()}
+                for option in args[1:]:
+                    field, _, value = option.partition('=')
+                    limit = {'loop_gap_ms': 0xFFFF, 'debounce_ms': 0xFF, 'time_scale': 0xFF}.get(field)
+                    if limit is None:
+                        raise CompileError('unknown option %r' % field)
+                    macro[field] = number(value, 0, limit, field)
+                if any(m['slot'] == macro['slot'] for m in macros):
+                    raise CompileError('slot %d is already defined' % macro['slot'])
+                macros.append(macro)
+                lines_of[macro['slot']] = line_number
+                continue
+            if macro is None:
+                raise CompileError('%s before the first macro' % statement)
+            code = macro['bytecode']
+            if statement in ('press', 'release', 'tap'):
+                if not args:
+                    raise CompileError('%s needs keys' % statement)
+                for arg in args:
+                    code += key_op(statement, keycode(arg))
+            elif statement == 'type':
+                for char in ' '.join(args):
+                    code += key_op('tap', typed(char))
+            elif statement == 'wait':
+                code += wait(number(''.join(args[:1]), 0, 0xFFFFFFFF, 'wait'))
+            elif statement == 'mods':
+                code += bytes([OP['mods'], 0 if args == ['none'] else mods_of('+'.join(args).lower().split('+'))])
+            elif statement == 'repeat':
+                depth += 1
+                if depth > VM_DEPTH:
+                    raise CompileError('repeats nest %d deep at most' % VM_DEPTH)
+                code += bytes([OP['repeat'], number(''.join(args[:1]), 1, 0xFF, 'repeat')])
+            elif statement == 'end':
+                if not depth:
+                    raise CompileError('end without repeat')
+                depth -= 1
+                code.append(OP['next'])
+            elif statement == 'call':
+                code += bytes([OP['call']]) + number(''.join(args[:1]), 0, 0xFFFF, 'call').to_bytes(2, 'little')
+            else:
+                raise CompileError('unknown statement %r' % statement)
+        except CompileError as error:
+            raise CompileError('line %d: %s' % (line_number, error))
+    if depth:
+        raise CompileError('repeat without end at the end of the file')
+    slots = {m['slot'] for m in macros}
+    for macro in macros:
+        for offset, name, operand in tdm_container.instructions(macro['bytecode']):
+            if name == 'call' and operand not in slots:
+                raise CompileError('line %d: macro %d calls slot %d, which isn\'t compiled' % (lines_of[macro['slot']], macro['slot'], operand))
+        macro['bytecode'].append(OP['end'])
+    programs = {m['slot']: bytes(m['bytecode']) for m in macros}
+    for macro in macros:
+        problems = tdm_container.run_problems(programs[macro['slot']], programs)[0]
+        if problems:
+            raise CompileError('line %d: macro %d %s' % (lines_of[macro['slot']], macro['slot'], problems[0]))
+    return macros
+
+
+def disassemble(code):
+    depth = 0
+    for offset, name, operand in tdm_container.instructions(code):
+        if name == 'next':
+            depth -= 1
+        text = name if operand is None else '%s %d' % (name, operand)
+        if name in ('press', 'release', 'tap', 'press16', 'release16', 'tap16'):
+            text = '%s 0x%04x' % (name, operand)
+        print('%5d  %s%s' % (offset, '    ' * depth, text))
+        if name == 'repeat':
+            depth += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('source', help='a program, or a container with --disassemble, stdin if -')
+    parser.add_argument('-o', '--output', help='the container to write')
+    parser.add_argument('--disassemble', action='store_true', help='print the bytecode of a container')
+    options = parser.parse_args()
+
+    if options.disassemble:
+        container = tdm_container.Container.open(options.source)
+        problems = container.problems()
+        if problems:
+            sys.exit('%s: %s' % (options.source, problems[0]))
+        for slot in container.slots():
+            if slot['kind'] == BYTECODE:
+                print('macro %d' % slot['slot'])
+                disassemble(container.bytecode(slot))
+        return
+
+    if not options.output:
+        parser.error('-o is needed to compile')
+    source = sys.stdin if options.source == '-' else open(options.source)
+    with source:
+        try:
+            macros = compile_text(source)
+        except CompileError as error:
+            sys.exit('%s: %s' % (options.source, error))
+    with open(options.output, 'wb') as f:
+        f.write(tdm_container.pack(macros))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,444 @@
+#!/usr/bin/env python3
+# Copyright 2024 Jack Bellinger
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Validates, lists, extracts and packs macro containers.
+
+The format is documented in tdm_container.h. Containers are mapped, not read,
+so checking or listing a large one doesn't copy it. Macros are extracted to and
+packed from JSON, one object per macro:
+
+    {"slot": 0, "loop_gap_ms": 0, "debounce_ms": 0, "time_scale": 0,
+     "events": [{"time": 0, "kind": "key", "keycode": 4, "pressed": true}, ...]}
+
+Timing fields of 0 keep the keyboard's config. Events may also have "repeat"
+and "interval" for runs. A bytecode macro has "bytecode", in hex, instead of
+events; tools/tdm_compile.py builds those from text, and pack works out how
+long they play. A macro with
+"compress": true (or all of them, with pack --compress) is stored LZ
+compressed, for keyboards built with TDM_LZ.
+
+    python3 tools/tdm_container.py validate macros.tdmc
+    python3 tools/tdm_container.py list macros.tdmc
+    python3 tools/tdm_container.py extract macros.tdmc --slot 3 > macro.json
+    python3 tools/tdm_container.py pack macros.json -o macros.tdmc --compress
+"""
+
+import argparse
+import json
+import mmap
+import struct
+import sys
+
+MAGIC = 0x434D4454
+VERSION = 3
+HEADER = struct.Struct('<IHHIHH')
+SLOT = struct.Struct('<HHIHBBB3x')
+EVENT = struct.Struct('<HHIBBBB')
+KINDS = ['key', 'motion', 'encoder', 'layer', 'mods']
+FLAG_PRESSED = 1
+EVENTS, BYTECODE, LZ = 0, 1, 2
+PROGRAM = struct.Struct('<I')
+LZ_HEADER = struct.Struct('<II')
+LZ_MATCH = 0x80
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x7F + LZ_MIN_MATCH
+LZ_MAX_LITERALS = 0x80
+LZ_WINDOW = 256
+
+# opcodes of tdm_container.h: name, operand bytes
+OPCODES = ['end', 'press', 'release', 'tap', 'press16', 'release16', 'tap16', 'mods', 'wait16', 'repeat', 'next', 'call']
+OPERANDS = {'end': 0, 'next': 0, 'press': 1, 'release': 1, 'tap': 1, 'mods': 1, 'repeat': 1}
+OP_WAIT = 0x80
+VM_DEPTH = 8
+VM_STEPS = 0xFFFF
+
+
+def instructions(code):
+    """(offset, name, operand) of each instruction, a short wait is ('wait', ms)."""
+    i = 0
+    while i < len(code):
+        op = code[i]
+        if op & OP_WAIT:
+            yield i, 'wait', op & ~OP_WAIT
+            i += 1
+            continue
+        if op >= len(OPCODES):
+            raise ValueError('unknown opcode %02x at %d' % (op, i))
+        name = OPCODES[op]
+        size = OPERANDS.get(name, 2)
+        if i + 1 + size > len(code):
+            raise ValueError('%s at %d is cut short' % (name, i))
+        yield i, name, int.from_bytes(code[i + 1:i + 1 + size], 'little') if size else None
+        i += 1 + size
+
+
+def bytecode_problems(code):
+    """What the firmware checks at mount, see tdm_bytecode_check."""
+    depth = 0
+    try:
+        for offset, name, operand in instructions(code):
+            if name == 'repeat':
+                depth += 1
+                if depth > VM_DEPTH or operand == 0:
+                    return ['repeat at %d: nested too deep or 0 times' % offset]
+            elif name == 'next':
+                if depth == 0:
+                    return ['next at %d closes no repeat' % offset]
+                depth -= 1
+            elif name == 'end' and depth == 0:
+                return [] if offset + 1 == len(code) else ['code after the final end at %d' % offset]
+    except ValueError as error:
+        return [str(error)]
+    return ['no final end']
+
+
+def run_cost(code, programs, depth=0):
+    """(instructions, ms, stopped) of one run of a program as the VM plays it: repeats and the
+    programs of calls (programs maps slots to their code) included. stopped is set where the VM
+    stops the whole macro, at a repeat or call past VM_DEPTH or a call to a slot with no program.
+    The counts are worked out, not played, so they can go well past VM_STEPS."""
+    ops = list(instructions(code))
+
+    def block(i, depth):
+        # from instruction i to the next that closes the block or the end that returns:
+        # (instructions, ms, the instruction after, None, 'end' or 'stop')
+        steps = ms = 0
+        while i < len(ops):
+            _, name, operand = ops[i]
+            steps += 1
+            i += 1
+            if name in ('wait', 'wait16'):
+                ms += operand
+            elif name == 'repeat':
+                if depth == VM_DEPTH:
+                    return steps, ms, i, 'stop'
+                body_steps, body_ms, i, how = block(i, depth + 1)
+                if how:  # left during the first run
+                    return steps + body_steps, ms + body_ms, i, how
+                steps += body_steps * operand
+                ms += body_ms * operand
+            elif name == 'next':
+                return steps, ms, i, None
+            elif name == 'call':
+                if depth == VM_DEPTH or operand not in programs:
+                    return steps, ms, i, 'stop'
+                call_steps, call_ms, stopped = run_cost(programs[operand], programs, depth + 1)
+                steps += call_steps
+                ms += call_ms
+                if stopped:
+                    return steps, ms, i, 'stop'
+            elif name == 'end':
+                return steps, ms, i, 'end'
+        return steps, ms, i, 'end'
+
+    steps, ms, _, how = block(0, depth)
+    return steps, ms, how == 'stop'
+
+
+def run_problems(code, programs):
+    """What makes the VM stop a program short, and its duration."""
+    steps, ms, stopped = run_cost(code, programs)
+    found = []
+    if stopped:
+        found.append('repeats and calls nest deeper than %d, or it calls a slot with no program' % VM_DEPTH)
+    if steps > VM_STEPS:
+        found.append('runs %d instructions, the keyboard stops it after %d' % (steps, VM_STEPS))
+    return found, ms
+
+
+def lz_compress(data):
+    """Greedy LZ77 over the window, with a chain of earlier positions per 3 bytes."""
+    out = bytearray()
+    literals = bytearray()
+    chains = {}
+
+    def flush():
+        for start in range(0, len(literals), LZ_MAX_LITERALS):
+            run = literals[start:start + LZ_MAX_LITERALS]
+            out.append(len(run) - 1)
+            out.extend(run)
+        literals.clear()
+
+    i = 0
+    while i < len(data):
+        best, distance = 0, 0
+        for candidate in reversed(chains.get(bytes(data[i:i + LZ_MIN_MATCH]), ())):
+            if i - candidate > LZ_WINDOW:
+                break
+            length = 0
+            while length < LZ_MAX_MATCH and i + length < len(data) and data[i + length] == data[candidate + length]:
+                length += 1
+            if length > best:
+                best, distance = length, i - candidate
+        step = best if best >= LZ_MIN_MATCH else 1
+        for position in range(i, i + step):
+            chains.setdefault(bytes(data[position:position + LZ_MIN_MATCH]), []).append(position)
+        if step == 1:
+            literals.append(data[i])
+        else:
+            flush()
+            out += bytes([LZ_MATCH | best - LZ_MIN_MATCH, distance - 1])
+        i += step
+    flush()
+    return bytes(out)
+
+
+def lz_decompress(tokens, size):
+    """The size bytes the tokens decode to, what tdm_lz_check refuses raises ValueError."""
+    out = bytearray()
+    i = 0
+    while i < len(tokens):
+        token = tokens[i]
+        if token & LZ_MATCH:
+            if i + 2 > len(tokens) or tokens[i + 1] + 1 > len(out):
+                raise ValueError('match at %d reaches before the start' % i)
+            start = len(out) - tokens[i + 1] - 1
+            for j in range((token & ~LZ_MATCH) + LZ_MIN_MATCH):
+                out.append(out[start + j])
+            i += 2
+        else:
+            if i + 2 + token > len(tokens):
+                raise ValueError('literals at %d are cut short' % i)
+            out += tokens[i + 1:i + 2 + token]
+            i += 2 + token
+    if len(out) != size:
+        raise ValueError('decodes to %d bytes instead of %d' % (len(out), size))
+    return bytes(out)
+
+
+def crc16(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class Container:
+    """A container image in a bytes-like object, parsed in place."""
+
+    def __init__(self, data):
+        self.data = memoryview(data)
+        if len(self.data) < HEADER.size:
+            raise ValueError('shorter than the header')
+        (self.magic, self.version, self.slot_count, self.size, self.event_size,
+         self.crc) = HEADER.unpack_from(self.data)
+
+    @classmethod
+    def open(cls, path):
+        with open(path, 'rb') as f:
+            return cls(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+
+    def slots(self):
+        for i in range(self.slot_count):
+            slot, length, offset, loop_gap, debounce, scale, kind = SLOT.unpack_from(self.data, HEADER.size + i * SLOT.size)
+            yield {'slot': slot, 'length': length, 'offset': offset, 'kind': kind,
+                   'loop_gap_ms': loop_gap, 'debounce_ms': debounce, 'time_scale': scale}
+
+    def bytecode(self, slot):
+        start = slot['offset'] + PROGRAM.size
+        return bytes(self.data[start:start + slot['length']])
+
+    def program_duration(self, slot):
+        return PROGRAM.unpack_from(self.data, slot['offset'])[0]
+
+    def programs(self):
+        return {slot['slot']: self.bytecode(slot) for slot in self.slots() if slot['kind'] == BYTECODE}
+
+    def lz(self, slot):
+        """The header and tokens of a compressed macro."""
+        if slot['offset'] + LZ_HEADER.size > self.size:
+            raise ValueError('past the end')
+        packed, ms = LZ_HEADER.unpack_from(self.data, slot['offset'])
+        start = slot['offset'] + LZ_HEADER.size
+        if start + packed > self.size:
+            raise ValueError('%d bytes of tokens go past the end' % packed)
+        return ms, bytes(self.data[start:start + packed])
+
+    def events(self, slot):
+        data, offset, time = self.data, slot['offset'], 0
+        if slot['kind'] == LZ:
+            data, offset = lz_decompress(self.lz(slot)[1], slot['length'] * EVENT.size), 0
+        for i in range(slot['length']):
+            keycode, _, delta, flags, repeat, interval, _ = EVENT.unpack_from(data, offset + i * EVENT.size)
+            time = time + delta if slot['kind'] == LZ else delta
+            yield keycode, time, flags, repeat, interval
+
+    def problems(self):
+        """Everything the firmware would refuse, and what it doesn't check itself."""
+        if self.magic != MAGIC:
+            return ['not a container (magic %08x)' % self.magic]
+        if self.version != VERSION:
+            return ['version %d, this tool reads %d' % (self.version, VERSION)]
+        if self.event_size != EVENT.size:
+            return ['events of %d bytes, expected %d' % (self.event_size, EVENT.size)]
+        if self.size > len(self.data) or self.size < HEADER.size + self.slot_count * SLOT.size:
+            return ['size %d, but the file has %d bytes' % (self.size, len(self.data))]
+        found = []
+        previous = -1
+        programs = {}
+        for slot in self.slots():
+            if slot['kind'] == BYTECODE and slot['offset'] + PROGRAM.size + slot['length'] <= self.size:
+                programs[slot['slot']] = self.bytecode(slot)
+        for slot in self.slots():
+            name = 'slot %d' % slot['slot']
+            if slot['slot'] <= previous:
+                found.append('%s: slots must be sorted and unique' % name)
+            previous = slot['slot']
+            size = {EVENTS: slot['length'] * EVENT.size, LZ: LZ_HEADER.size}.get(slot['kind'], PROGRAM.size + slot['length'])
+            if slot['offset'] % 4 or slot['offset'] + size > self.size:
+                found.append('%s: macro at %d is misaligned or past the end' % (name, slot['offset']))
+                continue
+            if slot['kind'] == BYTECODE:
+                problems = bytecode_problems(self.bytecode(slot))
+                if not problems:
+                    problems, ms = run_problems(self.bytecode(slot), programs)
+                    if ms != self.program_duration(slot):
+                        problems.append('the duration doesn\'t match the program')
+                found += ['%s: %s' % (name, problem) for problem in problems]
+                continue
+            if slot['kind'] not in (EVENTS, LZ):
+                found.append('%s: unknown kind %d' % (name, slot['kind']))
+                continue
+            try:
+                events = list(self.events(slot))
+            except ValueError as error:
+                found.append('%s: %s' % (name, error))
+                continue
+            last = 0
+            for index, (_, time, flags, _, _) in enumerate(events):
+                if time < last:
+                    found.append('%s: event %d plays before the one ahead of it' % (name, index))
+                if (flags >> 1) >= len(KINDS) or flags >> 4:
+                    found.append('%s: event %d has unknown flags %02x' % (name, index, flags))
+                last = time
+            if slot['kind'] == LZ and self.lz(slot)[0] != duration(events):
+                found.append('%s: the duration doesn\'t match the events' % name)
+        if crc16(self.data[HEADER.size:self.size]) != self.crc:
+            found.append('CRC mismatch')
+        return found
+
+    def macro(self, slot):
+        timing = {'loop_gap_ms': slot['loop_gap_ms'], 'debounce_ms': slot['debounce_ms'], 'time_scale': slot['time_scale']}
+        if slot['kind'] == BYTECODE:
+            return dict(slot=slot['slot'], bytecode=self.bytecode(slot).hex(), **timing)
+        events = []
+        for keycode, time, flags, repeat, interval in self.events(slot):
+            event = {'time': time, 'kind': KINDS[(flags >> 1) % len(KINDS)], 'keycode': keycode,
+                     'pressed': bool(flags & FLAG_PRESSED)}
+            if repeat:
+                event.update(repeat=repeat, interval=interval)
+            events.append(event)
+        if slot['kind'] == LZ:
+            timing['compress'] = True
+        return dict(slot=slot['slot'], events=events, **timing)
+
+
+def duration(events):
+    return max((time + repeat * interval for _, time, _, repeat, interval in events), default=0)
+
+
+def pack(macros, compress=False):
+    """Builds an image from macros as extracted, in any slot order."""
+    macros = sorted(macros, key=lambda m: m['slot'])
+    programs = {m['slot']: bytes.fromhex(m['bytecode']) if isinstance(m['bytecode'], str) else bytes(m['bytecode'])
+                for m in macros if 'bytecode' in m}
+    offset = HEADER.size + len(macros) * SLOT.size
+    index = bytearray()
+    body = bytearray()
+    for macro in macros:
+        timing = (macro.get('loop_gap_ms', 0), macro.get('debounce_ms', 0), macro.get('time_scale', 0))
+        if 'bytecode' in macro:
+            code = programs[macro['slot']]
+            index += SLOT.pack(macro['slot'], len(code), offset + len(body), *timing, BYTECODE)
+            body += PROGRAM.pack(run_cost(code, programs)[1]) + code
+            body += bytes(-len(body) % 4)  # the next macro starts aligned
+            continue
+        events = macro['events']
+        lz = macro.get('compress', compress)
+        index += SLOT.pack(macro['slot'], len(events), offset + len(body), *timing, LZ if lz else EVENTS)
+        data = bytearray()
+        last = 0
+        for event in events:
+            flags = KINDS.index(event.get('kind', 'key')) << 1 | (FLAG_PRESSED if event.get('pressed') else 0)
+            data += EVENT.pack(event['keycode'], 0, event['time'] - last if lz else event['time'], flags,
+                               event.get('repeat', 0), event.get('interval', 0), 0)
+            last = event['time']  # compressed times are deltas, so repeated patterns match
+        if lz:
+            tokens = lz_compress(data)
+            end = max((e['time'] + e.get('repeat', 0) * e.get('interval', 0) for e in events), default=0)
+            data = LZ_HEADER.pack(len(tokens), end) + tokens
+            data += bytes(-len(data) % 4)
+        body += data
+    payload = bytes(index + body)
+    return HEADER.pack(MAGIC, VERSION, len(macros), HEADER.size + len(payload), EVENT.size, crc16(payload)) + payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest='command', required=True)
+    commands.add_parser('validate').add_argument('container')
+    commands.add_parser('list').add_argument('container')
+    extract = commands.add_parser('extract')
+    extract.add_argument('container')
+    extract.add_argument('--slot', type=int, help='only this slot, all of them as a list if omitted')
+    packer = commands.add_parser('pack')
+    packer.add_argument('json', help='a macro or a list of them, stdin if -')
+    packer.add_argument('-o', '--output', required=True)
+    packer.add_argument('--compress', action='store_true', help='compress every macro of events')
+    options = parser.parse_args()
+
+    if options.command == 'pack':
+        source = sys.stdin if options.json == '-' else open(options.json)
+        with source:
+            macros = json.load(source)
+        with open(options.output, 'wb') as f:
+            f.write(pack(macros if isinstance(macros, list) else [macros], options.compress))
+        return
+
+    container = Container.open(options.container)
+    problems = container.problems()
+    if options.command == 'validate':
+        for problem in problems:
+            print(problem)
+        sys.exit(1 if problems else 0)
+    if problems:
+        sys.exit('%s: %s' % (options.container, problems[0]))
+    if options.command == 'list':
+        for slot in container.slots():
+            if slot['kind'] == BYTECODE:
+                steps = run_cost(container.bytecode(slot), container.programs())[0]
+                print('slot %d: %d bytes of bytecode, %d ms, %d instructions' % (
+                    slot['slot'], slot['length'], container.program_duration(slot), steps))
+                continue
+            events = list(container.events(slot))
+            line = 'slot %d: %d events, %d ms' % (slot['slot'], slot['length'], duration(events))
+            if slot['kind'] == LZ:
+                packed = LZ_HEADER.size + len(container.lz(slot)[1])
+                line += ', compressed %d to %d bytes (%.1fx)' % (
+                    slot['length'] * EVENT.size, packed, slot['length'] * EVENT.size / max(packed, 1))
+            print(line)
+    else:
+        macros = [container.macro(slot) for slot in container.slots()
+                  if options.slot is None or slot['slot'] == options.slot]
+        if options.slot is not None and not macros:
+            sys.exit('no slot %d in %s' % (options.slot, options.container))
+        json.dump(macros[0] if options.slot is not None else macros, sys.stdout, indent=1)
+        print()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# Copyright 2024 Jack Bellinger
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Decodes the binary log of a firmware built with TDM_LOG_BINARY.
+
+Reads the captured console output (a file, or stdin) and prints it with every
+log frame replaced by its message, using the table in tdm_log.h. Anything that
+isn't a frame is passed through untouched.
+
+    python3 tools/tdm_log_decode.py console.bin
+    python3 tools/tdm_log_decode.py --header path/to/tdm_log.h < console.bin
+"""
+
+import argparse
+import codecs
+import os
+import re
+import struct
+import sys
+
+FRAME_START = 0xFE
+FORMAT = re.compile(r'#define TDM_LOG_FORMAT_(\w+)\s+"((?:[^"\\]|\\.)*)"')
+MESSAGE = re.compile(r'X\((\w+)\)')
+SPECIFIER = re.compile(r'%([-+ 0#]*\d*)l*([diuxXc%])')
+
+
+def load_formats(header):
+    with open(header) as f:
+        table = f.read()
+    formats = {name: codecs.decode(text, 'unicode_escape') for name, text in FORMAT.findall(table)}
+    # an ID is the message's position in TDM_LOG_MESSAGES
+    names = MESSAGE.findall(table[table.index('#define TDM_LOG_MESSAGES'):])
+    return [(name, formats[name]) for name in names]
+
+
+def argument_count(text):
+    return sum(1 for m in SPECIFIER.finditer(text) if m.group(2) != '%')
+
+
+def format_message(text, args):
+    args = iter(args)
+
+    def convert(m):
+        flags, kind = m.groups()
+        if kind == '%':
+            return '%'
+        value = next(args)
+        if kind in 'uxX':
+            value &= 0xFFFFFFFF
+        if kind == 'c':
+            return chr(value & 0xFF)
+        return ('%' + flags + ('d' if kind in 'iu' else kind)) % value
+
+    return SPECIFIER.sub(convert, text)
+
+
+def decode(data, formats, out):
+    i = 0
+    while i < len(data):
+        if data[i] == FRAME_START and i + 3 <= len(data):
+            message, count = data[i + 1], data[i + 2]
+            end = i + 3 + 4 * count
+            if message < len(formats) and argument_count(formats[message][1]) == count and end <= len(data):
+                args = struct.unpack('<%di' % count, data[i + 3:end])
+                out.write(format_message(formats[message][1], args))
+                i = end
+                continue
+        out.write(chr(data[i]))
+        i += 1
+
+
+def main():
+    default_header = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'tdm_log.h')
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('capture', nargs='?', help='captured console output, stdin if omitted')
+    parser.add_argument('--header', default=default_header, help='the tdm_log.h the firmware was built with')
+    options = parser.parse_args()
+
+    formats = load_formats(options.header)
+    if options.capture:
+        with open(options.capture, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+    decode(data, formats, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()